@@ -12,6 +12,7 @@ struct Block {
   SIZE_T 	length;
   double        lastaccessed;  // for use in buffercache only
   bool          dirty;         // for use in buffercahce only
+  SIZE_T        pincount;      // for use in buffercache only
 
   Block();
   Block(const SIZE_T size);
@@ -1,4 +1,7 @@
 #include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <algorithm>
 #include "btree.h"
 
 #define RETURNIFERROR(rc) if(rc) {return rc;}
@@ -34,13 +37,46 @@ BTreeIndex::BTreeIndex(SIZE_T keysize,
 {
   superblock.info.keysize=keysize;
   superblock.info.valuesize=valuesize;
+  superblock.info.options=0;
+  superblock.info.prefixlen=0;
+  superblock.info.zerotail=0;
+  superblock.info.heaptop=0;
+  superblock.info.bigvaluesize=0;
+  superblock.info.runvalues=0;
   buffercache=cache;
-  // note: ignoring unique now
+  superblockdirty=false;
+  checkpointinterval=0;
+  changessincecheckpoint=0;
+  extentsize=16;
+  nodecachesize=0;
+  nodecache=0;
+  pinlevels=0;
+  pinbytes=0;
+  pinsstale=true;
+  if (!unique) { 
+    superblock.info.options|=BTREE_OPT_NONUNIQUE;
+    superblock.info.runvalues= valuesize>0 ? max((SIZE_T)2,BTREE_RUN_INLINE/valuesize) : 2;
+    superblock.info.valuesize=BTREE_RUN_HEADER+superblock.info.runvalues*valuesize;
+  }
 }
 
 BTreeIndex::BTreeIndex()
 {
-  // shouldn't have to do anything
+  superblock.info.options=0;
+  superblock.info.prefixlen=0;
+  superblock.info.zerotail=0;
+  superblock.info.heaptop=0;
+  superblock.info.bigvaluesize=0;
+  superblock.info.runvalues=0;
+  superblockdirty=false;
+  checkpointinterval=0;
+  changessincecheckpoint=0;
+  extentsize=16;
+  nodecachesize=0;
+  nodecache=0;
+  pinlevels=0;
+  pinbytes=0;
+  pinsstale=true;
 }
 
 
@@ -52,832 +88,3391 @@ BTreeIndex::BTreeIndex(const BTreeIndex &rhs)
   buffercache=rhs.buffercache;
   superblock_index=rhs.superblock_index;
   superblock=rhs.superblock;
+  superblockdirty=false;
+  checkpointinterval=rhs.checkpointinterval;
+  changessincecheckpoint=0;
+  extentsize=rhs.extentsize;
+  nodecachesize=rhs.nodecachesize;
+  nodecache=0;
+  pinlevels=rhs.pinlevels;
+  pinbytes=rhs.pinbytes;
+  pinsstale=true;
 }
 
 BTreeIndex::~BTreeIndex()
 {
-  // shouldn't have to do anything
+  UnpinUpperLevels();
+  delete nodecache;
 }
 
 
 BTreeIndex & BTreeIndex::operator=(const BTreeIndex &rhs)
 {
+  UnpinUpperLevels();
+  delete nodecache;
   return *(new(this)BTreeIndex(rhs));
 }
 
 
-ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
-{
-  n=superblock.info.freelist;
+BTreeExtent::BTreeExtent() : level(0), next(0), end(0)
+{}
 
-  if (n==0) { 
-    return ERROR_NOSPACE;
-  }
 
-  BTreeNode node;
+BTreeRightmost::BTreeRightmost() : valid(false), leaf(0), hasfence(false)
+{}
 
-  node.Unserialize(buffercache,n);
 
-  assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
+// How many extents either side of a block FindExtent looks at
+#define EXTENT_SEARCH 4
 
-  superblock.info.freelist=node.info.freelist;
+// The level whose extents hold overflow blocks, of runs or of big 
+// values, above any level of nodes
+#define OVERFLOW_LEVEL 64
 
-  superblock.Serialize(buffercache,superblock_index);
+static SIZE_T BlockDistance(const SIZE_T a, const SIZE_T b)
+{
+  return a>b ? a-b : b-a;
+}
 
-  buffercache->NotifyAllocateBlock(n);
 
-  return ERROR_NOERROR;
+//
+// First block of the extent of the given level closest to block that
+// still has room, looking at most a few extents either way; 0 if none.
+// Full extents count towards the few, so this stays in block's
+// neighbourhood rather than wandering off to wherever there is room.
+//
+SIZE_T BTreeIndex::FindExtent(const SIZE_T block, const SIZE_T level) const
+{
+  map<SIZE_T,BTreeExtent>::const_iterator up=extents.upper_bound(block);
+  map<SIZE_T,BTreeExtent>::const_iterator down=up;
+  SIZE_T best=0;
+  SIZE_T bestdistance=0;
+
+  if (block==0) { 
+    return 0;
+  }
+  for (int i=0; i<EXTENT_SEARCH; i++) { 
+    if (down!=extents.begin()) { 
+      --down;
+      if (down->second.level==level && down->second.next<down->second.end) { 
+	SIZE_T d=BlockDistance(down->second.next,block);
+	if (best==0 || d<bestdistance) { 
+	  best=down->first;
+	  bestdistance=d;
+	}
+      }
+    }
+    if (up!=extents.end()) { 
+      if (up->second.level==level && up->second.next<up->second.end) { 
+	SIZE_T d=BlockDistance(up->second.next,block);
+	if (best==0 || d<bestdistance) { 
+	  best=up->first;
+	  bestdistance=d;
+	}
+      }
+      ++up;
+    }
+  }
+  return best;
 }
 
 
-ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
+ERROR_T BTreeIndex::TakeFromExtent(const SIZE_T start, SIZE_T &n)
 {
-  BTreeNode node;
+  ERROR_T rc;
 
-  node.Unserialize(buffercache,n);
+  n=extents[start].next++;
+  rc=buffercache->NotifyAllocateBlock(n);
+  RETURNIFERROR(rc)
+  // the extents are kept in the superblock
+  return SuperblockChanged();
+}
 
-  assert(node.info.nodetype!=BTREE_UNALLOCATED_BLOCK);
 
-  node.info.nodetype=BTREE_UNALLOCATED_BLOCK;
+//
+// Blocks come from two places.  The free list holds blocks given back
+// by DeallocateNode.  Blocks at or above the high water mark have never
+// been used; they are handed out in extents that each serve one
+// neighbourhood of one level of the tree.  A node split from near goes
+// into near's extent while it has room, so nodes next to each other in
+// key order tend to share an extent.  Once that is full, it goes to
+// whichever is closest to near of the free list head, a nearby extent
+// of its level, and a fresh extent.  Without a hint, the free list
+// head, the extent the level opened last, and a fresh extent are 
+// tried in that order.  When the unused space runs out, any extent
+// is drawn on.
+//
+ERROR_T BTreeIndex::AllocateNode(SIZE_T &n, const SIZE_T level, const SIZE_T near)
+{
+  SIZE_T numblocks=buffercache->GetNumBlocks();
+  SIZE_T start;
+  SIZE_T candidates[3];
+  int choice=-1;
 
-  node.info.freelist=superblock.info.freelist;
+  if (currentextent.size()<=level) { 
+    currentextent.resize(level+1,0);
+  }
+  if (level>0 && level!=OVERFLOW_LEVEL) { 
+    // a new interior node, perhaps in a pinned level
+    pinsstale=true;
+  }
 
-  node.Serialize(buffercache,n);
+  candidates[0]=superblock.info.freelist;
+  start=FindExtent(near!=0 ? near : currentextent[level],level);
+  candidates[1]= start!=0 ? extents[start].next : 0;
+  candidates[2]= superblock.info.highwater<numblocks ? superblock.info.highwater : 0;
 
-  superblock.info.freelist=n;
+  // The extent near is in wins outright while it has room
+  if (near!=0 && start!=0 && start<=near && near<extents[start].end) { 
+    return TakeFromExtent(start,n);
+  }
+
+  for (int i=0;i<3;i++) { 
+    if (candidates[i]!=0 && 
+	(choice<0 || 
+	 (near!=0 && BlockDistance(candidates[i],near)<BlockDistance(candidates[choice],near)))) { 
+      choice=i;
+    }
+  }
 
-  superblock.Serialize(buffercache,superblock_index);
+  switch (choice) { 
+  case 0: {
+    BTreeNode node;
 
-  buffercache->NotifyDeallocateBlock(n);
+    n=candidates[0];
 
-  return ERROR_NOERROR;
+    node.Unserialize(buffercache,n);
+
+    assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
+
+    superblock.info.freelist=node.info.freelist;
+
+    buffercache->NotifyAllocateBlock(n);
+
+    return SuperblockChanged();
+  }
+  case 1:
+    return TakeFromExtent(start,n);
+  case 2: {
+    start=superblock.info.highwater;
+    BTreeExtent &e=extents[start];
 
+    e.level=level;
+    e.next=start;
+    e.end= numblocks-start<extentsize ? numblocks : start+extentsize;
+    superblock.info.highwater=e.end;
+    currentextent[level]=start;
+    // which writes the new high water mark with the superblock
+    return TakeFromExtent(start,n);
+  }
+  default: {
+    map<SIZE_T,BTreeExtent>::iterator i;
+    for (i=extents.begin(); i!=extents.end(); ++i) { 
+      if (i->second.next<i->second.end) { 
+	return TakeFromExtent(i->first,n);
+      }
+    }
+    return ERROR_NOSPACE;
+  }
+  }
 }
 
-ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
+
+//
+// Hands the unused part of an extent back, lowering the high water 
+// mark if it ends there and putting it on the free list if not.  The
+// caller writes the superblock.
+//
+ERROR_T BTreeIndex::ReleaseExtent(const SIZE_T start)
 {
   ERROR_T rc;
+  BTreeExtent &e=extents[start];
 
-  superblock_index=initblock;
-  assert(superblock_index==0);
+  if (e.end==superblock.info.highwater) { 
+    superblock.info.highwater=e.next;
+    e.end=e.next;
+  }
+  while (e.next<e.end) { 
+    SIZE_T n=--e.end;
+    BTreeNode node(BTREE_UNALLOCATED_BLOCK,
+		   superblock.info.keysize,
+		   superblock.info.valuesize,
+		   superblock.info.blocksize);
+    node.info.rootnode=superblock.info.rootnode;
+    node.info.freelist=superblock.info.freelist;
+    rc=node.Serialize(buffercache,n);
+    RETURNIFERROR(rc)
+    superblock.info.freelist=n;
+  }
+  extents.erase(start);
+  superblockdirty=true;
+  return ERROR_NOERROR;
+}
 
-  if (create) {
-    // build a super block, root node, and a free space list
-    //
-    // Superblock at superblock_index
-    // root node at superblock_index+1
-    // free space list for rest
-    BTreeNode newsuperblock(BTREE_SUPERBLOCK,
-			    superblock.info.keysize,
-			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
-    newsuperblock.info.rootnode=superblock_index+1;
-    newsuperblock.info.freelist=superblock_index+2;
-    newsuperblock.info.numkeys=0;
 
-    buffercache->NotifyAllocateBlock(superblock_index);
+static bool MoreLeft(const pair<SIZE_T,BTreeExtent> &a, const pair<SIZE_T,BTreeExtent> &b)
+{
+  return a.second.end-a.second.next > b.second.end-b.second.next;
+}
 
-    rc=newsuperblock.Serialize(buffercache,superblock_index);
 
-    if (rc) { 
-      return rc;
+//
+// Writes the extents that still have room into the superblock, so the
+// next Attach carries on with them and a crash loses none of their 
+// blocks.  Full ones are forgotten.  Should more have room than fit,
+// those with the fewest blocks left give them back.
+//
+ERROR_T BTreeIndex::StoreExtents()
+{
+  ERROR_T rc;
+  SIZE_T most=(superblock.info.GetNumDataBytes()-3*sizeof(SIZE_T))/(4*sizeof(SIZE_T));
+  vector<pair<SIZE_T,BTreeExtent> > room;
+  map<SIZE_T,BTreeExtent>::iterator i;
+  char *p=superblock.data+sizeof(SIZE_T);
+  SIZE_T count;
+
+  for (i=extents.begin(); i!=extents.end(); ++i) { 
+    if (i->second.next<i->second.end) { 
+      room.push_back(*i);
     }
-    
-    BTreeNode newrootnode(BTREE_ROOT_NODE,
-			  superblock.info.keysize,
-			  superblock.info.valuesize,
-			  buffercache->GetBlockSize());
-    newrootnode.info.rootnode=superblock_index+1;
-    newrootnode.info.freelist=superblock_index+2;
-    newrootnode.info.numkeys=0;
+  }
+  sort(room.begin(),room.end(),MoreLeft);
+  while (room.size()>most) { 
+    rc=ReleaseExtent(room.back().first);
+    RETURNIFERROR(rc)
+    room.pop_back();
+  }
 
-    buffercache->NotifyAllocateBlock(superblock_index+1);
+  count=room.size();
+  memcpy(superblock.data,&count,sizeof(SIZE_T));
+  for (SIZE_T k=0;k<count;k++) { 
+    SIZE_T words[4]={room[k].first,room[k].second.level,room[k].second.next,room[k].second.end};
+    memcpy(p,words,sizeof(words));
+    p+=sizeof(words);
+  }
+  return ERROR_NOERROR;
+}
 
-    rc=newrootnode.Serialize(buffercache,superblock_index+1);
 
-    if (rc) { 
-      return rc;
-    }
+//
+// Takes up the extents StoreExtents left in the superblock
+//
+ERROR_T BTreeIndex::LoadExtents()
+{
+  SIZE_T most=(superblock.info.GetNumDataBytes()-3*sizeof(SIZE_T))/(4*sizeof(SIZE_T));
+  const char *p=superblock.data+sizeof(SIZE_T);
+  SIZE_T count;
 
-    for (SIZE_T i=superblock_index+2; i<buffercache->GetNumBlocks();i++) { 
-      BTreeNode newfreenode(BTREE_UNALLOCATED_BLOCK,
-			    superblock.info.keysize,
-			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
-      newfreenode.info.rootnode=superblock_index+1;
-      newfreenode.info.freelist= ((i+1)==buffercache->GetNumBlocks()) ? 0: i+1;
-      
-      rc = newfreenode.Serialize(buffercache,i);
+  extents.clear();
+  currentextent.clear();
+  memcpy(&count,superblock.data,sizeof(SIZE_T));
+  if (count>most) { 
+    return ERROR_INSANE;
+  }
+  for (SIZE_T k=0;k<count;k++) { 
+    SIZE_T words[4];
+    memcpy(words,p,sizeof(words));
+    p+=sizeof(words);
+    BTreeExtent &e=extents[words[0]];
+    e.level=words[1];
+    e.next=words[2];
+    e.end=words[3];
+  }
+  return ERROR_NOERROR;
+}
 
-      if (rc) {
-	return rc;
-      }
 
-    }
+ERROR_T BTreeIndex::SetSplitPolicy(const BTreeSplitPolicy policy)
+{
+  if (policy==BTREE_SPLIT_AT_INSERT) { 
+    superblock.info.options|=BTREE_OPT_SPLIT_AT_INSERT|BTREE_OPT_MAY_BE_UNDERFULL;
+  } else {
+    superblock.info.options&=~(SIZE_T)BTREE_OPT_SPLIT_AT_INSERT;
   }
+  return SuperblockChanged();
+}
 
-  // OK, now, mounting the btree is simply a matter of reading the superblock 
 
-  return superblock.Unserialize(buffercache,initblock);
+BTreeSplitPolicy BTreeIndex::GetSplitPolicy() const
+{
+  return (superblock.info.options & BTREE_OPT_SPLIT_AT_INSERT) ? BTREE_SPLIT_AT_INSERT : BTREE_SPLIT_MIDDLE;
 }
-    
 
-ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
+
+ERROR_T BTreeIndex::SetIntegerKeys()
 {
-  return superblock.Serialize(buffercache,superblock_index);
+  if (superblock.info.keysize!=4 && superblock.info.keysize!=8) { 
+    return ERROR_SIZE;
+  }
+  superblock.info.options|=BTREE_OPT_INT_KEYS;
+  return SuperblockChanged();
 }
- 
 
-ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
-					   const BTreeOp op,
-					   const KEY_T &key,
-					   VALUE_T &value)
+
+bool BTreeIndex::HasIntegerKeys() const
 {
-  BTreeNode b;
-  ERROR_T rc;
-  SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
+  return (superblock.info.options & BTREE_OPT_INT_KEYS)!=0;
+}
 
-  rc= b.Unserialize(buffercache,node);
 
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
+ERROR_T BTreeIndex::SetKeysApart()
+{
+  superblock.info.options|=BTREE_OPT_KEYS_APART;
+  return SuperblockChanged();
+}
+
+
+bool BTreeIndex::HasKeysApart() const
+{
+  return (superblock.info.options & BTREE_OPT_KEYS_APART)!=0;
+}
+
+
+ERROR_T BTreeIndex::SetKeyDirectory()
+{
+  superblock.info.options|=BTREE_OPT_KEY_DIRECTORY;
+  return SuperblockChanged();
+}
+
+
+bool BTreeIndex::HasKeyDirectory() const
+{
+  return (superblock.info.options & BTREE_OPT_KEY_DIRECTORY)!=0;
+}
+
+
+ERROR_T BTreeIndex::SetPrefixCompression()
+{
+  superblock.info.options|=BTREE_OPT_PREFIX;
+  return SuperblockChanged();
+}
+
+
+bool BTreeIndex::HasPrefixCompression() const
+{
+  return (superblock.info.options & BTREE_OPT_PREFIX)!=0;
+}
+
+
+ERROR_T BTreeIndex::SetSuffixTruncation()
+{
+  superblock.info.options|=BTREE_OPT_TRUNCATE;
+  return SuperblockChanged();
+}
+
+
+bool BTreeIndex::HasSuffixTruncation() const
+{
+  return (superblock.info.options & BTREE_OPT_TRUNCATE)!=0;
+}
+
+
+ERROR_T BTreeIndex::SetSlottedPages()
+{
+  NodeMetadata info=superblock.info;
+
+  // slot offsets and lengths are two bytes
+  info.blocksize=buffercache->GetBlockSize();
+  info.options|=BTREE_NODE_SLOTTED;
+  if (info.GetNumDataBytes()>0xffff || 
+      info.GetNumSlotsAsLeaf()<4 || info.GetNumSlotsAsInterior()<4) { 
+    return ERROR_SIZE;
   }
+  superblock.info.options|=BTREE_OPT_SLOTTED;
+  return SuperblockChanged();
+}
 
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-      if (b.info.numkeys == 0) {
-          rc = b.GetPtr(0, ptr);
-          RETURNIFERROR(rc)
-          return LookupOrUpdateInternal(ptr, op, key, value);
-      }
-  case BTREE_INTERIOR_NODE:
-    // Scan through key/ptr pairs
-    //and recurse if possible
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (key<testkey) {
-	// OK, so we now have the first key that's larger
-	// so we ned to recurse on the ptr immediately previous to 
-	// this one, if it exists
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	return LookupOrUpdateInternal(ptr,op,key,value);
-      }
-    }
-    // if we got here, we need to go to the next pointer, if it exists
-    if (b.info.numkeys>0) { 
-      rc=b.GetPtr(b.info.numkeys,ptr);
-      if (rc) { return rc; }
-      return LookupOrUpdateInternal(ptr,op,key,value);
-    } else {
-      // There are no keys at all on this node, so nowhere to go
-      return ERROR_NONEXISTENT;
-    }
-    break;
-  case BTREE_LEAF_NODE:
-    // Scan through keys looking for matching value
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (testkey==key) { 
-	    if (op==BTREE_OP_LOOKUP) {
-	        return b.GetVal(offset,value);
-	    } else if (op==BTREE_OP_UPDATE) {
-	        // BTREE_OP_UPDATE
-            rc = b.SetVal(offset, value);
-            RETURNIFERROR(rc)
-                return b.Serialize(buffercache, node);
 
-	    } else {
-            return ERROR_INSANE;
-        }
+bool BTreeIndex::HasSlottedPages() const
+{
+  return (superblock.info.options & BTREE_OPT_SLOTTED)!=0;
+}
+
 
-      }
-    }
-    return ERROR_NONEXISTENT;
-  default:
-    // We can't be looking at anything other than a root, internal, or leaf
-    return ERROR_INSANE;
-    break;
-  }  
+ERROR_T BTreeIndex::SetBigValues(const SIZE_T threshold)
+{
+  if (HasBigValues() || superblock.info.valuesize<=threshold) { 
+    return ERROR_NOERROR;
+  }
+  superblock.info.options|=BTREE_OPT_BIG_VALUES;
+  superblock.info.bigvaluesize=superblock.info.valuesize;
+  superblock.info.valuesize=BTREE_BIG_VALUE_STUB;
+  return SuperblockChanged();
+}
 
-  return ERROR_INSANE;
+
+bool BTreeIndex::HasBigValues() const
+{
+  return (superblock.info.options & BTREE_OPT_BIG_VALUES)!=0;
 }
 
-ERROR_T BTreeIndex::InsertKeyPtr(SIZE_T &node, KEY_T &key, SIZE_T &ptr) {
-    BTreeNode b;
-    ERROR_T rc;
-    SIZE_T offset;
-    SIZE_T temp;
-    KEY_T testkey;
-    SIZE_T tempptr;
-
-    rc = b.Unserialize(buffercache, node);
-    RETURNIFERROR(rc)
-
-    switch (b.info.nodetype) {
-        case BTREE_ROOT_NODE: {
-            SIZE_T maxsize = b.info.GetNumSlotsAsInterior();
-            // root node split special case
-            if (b.info.numkeys >= maxsize) {
-                SIZE_T leftptr;
-                SIZE_T rightptr;
-
-                rc = AllocateNode(leftptr);
-                RETURNIFERROR(rc)
-                rc = AllocateNode(rightptr);
-                RETURNIFERROR(rc)
-
-                BTreeNode leftnode(BTREE_INTERIOR_NODE,
-                                   superblock.info.keysize,
-                                   superblock.info.valuesize,
-                                   superblock.info.blocksize);
-                BTreeNode rightnode(BTREE_INTERIOR_NODE,
-                                    superblock.info.keysize,
-                                    superblock.info.valuesize,
-                                    superblock.info.blocksize);
-                rc = leftnode.Serialize(buffercache, leftptr);
-                RETURNIFERROR(rc)
-                rc = rightnode.Serialize(buffercache, rightptr);
-                RETURNIFERROR(rc)
-
-                SIZE_T halfsize = (maxsize + 1) / 2;
-                SIZE_T movedcount = 0;
-                SIZE_T insertmoved = 0;
-                SIZE_T rootkeymoved = 0;
-                SIZE_T splitnodeoffset = 0;
-                KEY_T *keys = new KEY_T[maxsize+1];
-                SIZE_T *ptrs = new SIZE_T[maxsize+1];
-                for (offset=0; offset<b.info.numkeys; offset++) {
-                    rc = b.GetKey(offset, *(keys+offset+insertmoved));
-                    RETURNIFERROR(rc)
-                    rc = b.GetPtr(offset+1, *(ptrs+offset+insertmoved));
-                    RETURNIFERROR(rc)
-                    if (keys[offset+insertmoved] > key && !insertmoved) {
-                        *(keys+offset+insertmoved) = key;
-                        *(ptrs+offset+insertmoved) = ptr;
-                        insertmoved = 1;
-                        rc = b.GetKey(offset, *(keys+offset+insertmoved));
-                        RETURNIFERROR(rc)
-                        rc = b.GetPtr(offset+1, *(ptrs+offset+insertmoved));
-                        RETURNIFERROR(rc)
-                    } else if (keys[offset+insertmoved] == key) {
-                        return ERROR_CONFLICT;
-                    }
-
-                }
-                if (!insertmoved) {
-                    *(keys+offset+insertmoved) = key;
-                    *(ptrs+offset+insertmoved) = ptr;
-                }
-                b.info.numkeys = 0;
-                // set 0 ptr for left node
-                rc = b.GetPtr(0, tempptr);
-                RETURNIFERROR(rc)
-                rc = leftnode.SetPtr(0, tempptr);
-                RETURNIFERROR(rc)
-                for (offset=0; offset<maxsize+1; offset++) {
-                    if (movedcount < halfsize) {
-                        leftnode.info.numkeys++;
-                        rc = leftnode.SetKey(offset, *(keys+offset));
-                        RETURNIFERROR(rc)
-                        rc = leftnode.SetPtr(offset+1, *(ptrs+offset));
-                        RETURNIFERROR(rc)
-                    } else {
-                        if (!rootkeymoved) {
-                            // propagate key to root node
-                            b.info.numkeys++;
-                            rc = b.SetKey(0, *(keys+offset));
-                            RETURNIFERROR(rc)
-                            // set 0 ptr for right node
-                            rc = rightnode.SetPtr(0, *(ptrs+offset));
-                            RETURNIFERROR(rc)
-                            rootkeymoved = 1;
-                            continue;
-                        }
-                        rightnode.info.numkeys++;
-                        rc = rightnode.SetKey(splitnodeoffset++, *(keys+offset));
-                        RETURNIFERROR(rc)
-                        rc = rightnode.SetPtr(splitnodeoffset, *(ptrs+offset));
-                        RETURNIFERROR(rc)
-                    }
-                    movedcount++;
-                }
-                rc = b.SetPtr(0, leftptr);
-                RETURNIFERROR(rc)
-                rc = b.SetPtr(1, rightptr);
-                RETURNIFERROR(rc)
-
-                // Serialize back to buffer
-                rc = leftnode.Serialize(buffercache, leftptr);
-                RETURNIFERROR(rc)
-                rc = rightnode.Serialize(buffercache, rightptr);
-                RETURNIFERROR(rc)
-                return b.Serialize(buffercache, node);
-            }
-        }
-        case BTREE_INTERIOR_NODE: {
-            SIZE_T maxsize = b.info.GetNumSlotsAsInterior();
-            if (b.info.numkeys < maxsize) {
-                b.info.numkeys++;
-                for (offset=0;offset<b.info.numkeys-1;offset++) {
-                    rc = b.GetKey(offset, testkey);
-                    RETURNIFERROR(rc)
-                    if (key < testkey) {
-                        for (temp=b.info.numkeys-2; temp>=offset; temp--) {
-                            rc = b.GetPtr(temp+1, tempptr);
-                            RETURNIFERROR(rc)
-                            rc = b.GetKey(temp, testkey);
-                            RETURNIFERROR(rc)
-                            rc = b.SetKey(temp+1, testkey);
-                            RETURNIFERROR(rc)
-                            rc = b.SetPtr(temp+2, tempptr);
-                            RETURNIFERROR(rc)
-                            if (temp == 0) {
-                                break;
-                            }
-                        }
-                        break;
-
-                    } else if (key == testkey) {
-                        return ERROR_CONFLICT;
-                    }
-                }
-                rc = b.SetKey(offset, key);
-                RETURNIFERROR(rc)
-                rc = b.SetPtr(offset+1, ptr);
-                RETURNIFERROR(rc)
-                return b.Serialize(buffercache, node);
-            } else {
-                cerr << "Maximum num of keys in interior" << endl;
-                SIZE_T splitnodeptr;
-                rc = AllocateNode(splitnodeptr);
-                RETURNIFERROR(rc)
-
-                BTreeNode splitnode(BTREE_INTERIOR_NODE,
-                                    superblock.info.keysize,
-                                    superblock.info.valuesize,
-                                    superblock.info.blocksize);
-                rc = splitnode.Serialize(buffercache, splitnodeptr);
-                RETURNIFERROR(rc)
-
-                SIZE_T halfsize = (maxsize + 1) / 2;
-                SIZE_T movedcount = 0;
-                SIZE_T insertmoved = 0;
-                SIZE_T splitnodeoffset = 0;
-                SIZE_T splitfirstptr = 0;
-                KEY_T *keys = new KEY_T[maxsize+1];
-                SIZE_T *ptrs = new SIZE_T[maxsize+1];
-                for (offset=0; offset<b.info.numkeys; offset++) {
-                    rc = b.GetKey(offset, *(keys+offset+insertmoved));
-                    RETURNIFERROR(rc)
-                    rc = b.GetPtr(offset+1, *(ptrs+offset+insertmoved));
-                    RETURNIFERROR(rc)
-                    if (keys[offset+insertmoved] > key && !insertmoved) {
-                        *(keys+offset+insertmoved) = key;
-                        *(ptrs+offset+insertmoved) = ptr;
-                        insertmoved = 1;
-                        rc = b.GetKey(offset, *(keys+offset+insertmoved));
-                        RETURNIFERROR(rc)
-                        rc = b.GetPtr(offset+1, *(ptrs+offset+insertmoved));
-                        RETURNIFERROR(rc)
-                    } else if (keys[offset+insertmoved] == key) {
-                        return ERROR_CONFLICT;
-                    }
-                }
-                if (!insertmoved) {
-                    *(keys+offset+insertmoved) = key;
-                    *(ptrs+offset+insertmoved) = ptr;
-                }
-                b.info.numkeys = 0;
-                KEY_T propkey;
-                for (offset=0; offset<maxsize+1; offset++) {
-                    if (movedcount < halfsize) {
-                        b.info.numkeys++;
-                        rc = b.SetKey(offset, *(keys+offset));
-                        RETURNIFERROR(rc)
-                        rc = b.SetPtr(offset+1, *(ptrs+offset));
-                        RETURNIFERROR(rc)
-                    } else {
-                        if (!splitfirstptr) {
-                            rc = splitnode.SetPtr(0, *(ptrs+offset));
-                            RETURNIFERROR(rc)
-                            propkey = *(keys+offset);
-                            splitfirstptr = 1;
-                            continue;
-                        }
-                        splitnode.info.numkeys++;
-                        rc = splitnode.SetKey(splitnodeoffset++, *(keys+offset));
-                        RETURNIFERROR(rc)
-                        rc = splitnode.SetPtr(splitnodeoffset, *(ptrs+offset));
-                        RETURNIFERROR(rc)
-                    }
-                    movedcount++;
-                }
-                // new node created, return ptr
-                rc = b.Serialize(buffercache, node);
-                RETURNIFERROR(rc)
-                rc = splitnode.Serialize(buffercache, splitnodeptr);
-                RETURNIFERROR(rc)
-                // set return value
-                ptr = splitnodeptr;
-                key = propkey;
-                // Propagate to upper level
-                return ERROR_NOERROR;
-            }
-            break;
-        }
-        case BTREE_LEAF_NODE:
-            return ERROR_INSANE;
-        default:
-            return ERROR_INSANE;
-    }
-    return ERROR_INSANE;
+
+// Byte order of whole keys, a key sorting before the longer ones it
+// starts
+static int CompareKeys(const KEY_T &a, const KEY_T &b)
+{
+  return BTreeByteKeyTraits::Compare((const char*)a.data,a.length,BTreeByteKeyTraits::MakeProbe(b));
 }
 
-ERROR_T BTreeIndex::InsertKeyPtrHelper(const SIZE_T &curnode,
-                                       SIZE_T &node,
-                                       KEY_T &key,
-                                       SIZE_T &ptr) {
-    BTreeNode b;
-    ERROR_T rc;
-    SIZE_T offset;
-    KEY_T testkey;
-    SIZE_T testptr;
-    SIZE_T old_ptr;
-
-    if (curnode == node) {
-        SIZE_T retptr = ptr;
-        KEY_T retkey = key;
-        SIZE_T retnode = node;
-        rc = InsertKeyPtr(retnode, retkey, retptr);
-        RETURNIFERROR(rc)
-        if (retptr != ptr) {
-            key = retkey;
-            ptr = retptr;
-            node = curnode;
-        }
-        return ERROR_NOERROR;
-    }
-
-    rc = b.Unserialize(buffercache, curnode);
-    RETURNIFERROR(rc)
-
-    switch (b.info.nodetype) {
-        case BTREE_ROOT_NODE:
-        case BTREE_INTERIOR_NODE:{
-            for (offset=0;offset<b.info.numkeys;offset++) {
-                rc = b.GetKey(offset, testkey);
-                RETURNIFERROR(rc)
-                if (key < testkey || key == testkey) {
-                    break;
-                }
-            }
-            rc = b.GetPtr(offset, testptr);
-            RETURNIFERROR(rc)
-            old_ptr = ptr;
-            rc = InsertKeyPtrHelper(testptr, node, key, ptr);
-            RETURNIFERROR(rc)
-            if (old_ptr != ptr) {
-                SIZE_T retptr = ptr;
-                KEY_T retkey = key;
-                SIZE_T retnode = curnode;
-                rc = InsertKeyPtr(retnode, retkey, retptr);
-                RETURNIFERROR(rc)
-                if (retptr != ptr) {
-                    key = retkey;
-                    ptr = retptr;
-                    node = curnode;
-                }
-                return ERROR_NOERROR;
-            }
-            break;
-        }
-        case BTREE_LEAF_NODE:
-            return ERROR_INSANE;
-    }
+
+//
+// A node's prefix comes from its range, the separators around it in
+// its parent (or further up): every key between two keys starts with
+// whatever they both start with.  So a node bounded on both sides 
+// gets the prefix its bounds share; one at either edge of the tree 
+// gets none.  Splits only narrow ranges, so prefixes only grow there.
+// When two nodes trade or merge entries, the one that takes them 
+// shrinks its prefix to what both prefixes share first; Delete keeps
+// nodes at least half full without a prefix, so that always fits.
+//
+static SIZE_T CommonPrefix(const char *a, const char *b, const SIZE_T n)
+{
+  SIZE_T i;
+
+  for (i=0;i<n && a[i]==b[i];i++) { 
+  }
+  return i;
+}
+
+
+ERROR_T BTreeIndex::SetRangePrefix(BTreeNode &b,
+				   const bool haslow, const KEY_T &low,
+				   const bool hashigh, const KEY_T &high) const
+{
+  SIZE_T len=0;
+
+  if (!HasPrefixCompression()) { 
     return ERROR_NOERROR;
+  }
+  if (haslow && hashigh) { 
+    len=CommonPrefix((const char*)low.data,(const char*)high.data,superblock.info.keysize);
+  }
+  if (len==superblock.info.keysize) { 
+    return ERROR_INSANE;
+  }
+  if (len==b.info.prefixlen) { 
+    return ERROR_NOERROR;
+  }
+  return b.SetPrefix((const char*)low.data,len);
 }
 
-ERROR_T BTreeIndex::InsertHelper(SIZE_T &node, KEY_T &key, const VALUE_T &value)
-{
-    BTreeNode b;
-    ERROR_T rc;
-    SIZE_T offset;
-    SIZE_T temp;
-    KEY_T testkey;
-    SIZE_T ptr;
-
-    rc = b.Unserialize(buffercache, node);
-
-    if (rc != ERROR_NOERROR) {
-        return rc;
-    }
-
-    switch (b.info.nodetype) {
-        case BTREE_ROOT_NODE: {
-            // No keys so far, need to allocate node or go into first leaf node
-            if (b.info.numkeys == 0) {
-                rc = b.GetPtr(0, ptr);
-                RETURNIFERROR(rc)
-                // need to alloc node
-                if (ptr != node+1)  {
-                    rc = AllocateNode(ptr);
-                    RETURNIFERROR(rc)
-                    BTreeNode b_leaf(BTREE_LEAF_NODE,
-                                     superblock.info.keysize,
-                                     superblock.info.valuesize,
-                                     superblock.info.blocksize);
-                    b_leaf.Serialize(buffercache, ptr);
-                    rc = b.SetPtr(0, ptr);
-                    RETURNIFERROR(rc)
-
-                    rc = b.Serialize(buffercache, node);
-                    RETURNIFERROR(rc)
-                }
-                SIZE_T old_ptr = ptr;
-                rc = InsertHelper(ptr, key, value);
-                RETURNIFERROR(rc)
-                if (old_ptr != ptr) {
-                    // leaf node split, insert new key
-                    b.info.numkeys++;
-                    rc = b.SetKey(0, key);
-                    RETURNIFERROR(rc)
-                    rc = b.SetPtr(1, ptr);
-                    RETURNIFERROR(rc)
-                    return b.Serialize(buffercache, node);
-                }
-                break;
-            }
-        }
-        case BTREE_INTERIOR_NODE: {
-            SIZE_T old_ptr;
-            for (offset=0;offset<b.info.numkeys;offset++) {
-                rc = b.GetKey(offset, testkey);
-                RETURNIFERROR(rc)
-                if (key<testkey || key==testkey) {
-                    rc = b.GetPtr(offset, ptr);
-                    RETURNIFERROR(rc)
-                    old_ptr = ptr;
-                    rc = InsertHelper(ptr, key, value);
-                    RETURNIFERROR(rc)
-                    if (old_ptr != ptr) {
-                        return InsertKeyPtrHelper(superblock.info.rootnode,
-                                            node, key, ptr);
-                    } else {
-                        return ERROR_NOERROR;
-                    }
-                }
-            }
-            // Did't find any greater keys, go to last ptr
-            rc = b.GetPtr(b.info.numkeys, ptr);
-            RETURNIFERROR(rc)
-            old_ptr = ptr;
-            rc = InsertHelper(ptr, key, value);
-            RETURNIFERROR(rc)
-            if (old_ptr != ptr) {
-                // leaf node split, insert new key and ptr
-                return InsertKeyPtrHelper(superblock.info.rootnode,
-                                    node, key, ptr);
-            }
-            return ERROR_NOERROR;
-        }
-        case BTREE_LEAF_NODE: {
-            if (b.info.numkeys < b.info.GetNumSlotsAsLeaf()) {
-                b.info.numkeys++;
-                for (offset=0;offset<b.info.numkeys-1;offset++) {
-                    rc = b.GetKey(offset, testkey);
-                    RETURNIFERROR(rc)
-                    if (key < testkey) {
-                        for (temp=b.info.numkeys-2; temp>=offset; temp--) {
-                            KeyValuePair tempkeyval;
-                            rc = b.GetKeyVal(temp, tempkeyval);
-                            RETURNIFERROR(rc)
-                            rc = b.SetKeyVal(temp+1, tempkeyval);
-                            RETURNIFERROR(rc)
-                            // Avoid overflow
-                            if (temp == 0) {
-                                break;
-                            }
-                        }
-                        break;
-                    }
-                    if (key == testkey) {
-                        return ERROR_CONFLICT;
-                    }
-                }
-//                KeyValuePair keyvalpair(key, value);
-//                rc = b.SetKeyVal(offset, keyvalpair);
-                rc = b.SetKey(offset, key);
-                RETURNIFERROR(rc)
-                rc = b.SetVal(offset, value);
-                if (rc) {
-                    return rc;
-                } else {
-                    rc = b.Serialize(buffercache, node);
-                    return rc;
-                }
-            } else { // split
-                SIZE_T maxsize= b.info.GetNumSlotsAsLeaf();
-                cerr << "Maximum slots (";
-                cerr << maxsize;
-                cerr << ")" << endl;
-                cerr << "Need to split" << endl;
-
-                rc = AllocateNode(ptr);
-                RETURNIFERROR(rc)
-                BTreeNode splitnode(BTREE_LEAF_NODE,
-                    superblock.info.keysize,
-                    superblock.info.valuesize,
-                    superblock.info.blocksize);;
-                rc = splitnode.Serialize(buffercache, ptr);
-                RETURNIFERROR(rc)
-
-                // Moving objects
-                SIZE_T halfsize = (maxsize + 1) / 2;
-                SIZE_T movedcount = 0;
-                SIZE_T insertmoved = 0;
-                SIZE_T splitnodeoffset = 0;
-                KeyValuePair *tempkeyval;
-                tempkeyval = new KeyValuePair [b.info.numkeys+1];
-                for (offset=0; offset<b.info.numkeys; offset++) {
-                    rc = b.GetKeyVal(offset, *(tempkeyval+offset+insertmoved));
-                    RETURNIFERROR(rc)
-                    if (tempkeyval[offset+insertmoved].key > key && !insertmoved) {
-                        *(tempkeyval+offset+insertmoved) = KeyValuePair(key, value);
-                        insertmoved = 1;
-                        rc = b.GetKeyVal(offset, *(tempkeyval+offset+insertmoved));
-                        RETURNIFERROR(rc)
-                    } else if (tempkeyval[offset+insertmoved].key == key) {
-                        return ERROR_CONFLICT;
-                    }
-
-                }
-                if (!insertmoved) {
-                    *(tempkeyval+offset+insertmoved) = KeyValuePair(key, value);
-                }
-                b.info.numkeys = 0;
-                for (offset=0; offset<maxsize+1; offset++) {
-                    if (movedcount < halfsize) {
-                        b.info.numkeys++;
-                        rc = b.SetKeyVal(offset, *(tempkeyval+offset));
-                        RETURNIFERROR(rc)
-                    } else {
-                        splitnode.info.numkeys++;
-                        rc = splitnode.SetKeyVal(splitnodeoffset++, *(tempkeyval+offset));
-                        RETURNIFERROR(rc)
-                    }
-                    movedcount++;
-                }
-                // new node created, return ptr
-                rc = b.Serialize(buffercache, node);
-                RETURNIFERROR(rc)
-                rc = splitnode.Serialize(buffercache, ptr);
-                RETURNIFERROR(rc)
-                // set return value
-                node = ptr;
-                rc = splitnode.GetKey(0, key);
-                RETURNIFERROR(rc)
-                return ERROR_NOERROR;
-            }
-            break;
-        }
-        default:
-            return ERROR_INSANE;
-    }
+
+ERROR_T BTreeIndex::SharePrefix(BTreeNode &b, const BTreeNode &other) const
+{
+  SIZE_T len=min(b.info.prefixlen,other.info.prefixlen);
+
+  len=CommonPrefix(b.ResolvePrefix(),other.ResolvePrefix(),len);
+  if (len==b.info.prefixlen) { 
     return ERROR_NOERROR;
+  }
+  return b.SetPrefix(b.ResolvePrefix(),len);
 }
 
-ERROR_T BTreeIndex::InsertInternal(const SIZE_T &node, const BTreeOp op, const KEY_T &key, const VALUE_T &value) {
-    if (op != BTREE_OP_INSERT) {
-        return ERROR_INSANE;
-    }
-    ERROR_T rc;
-    KEY_T retkey = key;
-    SIZE_T retnode = node;
-    rc = InsertHelper(retnode, retkey, value);
-    return rc;
+
+//
+// With suffix truncation a separator is only as long as it must be to
+// tell the nodes either side of it apart: the first key of the right
+// one up to and including the first byte where it differs from the
+// last key of the left one, then zeros.  An interior node leaves the 
+// trailing zeros its keys all have out of its slots, so the shorter
+// its separators the more of them it holds.  Empty ones leave out as
+// much as they may, and take in bytes only as keys need them; a node
+// with no room for a key that needs more splits, and the halves give 
+// back what they can.
+//
+void BTreeIndex::Separator(const KEY_T &last, const KEY_T &first, KEY_T &sep) const
+{
+  sep=first;
+  CutSeparator(sep,CommonPrefix((const char*)last.data,(const char*)first.data,
+				min(last.length,first.length)));
 }
 
-static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt)
+
+// Cuts sep, the first key of a right node, down to its separator, 
+// given the bytes it has in common with the last key of the left one
+void BTreeIndex::CutSeparator(KEY_T &sep, const SIZE_T common) const
 {
-  KEY_T key;
-  VALUE_T value;
-  SIZE_T ptr;
-  SIZE_T offset;
-  ERROR_T rc;
-  unsigned i;
+  SIZE_T n=common+1;
 
-  if (dt==BTREE_DEPTH_DOT) { 
-    os << nodenum << " [ label=\""<<nodenum<<": ";
-  } else if (dt==BTREE_DEPTH) {
-    os << nodenum << ": ";
-  } else {
+  if (!HasSuffixTruncation()) { 
+    return;
   }
-
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
+  if (HasSlottedPages()) { 
+    // keys of any length, so no zero fill
+    if (n<sep.length) { 
+      sep.Resize(n);
+    }
+    return;
+  }
+  if (n<superblock.info.keysize) { 
+    memset(sep.data+n,0,superblock.info.keysize-n);
+  }
+}
+
+
+// Leading bytes the ith key of b has in common with k, read in place:
+// the prefix, the stored bytes and then the zero tail
+static SIZE_T CommonWithKey(const BTreeNode &b, const SIZE_T offset, const KEY_T &k)
+{
+  const char *key=(const char*)k.data;
+  SIZE_T n, m;
+
+  if (b.info.options & BTREE_NODE_SLOTTED) { 
+    return CommonPrefix(b.ResolveKey(offset),key,min(b.GetKeyLength(offset),k.length));
+  }
+  n=CommonPrefix(b.ResolvePrefix(),key,min(b.info.prefixlen,k.length));
+  if (n<b.info.prefixlen) { 
+    return n;
+  }
+  m=min(b.info.GetKeyBytes(),k.length-n);
+  n+=CommonPrefix(b.ResolveKey(offset),key+b.info.prefixlen,m);
+  if (n<b.info.prefixlen+m) { 
+    return n;
+  }
+  for (; n<min(b.info.keysize,k.length) && key[n]==0; n++) { 
+  }
+  return n;
+}
+
+
+ERROR_T BTreeIndex::NarrowKeys(BTreeNode &b) const
+{
+  KEY_T key;
+  SIZE_T zerotail;
+  ERROR_T rc;
+
+  if (!HasSuffixTruncation() || (b.info.options & BTREE_NODE_SLOTTED)) { 
+    return ERROR_NOERROR;
+  }
+  zerotail=b.info.GetMaxZeroTail();
+  for (SIZE_T i=0; i<b.info.numkeys && zerotail>b.info.zerotail; i++) { 
+    rc=b.GetKey(i,key);
+    RETURNIFERROR(rc)
+    zerotail=min(zerotail,BTreeZeroTail(key));
+  }
+  if (zerotail<=b.info.zerotail) { 
+    return ERROR_NOERROR;
+  }
+  return b.SetZeroTail(zerotail);
+}
+
+
+// Slots interior node b would have with room for key
+static SIZE_T InteriorSlotsFor(const BTreeNode &b, const KEY_T &key)
+{
+  NodeMetadata info=b.info;
+
+  info.zerotail=min(info.zerotail,BTreeZeroTail(key));
+  return info.GetNumSlotsAsInterior();
+}
+
+
+// Lays interior node b out again, if need be, to hold key
+static ERROR_T WidenFor(BTreeNode &b, const KEY_T &key)
+{
+  SIZE_T zerotail=BTreeZeroTail(key);
+
+  if (zerotail>=b.info.zerotail) { 
+    return ERROR_NOERROR;
+  }
+  return b.SetZeroTail(zerotail);
+}
+
+
+// Whether leaf b has room for one more entry
+static bool LeafHasRoom(const BTreeNode &b, const KEY_T &key, const VALUE_T &value)
+{
+  if (b.info.options & BTREE_NODE_SLOTTED) { 
+    return b.GetFreeBytes()>=BTreeSlottedEntryBytes(key.length,value.length);
+  }
+  return b.info.numkeys<b.info.GetNumSlotsAsLeaf();
+}
+
+
+// Whether interior node b has room for one more key
+static bool InteriorHasRoom(const BTreeNode &b, const KEY_T &key)
+{
+  if (b.info.options & BTREE_NODE_SLOTTED) { 
+    return b.GetFreeBytes()>=BTreeSlottedEntryBytes(key.length,sizeof(SIZE_T));
+  }
+  return b.info.numkeys<InteriorSlotsFor(b,key);
+}
+
+
+// Whether key offset of interior node b can give way to key
+static bool InteriorHasRoomAt(const BTreeNode &b, const SIZE_T offset, const KEY_T &key)
+{
+  if (b.info.options & BTREE_NODE_SLOTTED) { 
+    return b.GetFreeBytes()+b.GetKeyLength(offset)>=key.length;
+  }
+  return b.info.numkeys<=InteriorSlotsFor(b,key);
+}
+
+
+// A new empty node with the layout this index gives nodes of its type
+BTreeNode BTreeIndex::NewNode(const int nodetype) const
+{
+  BTreeNode node(nodetype,
+		 superblock.info.keysize,
+		 superblock.info.valuesize,
+		 buffercache->GetBlockSize());
+
+  if (nodetype==BTREE_OVERFLOW_NODE && !IsUnique()) { 
+    // holding values of a run
+    node.info.valuesize=ValueSize();
+  }
+  if (HasSlottedPages() && nodetype!=BTREE_OVERFLOW_NODE) { 
+    node.info.options|=BTREE_NODE_SLOTTED;
+    node.info.heaptop=node.info.GetNumDataBytes();
+    return node;
+  }
+  if (nodetype==BTREE_ROOT_NODE || nodetype==BTREE_INTERIOR_NODE) { 
+    if (HasKeysApart()) { 
+      node.info.options|=BTREE_NODE_KEYS_APART;
+    }
+  }
+  if (nodetype!=BTREE_OVERFLOW_NODE && HasKeyDirectory()) { 
+    node.info.options|=BTREE_NODE_KEY_DIRECTORY;
+  }
+  if ((nodetype==BTREE_ROOT_NODE || nodetype==BTREE_INTERIOR_NODE) && HasSuffixTruncation()) { 
+    node.info.zerotail=node.info.GetMaxZeroTail();
+  }
+  return node;
+}
+
+
+KEY_T BTreeIndex::IntegerKey(const long long x) const
+{
+  KEY_T key(superblock.info.keysize);
+  unsigned long long u=(unsigned long long)x;
+  SIZE_T i;
+
+  // flip the sign bit of the keysize byte integer
+  u^=1ULL<<(8*superblock.info.keysize-1);
+  for (i=superblock.info.keysize; i>0; i--) { 
+    key.data[i-1]=(BYTE_T)(u&0xff);
+    u>>=8;
+  }
+  return key;
+}
+
+
+long long BTreeIndex::IntegerKeyValue(const KEY_T &key) const
+{
+  unsigned long long u=0;
+  SIZE_T i;
+
+  for (i=0;i<key.length;i++) { 
+    u=(u<<8)|key.data[i];
+  }
+  u^=1ULL<<(8*key.length-1);
+  if (key.length<8 && (u>>(8*key.length-1))&1) { 
+    // sign extend
+    u|=~0ULL<<(8*key.length);
+  }
+  return (long long)u;
+}
+
+
+ERROR_T BTreeIndex::ParseKey(const char *text, KEY_T &key) const
+{
+  char *end;
+  long long x;
+
+  if (!HasIntegerKeys()) { 
+    key=KEY_T(text);
+    return ERROR_NOERROR;
+  }
+  x=strtoll(text,&end,10);
+  if (end==text || *end!=0) { 
+    return ERROR_SIZE;
+  }
+  key=IntegerKey(x);
+  return ERROR_NOERROR;
+}
+
+
+// Fixed pages keep every key at keysize, zero filled, so a shorter
+// one is searched for the same way.  Slotted pages keep keys as they
+// are.
+bool BTreeIndex::IsShortKey(const KEY_T &key) const
+{
+  return !HasSlottedPages() && key.length<superblock.info.keysize;
+}
+
+
+KEY_T BTreeIndex::PaddedKey(const KEY_T &key) const
+{
+  KEY_T padded(superblock.info.keysize);
+
+  memcpy(padded.data,key.data,key.length);
+  memset(padded.data+key.length,0,padded.length-key.length);
+  return padded;
+}
+
+
+ostream & BTreeIndex::PrintKey(ostream &os, const KEY_T &key) const
+{
+  if (HasIntegerKeys() && key.length==superblock.info.keysize) { 
+    return os << IntegerKeyValue(key);
+  }
+  // a cut separator without its zero fill
+  SIZE_T n= HasSuffixTruncation() ? key.length-BTreeZeroTail(key) : key.length;
+  for (SIZE_T i=0;i<n;i++) { 
+    os << key.data[i];
+  }
+  return os;
+}
+
+
+//
+// Node searches, with integer keys compared as integers
+//
+SIZE_T BTreeIndex::LowerBound(const BTreeNode &b, const KEY_T &key) const
+{
+  if (HasIntegerKeys() && key.length==b.info.keysize) { 
+    return b.info.keysize==4 ? b.LowerBoundAs<BTreeInt32KeyTraits>(key) : b.LowerBoundAs<BTreeInt64KeyTraits>(key);
+  }
+  return b.LowerBound(key);
+}
+
+
+SIZE_T BTreeIndex::UpperBound(const BTreeNode &b, const KEY_T &key) const
+{
+  if (HasIntegerKeys() && key.length==b.info.keysize) { 
+    return b.info.keysize==4 ? b.UpperBoundAs<BTreeInt32KeyTraits>(key) : b.UpperBoundAs<BTreeInt64KeyTraits>(key);
+  }
+  return b.UpperBound(key);
+}
+
+
+void BTreeIndex::SetExtentSize(const SIZE_T blocks)
+{
+  extentsize = blocks>0 ? blocks : 1;
+}
+
+
+ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
+{
+  BTreeNode node;
+
+  node.Unserialize(buffercache,n);
+
+  assert(node.info.nodetype!=BTREE_UNALLOCATED_BLOCK);
+
+  if (find(pinned.begin(),pinned.end(),n)!=pinned.end()) { 
+    pinsstale=true;
+  }
+
+  node.info.nodetype=BTREE_UNALLOCATED_BLOCK;
+
+  node.info.freelist=superblock.info.freelist;
+
+  node.Serialize(buffercache,n);
+
+  superblock.info.freelist=n;
+
+  buffercache->NotifyDeallocateBlock(n);
+
+  return SuperblockChanged();
+
+}
+
+
+//
+// The superblock is only written at commit points: Detach, 
+// Checkpoint, or every checkpointinterval changes if that is set.
+// In between, the copy in memory is the current one.
+//
+ERROR_T BTreeIndex::SuperblockChanged()
+{
+  superblockdirty=true;
+  changessincecheckpoint++;
+  if (checkpointinterval>0 && changessincecheckpoint>=checkpointinterval) { 
+    return Checkpoint();
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::Checkpoint()
+{
+  ERROR_T rc;
+
+  if (!superblockdirty) { 
+    return ERROR_NOERROR;
+  }
+  rc=StoreExtents();
+  RETURNIFERROR(rc)
+  rc=superblock.Serialize(buffercache,superblock_index);
+  RETURNIFERROR(rc)
+  superblockdirty=false;
+  changessincecheckpoint=0;
+  return ERROR_NOERROR;
+}
+
+
+void BTreeIndex::SetCheckpointInterval(const SIZE_T changes)
+{
+  checkpointinterval=changes;
+}
+
+//
+// The magic number and format version, at the end of the superblock
+//
+static char *FormatWords(const BTreeNode &super)
+{
+  return super.data+super.info.GetNumDataBytes()-2*sizeof(SIZE_T);
+}
+
+
+ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
+{
+  ERROR_T rc;
+  SIZE_T format[2];
+
+  superblock_index=initblock;
+  assert(superblock_index==0);
+
+  if (create) {
+    // build a super block and root node
+    //
+    // Superblock at superblock_index
+    // root node at superblock_index+1
+    // the rest is free, from the high water mark on, and is not
+    // written until it is allocated
+    if (HasSlottedPages() && 
+	(superblock.info.options & (BTREE_OPT_NONUNIQUE|BTREE_OPT_KEYS_APART|
+				    BTREE_OPT_KEY_DIRECTORY|BTREE_OPT_PREFIX))) { 
+      return ERROR_CONFLICT;
+    }
+    if (HasBigValues() && 
+	(superblock.info.options & (BTREE_OPT_NONUNIQUE|BTREE_OPT_SLOTTED))) { 
+      return ERROR_CONFLICT;
+    }
+    BTreeNode newsuperblock(BTREE_SUPERBLOCK,
+			    superblock.info.keysize,
+			    superblock.info.valuesize,
+			    buffercache->GetBlockSize());
+    newsuperblock.info.rootnode=superblock_index+1;
+    newsuperblock.info.freelist=0;
+    newsuperblock.info.highwater=superblock_index+2;
+    newsuperblock.info.options=superblock.info.options;
+    newsuperblock.info.bigvaluesize=superblock.info.bigvaluesize;
+    newsuperblock.info.runvalues=superblock.info.runvalues;
+    newsuperblock.info.numkeys=0;
+    format[0]=BTREE_MAGIC;
+    format[1]=BTREE_FORMAT_VERSION;
+    memcpy(FormatWords(newsuperblock),format,sizeof(format));
+
+    buffercache->NotifyAllocateBlock(superblock_index);
+
+    rc=newsuperblock.Serialize(buffercache,superblock_index);
+
+    if (rc) { 
+      return rc;
+    }
+    
+    BTreeNode newrootnode=NewNode(BTREE_ROOT_NODE);
+    newrootnode.info.rootnode=superblock_index+1;
+    newrootnode.info.numkeys=0;
+
+    buffercache->NotifyAllocateBlock(superblock_index+1);
+
+    rc=newrootnode.Serialize(buffercache,superblock_index+1);
+
+    if (rc) { 
+      return rc;
+    }
+  }
+
+  // OK, now, mounting the btree is simply a matter of reading the superblock 
+
+  superblockdirty=false;
+  changessincecheckpoint=0;
+  rightmost.valid=false;
+
+  delete nodecache;
+  nodecache = nodecachesize>0 ? new BTreeNodeCache(buffercache,nodecachesize) : 0;
+
+  rc=superblock.Unserialize(buffercache,initblock);
+  RETURNIFERROR(rc)
+  if (superblock.info.nodetype!=BTREE_SUPERBLOCK) { 
+    return ERROR_NOTANINDEX;
+  }
+  memcpy(format,FormatWords(superblock),sizeof(format));
+  if (format[0]!=BTREE_MAGIC) { 
+    return ERROR_NOTANINDEX;
+  }
+  if (format[1]!=BTREE_FORMAT_VERSION) { 
+    return ERROR_VERSION;
+  }
+  rc=LoadExtents();
+  RETURNIFERROR(rc)
+  pinsstale=true;
+  return PinUpperLevels();
+}
+    
+
+ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
+{
+  ERROR_T rc;
+
+  rc=UnpinUpperLevels();
+  RETURNIFERROR(rc)
+  delete nodecache;
+  nodecache=0;
+  rc=Checkpoint();
+  RETURNIFERROR(rc)
+  extents.clear();
+  currentextent.clear();
+  return ERROR_NOERROR;
+}
+
+
+void BTreeIndex::SetNodeCache(const SIZE_T nodes)
+{
+  nodecachesize=nodes;
+}
+
+
+void BTreeIndex::SetPinnedLevels(const SIZE_T levels, const SIZE_T bytes)
+{
+  pinlevels=levels;
+  pinbytes=bytes;
+  pinsstale=true;
+}
+
+
+//
+// Pins the top pinlevels levels of interior nodes, a level at a time
+// from the root, in place of whatever was pinned before.  A level is
+// pinned whole or not at all, and only while the pinned blocks stay 
+// within pinbytes (if set) and half the buffer cache, so the rest is
+// left for the leaves.  Nothing is done unless an interior node may
+// have been allocated or a pinned one freed since the last time.
+//
+ERROR_T BTreeIndex::PinUpperLevels()
+{
+  vector<SIZE_T> level, next;
+  BTreeNodeView b;
+  Block *frame;
+  SIZE_T limit;
+  SIZE_T ptr;
+  ERROR_T rc;
+
+  if (!pinsstale) { 
+    return ERROR_NOERROR;
+  }
+  rc=UnpinUpperLevels();
+  RETURNIFERROR(rc)
+  pinsstale=false;
+
+  limit=PinLimit();
+
+  level.push_back(superblock.info.rootnode);
+  for (SIZE_T depth=0; depth<pinlevels && pinned.size()+level.size()<=limit; depth++) { 
+    next.clear();
+    for (SIZE_T i=0; i<level.size(); i++) { 
+      rc=b.Pin(buffercache,level[i]);
+      RETURNIFERROR(rc)
+      if (b.info.nodetype!=BTREE_ROOT_NODE && b.info.nodetype!=BTREE_INTERIOR_NODE) { 
+	// down to the leaves, which are not pinned
+	return b.Unpin();
+      }
+      for (SIZE_T j=0; j<=b.info.numkeys; j++) { 
+	rc=b.GetPtr(j,ptr);
+	RETURNIFERROR(rc)
+	if (ptr!=0) { 
+	  next.push_back(ptr);
+	}
+      }
+      rc=buffercache->PinBlock(level[i],frame);
+      RETURNIFERROR(rc)
+      pinned.push_back(level[i]);
+    }
+    level.swap(next);
+  }
+  return ERROR_NOERROR;
+}
+
+
+// Blocks PinUpperLevels may pin
+SIZE_T BTreeIndex::PinLimit() const
+{
+  SIZE_T limit=buffercache->GetCacheSize()/2;
+
+  if (pinbytes>0) { 
+    limit=min(limit,pinbytes/buffercache->GetBlockSize());
+  }
+  return limit;
+}
+
+
+ERROR_T BTreeIndex::UnpinUpperLevels()
+{
+  ERROR_T rc=ERROR_NOERROR;
+
+  for (SIZE_T i=0; i<pinned.size(); i++) { 
+    if (buffercache->UnpinBlock(pinned[i])!=ERROR_NOERROR) { 
+      rc=ERROR_INSANE;
+    }
+  }
+  pinned.clear();
+  return rc;
+}
+
+
+BTreeNodeCache::Hop::Hop() : from(0), fromblock(0), slot(0), frame(0)
+{}
+
+
+BTreeNodeCache::BTreeNodeCache(BufferCache *c, const SIZE_T s) : 
+  hits(0), misses(0), cache(c), size(s), clock(0)
+{
+  cache->AddObserver(this);
+}
+
+
+BTreeNodeCache::~BTreeNodeCache()
+{
+  cache->RemoveObserver(this);
+}
+
+
+void BTreeNodeCache::Use(Node &n)
+{
+  hits++;
+  n.lastused=++clock;
+  cache->Touch(n.frame);
+}
+
+
+BTreeNodeCache::Node *BTreeNodeCache::Find(const SIZE_T block)
+{
+  map<SIZE_T,Node>::iterator e=nodes.find(block);
+
+  if (e==nodes.end()) { 
+    misses++;
+    return 0;
+  }
+  Use(e->second);
+  return &(e->second);
+}
+
+
+BTreeNodeCache::Node *BTreeNodeCache::Child(Node *from, const SIZE_T slot, Hop &hop)
+{
+  Node *c=from->children[slot];
+  SIZE_T ptr;
+
+  if (c) { 
+    Use(*c);
+    return c;
+  }
+  // A swizzled frame is of a leaf, or of a node not here (yet)
+  if (!from->childframes[slot]) { 
+    from->node.GetPtr(slot,ptr);
+    c=Find(ptr);
+    if (c) { 
+      Link(from,slot,ptr);
+      from->children[slot]=c;
+      from->childframes[slot]=c->frame;
+      return c;
+    }
+  }
+  hop.from=from;
+  hop.fromblock=from->block;
+  hop.slot=slot;
+  hop.frame=from->childframes[slot];
+  return 0;
+}
+
+
+void BTreeNodeCache::Add(const BTreeNodeView &b)
+{
+  map<SIZE_T,Node>::iterator e;
+  map<SIZE_T,Hop>::iterator p;
+
+  if (nodes.find(b.block)!=nodes.end()) { 
+    return;
+  }
+  if (nodes.size()>=size) { 
+    // As in the buffer cache, a scan for the oldest will do
+    map<SIZE_T,Node>::iterator oldest=nodes.begin();
+    for (e=nodes.begin(); e!=nodes.end(); ++e) { 
+      if (e->second.lastused<oldest->second.lastused) { 
+	oldest=e;
+      }
+    }
+    Drop(oldest->first);
+  }
+  Node &n=nodes[b.block];
+  n.node=b;
+  n.block=b.block;
+  n.frame=b.frame;
+  n.lastused=++clock;
+  n.children.assign(b.info.numkeys+1,(Node*)0);
+  n.childframes.assign(b.info.numkeys+1,(Block*)0);
+  // A parent here that has its frame now has the node itself
+  p=parents.find(b.block);
+  if (p!=parents.end()) { 
+    p->second.from->children[p->second.slot]=&n;
+  }
+}
+
+
+void BTreeNodeCache::Swizzle(const Hop &hop, const BTreeNodeView &child)
+{
+  map<SIZE_T,Node>::iterator e;
+
+  if (!hop.from || hop.frame) { 
+    return;
+  }
+  // Pinning child may have evicted what the descent came from
+  e=nodes.find(hop.fromblock);
+  if (e==nodes.end() || &(e->second)!=hop.from) { 
+    return;
+  }
+  hop.from->childframes[hop.slot]=child.frame;
+  Link(hop.from,hop.slot,child.block);
+}
+
+
+void BTreeNodeCache::Link(Node *from, const SIZE_T slot, const SIZE_T child)
+{
+  Unlink(child);
+  Hop &h=parents[child];
+  h.from=from;
+  h.fromblock=from->block;
+  h.slot=slot;
+  h.frame=0;
+}
+
+
+// The pointer to child goes back to a block number
+void BTreeNodeCache::Unlink(const SIZE_T child)
+{
+  map<SIZE_T,Hop>::iterator p=parents.find(child);
+
+  if (p!=parents.end()) { 
+    p->second.from->children[p->second.slot]=0;
+    p->second.from->childframes[p->second.slot]=0;
+    parents.erase(p);
+  }
+}
+
+
+void BTreeNodeCache::Drop(const SIZE_T block)
+{
+  map<SIZE_T,Node>::iterator e;
+  map<SIZE_T,Hop>::iterator p;
+  SIZE_T child;
+
+  Unlink(block);
+  e=nodes.find(block);
+  if (e==nodes.end()) { 
+    return;
+  }
+  for (SIZE_T i=0; i<e->second.childframes.size(); i++) { 
+    if (e->second.childframes[i]) { 
+      e->second.node.GetPtr(i,child);
+      p=parents.find(child);
+      if (p!=parents.end() && p->second.from==&(e->second)) { 
+	parents.erase(p);
+      }
+    }
+  }
+  nodes.erase(e);
+}
+
+
+void BTreeNodeCache::BlockChanged(const SIZE_T block)
+{
+  Drop(block);
+}
+
+
+ERROR_T BTreeNodeCache::Check() const
+{
+  map<SIZE_T,Node>::const_iterator e, c;
+  map<SIZE_T,Hop>::const_iterator p;
+  SIZE_T child;
+  SIZE_T swizzled=0;
+
+  if (nodes.size()>size) { 
+    return ERROR_INSANE;
+  }
+  for (e=nodes.begin(); e!=nodes.end(); ++e) { 
+    const Node &n=e->second;
+    const NodeMetadata &info=n.node.info;
+    if (n.block!=e->first || !n.frame || cache->GetResidentFrame(n.block)!=n.frame ||
+	(info.nodetype!=BTREE_ROOT_NODE && info.nodetype!=BTREE_INTERIOR_NODE) ||
+	memcmp(n.frame->data,&info,sizeof(info))!=0 ||
+	memcmp(n.frame->data+sizeof(info),n.node.data,info.GetNumDataBytes())!=0 ||
+	n.children.size()!=info.numkeys+1 || n.childframes.size()!=info.numkeys+1) { 
+      return ERROR_INSANE;
+    }
+    for (SIZE_T i=0; i<=info.numkeys; i++) { 
+      if (!n.childframes[i]) { 
+	if (n.children[i]) { 
+	  return ERROR_INSANE;
+	}
+	continue;
+      }
+      swizzled++;
+      n.node.GetPtr(i,child);
+      p=parents.find(child);
+      c=nodes.find(child);
+      if (cache->GetResidentFrame(child)!=n.childframes[i] ||
+	  p==parents.end() || p->second.from!=&n || p->second.slot!=i ||
+	  (n.children[i] && (c==nodes.end() || &(c->second)!=n.children[i])) ||
+	  (!n.children[i] && c!=nodes.end())) { 
+	return ERROR_INSANE;
+      }
+    }
+  }
+  // and nothing else is listed
+  return swizzled==parents.size() ? ERROR_NOERROR : ERROR_INSANE;
+}
+
+
+//
+// Follows key (or the first pointers, if key is null) down from ptr 
+// through whatever interior nodes are in the node cache, by their
+// swizzled pointers where it can, leaving ptr at the first node that
+// is not, or 0 at an empty root.  hop gives that node's frame if it
+// is known.
+//
+ERROR_T BTreeIndex::DescendCached(SIZE_T &ptr, const KEY_T *key, BTreeNodeCache::Hop &hop) const
+{
+  BTreeNodeCache::Node *n;
+  SIZE_T slot;
+  ERROR_T rc;
+
+  hop=BTreeNodeCache::Hop();
+  if (!nodecache) { 
+    return ERROR_NOERROR;
+  }
+  n=nodecache->Find(ptr);
+  while (n) { 
+    slot = key ? UpperBound(n->node,*key) : 0;
+    rc=n->node.GetPtr(slot,ptr);
+    RETURNIFERROR(rc)
+    if (ptr==0) { 
+      return ERROR_NOERROR;
+    }
+    n=nodecache->Child(n,slot,hop);
+  }
+  return ERROR_NOERROR;
+}
+ 
+
+ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
+					   const BTreeOp op,
+					   const KEY_T &key,
+					   VALUE_T &value)
+{
+  BTreeNodeView b;
+  BTreeNodeCache::Hop hop;
+  ERROR_T rc;
+  SIZE_T offset;
+  SIZE_T ptr=node;
+
+  // Walk down from node, looking at each node in place in the cache,
+  // or in the node cache if it is there
+  while (1) { 
+    rc=DescendCached(ptr,&key,hop);
+    RETURNIFERROR(rc)
+    if (ptr==0) { 
+      return ERROR_NONEXISTENT;
+    }
+
+    rc= b.Pin(buffercache,ptr,hop.frame);
+
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+    if (nodecache) { 
+      nodecache->Swizzle(hop,b);
+    }
+
+    switch (b.info.nodetype) { 
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      // The first key that's larger tells us which pointer to
+      // follow: the one immediately previous to it, or the
+      // last pointer if there is no larger key.  An empty root
+      // still has its first pointer.
+      offset=UpperBound(b,key);
+      rc=b.GetPtr(offset,ptr);
+      if (rc) { return rc; }
+      if (ptr==0) { 
+	// an empty root, before its first leaf
+	return ERROR_NONEXISTENT;
+      }
+      if (nodecache) { 
+	nodecache->Add(b);
+      }
+      break;
+    case BTREE_LEAF_NODE:
+      // Search for the matching key
+      offset=LowerBound(b,key);
+      if (offset<b.info.numkeys && b.CompareKey(offset,key)==0) { 
+	if (op==BTREE_OP_LOOKUP) {
+	  return b.GetVal(offset,value);
+	} else if (op==BTREE_OP_UPDATE) {
+	  rc = b.SetVal(offset, value);
+	  RETURNIFERROR(rc)
+	  return b.MarkDirty();
+	} else {
+	  return ERROR_INSANE;
+	}
+      }
+      return ERROR_NONEXISTENT;
+    default:
+      // We can't be looking at anything other than a root, internal, or leaf
+      return ERROR_INSANE;
+      break;
+    }  
+  }
+
+  return ERROR_INSANE;
+}
+
+//
+// Entry shuffling for Insert, Delete and bulk loading.  A leaf entry
+// is a key/value pair.  An interior entry is a key and the pointer to
+// its right, so entry i is key i and pointer i+1.  Entries of a fixed
+// layout move as bytes, a memmove to open or close a gap; a slotted
+// node moves only its slots.
+//
+
+static ERROR_T InsertLeafEntry(BTreeNode &b, const SIZE_T offset, const KEY_T &key, const VALUE_T &value)
+{
+  ERROR_T rc;
+
+  if (b.info.options & BTREE_NODE_SLOTTED) { 
+    return b.InsertSlot(offset,key,(const char*)value.data,value.length);
+  }
+  b.OpenGap(offset);
+  rc=b.SetKey(offset,key);
+  RETURNIFERROR(rc)
+  return b.SetVal(offset,value);
+}
+
+static ERROR_T RemoveLeafEntry(BTreeNode &b, const SIZE_T offset)
+{
+  if (b.info.options & BTREE_NODE_SLOTTED) { 
+    return b.RemoveSlot(offset);
+  }
+  b.CloseGap(offset);
+  return ERROR_NOERROR;
+}
+
+static ERROR_T InsertInteriorEntry(BTreeNode &b, const SIZE_T offset, const KEY_T &key, const SIZE_T ptr)
+{
+  ERROR_T rc;
+
+  if (b.info.options & BTREE_NODE_SLOTTED) { 
+    return b.InsertSlot(offset,key,(const char*)&ptr,sizeof(SIZE_T));
+  }
+  rc=WidenFor(b,key);
+  RETURNIFERROR(rc)
+  b.OpenGap(offset);
+  rc=b.SetKey(offset,key);
+  RETURNIFERROR(rc)
+  return b.SetPtr(offset+1,ptr);
+}
+
+static ERROR_T RemoveInteriorEntry(BTreeNode &b, const SIZE_T offset)
+{
+  if (b.info.options & BTREE_NODE_SLOTTED) { 
+    return b.RemoveSlot(offset);
+  }
+  b.CloseGap(offset);
+  return ERROR_NOERROR;
+}
+
+// Moves the entries of b from offset first on to the end of to, leaving
+// b with first entries.  For interior nodes the caller sets to's 
+// pointer 0; the keys move with the pointers to their right.  Between
+// nodes laid out alike this is one memcpy; otherwise, as when to keeps
+// a shorter prefix or zero tail, the entries go one at a time.
+static ERROR_T MoveLeafTail(BTreeNode &b, const SIZE_T first, BTreeNode &to)
+{
+  KeyValuePair temp;
+  ERROR_T rc;
+
+  if (b.SameLayout(to)) { 
+    return b.MoveTail(first,to);
+  }
+  for (SIZE_T i=first; i<b.info.numkeys; i++) { 
+    rc=b.GetKeyVal(i,temp);
+    RETURNIFERROR(rc)
+    rc=InsertLeafEntry(to,to.info.numkeys,temp.key,temp.value);
+    RETURNIFERROR(rc)
+  }
+  b.info.numkeys=first;
+  return ERROR_NOERROR;
+}
+
+static ERROR_T MoveInteriorTail(BTreeNode &b, const SIZE_T first, BTreeNode &to)
+{
+  KEY_T tempkey;
+  SIZE_T tempptr;
+  ERROR_T rc;
+
+  if (b.SameLayout(to)) { 
+    return b.MoveTail(first,to);
+  }
+  for (SIZE_T i=first; i<b.info.numkeys; i++) { 
+    rc=b.GetKey(i,tempkey);
+    RETURNIFERROR(rc)
+    rc=b.GetPtr(i+1,tempptr);
+    RETURNIFERROR(rc)
+    rc=InsertInteriorEntry(to,to.info.numkeys,tempkey,tempptr);
+    RETURNIFERROR(rc)
+  }
+  b.info.numkeys=first;
+  return ERROR_NOERROR;
+}
+
+// Fewest keys a node other than the root may hold.  Splits never
+// produce less than this, and a merge of an underfull node with a
+// sibling that cannot lend always fits.  It is counted without a 
+// prefix or zero tail, so that it holds whatever layout the merged 
+// node ends up with.
+static SIZE_T MinKeys(const NodeMetadata &info)
+{
+  NodeMetadata whole=info;
+
+  whole.prefixlen=0;
+  whole.zerotail=0;
+  if (info.nodetype==BTREE_LEAF_NODE) { 
+    return whole.GetNumSlotsAsLeaf()/2;
+  } else {
+    return whole.GetNumSlotsAsInterior()/2;
+  }
+}
+
+
+// Whether b has fallen below what Delete keeps nodes other than the
+// root at: MinKeys, or with slotted pages a quarter of its bytes
+static bool Underfull(const BTreeNode &b)
+{
+  if (b.info.options & BTREE_NODE_SLOTTED) { 
+    return b.GetUsedBytes()<b.info.GetNumSlottedBytes()/4;
+  }
+  return b.info.numkeys<MinKeys(b.info);
+}
+
+
+// Whether left, right and, for interior nodes, the separator between
+// them fit in one slotted node
+static bool MergeFits(const BTreeNode &left, const BTreeNode &right, const KEY_T &sep)
+{
+  SIZE_T bytes=left.GetUsedBytes()+right.GetUsedBytes();
+
+  if (left.info.nodetype!=BTREE_LEAF_NODE) { 
+    bytes+=BTreeSlottedEntryBytes(sep.length,sizeof(SIZE_T));
+  }
+  return bytes<=left.info.GetNumSlottedBytes();
+}
+
+
+//
+// A full node splits into itself and a new right sibling, the first
+// SplitPoint of the numkeys+1 entries, counting the one being added,
+// staying put.  Both halves are left for the caller to write.  A leaf
+// passes up the first key of the new node; an interior node passes up
+// the key after those that stay and keeps it in neither half.  A 
+// slotted node is full when its bytes run out, and splits where the
+// halves hold about as many bytes; the new entry takes newbytes.
+// A fixed node splits the entries it has, which may be fewer than its
+// slots: an interior node is full sooner when the new key needs a 
+// shorter zero tail.
+//
+SIZE_T BTreeIndex::SplitPoint(const BTreeNode &b,
+			      const SIZE_T insertat,
+			      const SIZE_T newbytes,
+			      const bool leaf) const
+{
+  bool slotted=(b.info.options & BTREE_NODE_SLOTTED)!=0;
+  SIZE_T numkeys=b.info.numkeys;
+  SIZE_T total=0, below=0, above;
+  SIZE_T best=1, bestbytes=0;
+  vector<SIZE_T> bytes;
+
+  if ((superblock.info.options & BTREE_OPT_SPLIT_AT_INSERT) && (leaf || numkeys>=2)) { 
+    if (insertat==numkeys) { 
+      // Everything there already stays.  An interior node keeps a
+      // key back so that the new one is not left without any.
+      return leaf ? numkeys : numkeys-1;
+    }
+    if (insertat==0) { 
+      return 1;
+    }
+  }
+  if (!slotted) { 
+    return (numkeys+1)/2;
+  }
+
+  for (SIZE_T i=0;i<=numkeys;i++) { 
+    SIZE_T j= i<insertat ? i : i-1;
+    bytes.push_back(i==insertat ? newbytes : 
+		    BTreeSlottedEntryBytes(b.GetKeyLength(j),b.GetValLength(j)));
+    total+=bytes.back();
+  }
+  // Both halves keep at least a key
+  for (SIZE_T half=1; half<=(leaf ? numkeys : numkeys-1); half++) { 
+    below+=bytes[half-1];
+    above=total-below-(leaf ? 0 : bytes[half]);
+    if (half==1 || max(below,above)<bestbytes) { 
+      best=half;
+      bestbytes=max(below,above);
+    }
+  }
+  return best;
+}
+
+ERROR_T BTreeIndex::SplitLeaf(BTreeNode &b, const SIZE_T block,
+			      const SIZE_T insertat,
+			      const KEY_T &key, const VALUE_T &value,
+			      BTreeNode &right, SIZE_T &rightptr, KEY_T &upkey)
+{
+  ERROR_T rc;
+  SIZE_T half=SplitPoint(b,insertat,BTreeSlottedEntryBytes(key.length,value.length),true);
+  SIZE_T next;
+
+  rc=AllocateNode(rightptr,0,block);
+  RETURNIFERROR(rc)
+  right=NewNode(BTREE_LEAF_NODE);
+  // within b's range, so it can start with b's prefix
+  rc=right.SetPrefix(b.ResolvePrefix(),b.info.prefixlen);
+  RETURNIFERROR(rc)
+
+  // splice the new node into the leaf chain after this one
+  rc=b.GetPtr(0,next);
+  RETURNIFERROR(rc)
+  rc=right.SetPtr(0,next);
+  RETURNIFERROR(rc)
+  rc=b.SetPtr(0,rightptr);
+  RETURNIFERROR(rc)
+
+  if (insertat<half) { 
+    rc=MoveLeafTail(b,half-1,right);
+    RETURNIFERROR(rc)
+    rc=InsertLeafEntry(b,insertat,key,value);
+  } else {
+    rc=MoveLeafTail(b,half,right);
+    RETURNIFERROR(rc)
+    rc=InsertLeafEntry(right,insertat-half,key,value);
+  }
+  RETURNIFERROR(rc)
+  // the first key of right, cut against the last of b where it lies
+  rc=right.GetKey(0,upkey);
+  RETURNIFERROR(rc)
+  CutSeparator(upkey,CommonWithKey(b,b.info.numkeys-1,upkey));
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::SplitInterior(BTreeNode &b, const SIZE_T block,
+				  const SIZE_T level,
+				  const SIZE_T insertat,
+				  const KEY_T &key, const SIZE_T ptr,
+				  BTreeNode &right, SIZE_T &rightptr,
+				  KEY_T &upkey)
+{
+  ERROR_T rc;
+  SIZE_T half=SplitPoint(b,insertat,BTreeSlottedEntryBytes(key.length,sizeof(SIZE_T)),false);
+  SIZE_T tempptr;
+
+  rc=AllocateNode(rightptr,level,block);
+  RETURNIFERROR(rc)
+  right=NewNode(BTREE_INTERIOR_NODE);
+  rc=right.SetLayout(b.ResolvePrefix(),b.info.prefixlen,b.info.zerotail);
+  RETURNIFERROR(rc)
+
+  if (insertat<half) { 
+    rc=b.GetKey(half-1,upkey);
+    RETURNIFERROR(rc)
+    rc=b.GetPtr(half,tempptr);
+    RETURNIFERROR(rc)
+    rc=right.SetPtr(0,tempptr);
+    RETURNIFERROR(rc)
+    rc=MoveInteriorTail(b,half,right);
+    RETURNIFERROR(rc)
+    b.info.numkeys=half-1;
+    return InsertInteriorEntry(b,insertat,key,ptr);
+  } else if (insertat==half) { 
+    upkey=key;
+    rc=right.SetPtr(0,ptr);
+    RETURNIFERROR(rc)
+    return MoveInteriorTail(b,half,right);
+  } else {
+    rc=b.GetKey(half,upkey);
+    RETURNIFERROR(rc)
+    rc=b.GetPtr(half+1,tempptr);
+    RETURNIFERROR(rc)
+    rc=right.SetPtr(0,tempptr);
+    RETURNIFERROR(rc)
+    rc=MoveInteriorTail(b,half+1,right);
+    RETURNIFERROR(rc)
+    b.info.numkeys=half;
+    return InsertInteriorEntry(right,insertat-half-1,key,ptr);
+  }
+}
+
+
+//
+// Puts (key, ptr) into interior node b, in block, as entry offset, and
+// writes it.  If b has no room it splits.  The root moves what it has
+// down into two new nodes, and the tree gets a level taller; another
+// node keeps the lower half and hands the separator and the new node
+// back in upkey and upptr for its parent.  Both halves keep b's 
+// prefix, which still fits their ranges.
+//
+ERROR_T BTreeIndex::PutInteriorEntry(BTreeNode &b,
+				     const SIZE_T block,
+				     const SIZE_T level,
+				     const SIZE_T offset,
+				     const KEY_T &key,
+				     const SIZE_T ptr,
+				     bool &split,
+				     KEY_T &upkey,
+				     SIZE_T &upptr)
+{
+  ERROR_T rc;
+  BTreeNode right;
+
+  split=false;
+  if (InteriorHasRoom(b,key)) { 
+    rc=InsertInteriorEntry(b,offset,key,ptr);
+    RETURNIFERROR(rc)
+    return b.Serialize(buffercache,block);
+  }
+
+  if (b.info.nodetype==BTREE_ROOT_NODE) { 
+    // Move the root's contents into a new node, split that, and
+    // leave the root with just the two halves
+    SIZE_T leftptr, rightptr;
+    KEY_T sep;
+    BTreeNode left=b;
+    left.info.nodetype=BTREE_INTERIOR_NODE;
+    rc=AllocateNode(leftptr,level,block);
+    RETURNIFERROR(rc)
+    rc=SplitInterior(left,leftptr,level,offset,key,ptr,right,rightptr,sep);
+    RETURNIFERROR(rc)
+    rc=NarrowKeys(left);
+    RETURNIFERROR(rc)
+    rc=NarrowKeys(right);
+    RETURNIFERROR(rc)
+    rc=left.Serialize(buffercache,leftptr);
+    RETURNIFERROR(rc)
+    rc=right.Serialize(buffercache,rightptr);
+    RETURNIFERROR(rc)
+    b.info.numkeys=0;
+    rc=b.SetPtr(0,leftptr);
+    RETURNIFERROR(rc)
+    rc=InsertInteriorEntry(b,0,sep,rightptr);
+    RETURNIFERROR(rc)
+    rc=NarrowKeys(b);
+    RETURNIFERROR(rc)
+    return b.Serialize(buffercache,block);
+  }
+
+  rc=SplitInterior(b,block,level,offset,key,ptr,right,upptr,upkey);
+  RETURNIFERROR(rc)
+  rc=NarrowKeys(b);
+  RETURNIFERROR(rc)
+  rc=NarrowKeys(right);
+  RETURNIFERROR(rc)
+  rc=b.Serialize(buffercache,block);
+  RETURNIFERROR(rc)
+  rc=right.Serialize(buffercache,upptr);
+  RETURNIFERROR(rc)
+  split=true;
+  return ERROR_NOERROR;
+}
+
+
+//
+// Insert descends once, remembering each interior node it passes
+// through and the pointer it followed.  A split then hands its
+// separator and new node to the remembered parent, and so on up, 
+// without reading anything again.  The root stays in its block: when
+// it is full its contents move down into two new nodes.
+//
+// When the descent keeps to the right edge of the tree it also notes
+// the rightmost leaf and its fence, the separator above it.  Keys at
+// or past the fence can only go to that leaf, so while it has room
+// later inserts of such keys go straight to it.  Splits elsewhere
+// leave the rightmost leaf and its fence alone; Delete may not, so it
+// forgets them.
+//
+// With BTREE_OP_UPDATE the key must be there already.  Its entry comes
+// out of the leaf in memory and the new one goes in as an insert 
+// would, splitting the leaf if need be, so a value too long for what
+// is left of its leaf replaces the old one or the index is unchanged.
+//
+struct InsertPathEntry {
+  SIZE_T    block;
+  SIZE_T    offset;
+  BTreeNode node;
+  bool      haslow, hashigh;    // the node's range, for prefixes
+  KEY_T     low, high;
+};
+
+ERROR_T BTreeIndex::InsertInternal(const SIZE_T &node,
+				   const BTreeOp op,
+				   const KEY_T &key,
+				   const VALUE_T &value)
+{
+  ERROR_T rc;
+  vector<InsertPathEntry> path;
+  BTreeNode b;
+  BTreeNode right;
+  SIZE_T cur;
+  SIZE_T offset;
+  SIZE_T ptr;
+  KEY_T upkey;
+
+  // The range of b, bounded below by the fence
+  bool rightedge=true;
+  bool hasfence=false;
+  KEY_T fence;
+  bool hashigh=false;
+  KEY_T high;
+
+  if (op!=BTREE_OP_INSERT && op!=BTREE_OP_UPDATE) { 
+    return ERROR_INSANE;
+  }
+
+  if (op==BTREE_OP_INSERT && rightmost.valid && node==superblock.info.rootnode &&
+      (!rightmost.hasfence || CompareKeys(key,rightmost.fence)>=0)) { 
+    rc=b.Unserialize(buffercache,rightmost.leaf);
+    RETURNIFERROR(rc)
+    rc=b.GetPtr(0,ptr);
+    RETURNIFERROR(rc)
+    if (b.info.nodetype!=BTREE_LEAF_NODE || ptr!=0) { 
+      return ERROR_INSANE;
+    }
+    if (LeafHasRoom(b,key,value)) { 
+      offset=LowerBound(b,key);
+      if (offset<b.info.numkeys && b.CompareKey(offset,key)==0) { 
+	if (IsUnique()) { 
+	  return ERROR_CONFLICT;
+	}
+	rc=AddToRun(b,offset,rightmost.leaf,value.data+BTREE_RUN_HEADER);
+	RETURNIFERROR(rc)
+	return b.Serialize(buffercache,rightmost.leaf);
+      }
+      rc=InsertLeafEntry(b,offset,key,value);
+      RETURNIFERROR(rc)
+      return b.Serialize(buffercache,rightmost.leaf);
+    }
+    // full, so take the long way round to get the parents
+  }
+
+  cur=node;
+  while (1) { 
+    rc=b.Unserialize(buffercache,cur);
+    RETURNIFERROR(rc)
+    if (b.info.nodetype==BTREE_LEAF_NODE) { 
+      break;
+    }
+    if (b.info.nodetype!=BTREE_ROOT_NODE && b.info.nodetype!=BTREE_INTERIOR_NODE) { 
+      return ERROR_INSANE;
+    }
+    offset=UpperBound(b,key);
+    rc=b.GetPtr(offset,ptr);
+    RETURNIFERROR(rc)
+    rightedge = rightedge && offset==b.info.numkeys;
+    path.push_back(InsertPathEntry());
+    path.back().haslow=hasfence;
+    path.back().low=fence;
+    path.back().hashigh=hashigh;
+    path.back().high=high;
+    if (offset>0) { 
+      rc=b.GetKey(offset-1,fence);
+      RETURNIFERROR(rc)
+      hasfence=true;
+    }
+    if (offset<b.info.numkeys) { 
+      rc=b.GetKey(offset,high);
+      RETURNIFERROR(rc)
+      hashigh=true;
+    }
+    if (ptr==0) { 
+      // Empty root without a leaf yet (block 0 is the superblock)
+      BTreeNode leaf=NewNode(BTREE_LEAF_NODE);
+      rc=AllocateNode(ptr,0,cur);
+      RETURNIFERROR(rc)
+      rc=leaf.Serialize(buffercache,ptr);
+      RETURNIFERROR(rc)
+      rc=b.SetPtr(offset,ptr);
+      RETURNIFERROR(rc)
+      rc=b.Serialize(buffercache,cur);
+      RETURNIFERROR(rc)
+    }
+    path.back().block=cur;
+    path.back().offset=offset;
+    path.back().node=b;
+    cur=ptr;
+  }
+
+  if (rightedge && node==superblock.info.rootnode) { 
+    rightmost.valid=true;
+    rightmost.leaf=cur;
+    rightmost.hasfence=hasfence;
+    rightmost.fence=fence;
+  }
+
+  offset=LowerBound(b,key);
+  if (op==BTREE_OP_UPDATE) { 
+    if (offset>=b.info.numkeys || b.CompareKey(offset,key)!=0) { 
+      return ERROR_NONEXISTENT;
+    }
+    rc=RemoveLeafEntry(b,offset);
+    RETURNIFERROR(rc)
+  } else if (offset<b.info.numkeys && b.CompareKey(offset,key)==0) { 
+    if (IsUnique()) { 
+      return ERROR_CONFLICT;
+    }
+    rc=AddToRun(b,offset,cur,value.data+BTREE_RUN_HEADER);
+    RETURNIFERROR(rc)
+    return b.Serialize(buffercache,cur);
+  }
+  if (LeafHasRoom(b,key,value)) { 
+    rc=InsertLeafEntry(b,offset,key,value);
+    RETURNIFERROR(rc)
+    return b.Serialize(buffercache,cur);
+  }
+
+  rc=SplitLeaf(b,cur,offset,key,value,right,ptr,upkey);
+  RETURNIFERROR(rc)
+  rc=SetRangePrefix(b,hasfence,fence,true,upkey);
+  RETURNIFERROR(rc)
+  rc=SetRangePrefix(right,true,upkey,hashigh,high);
+  RETURNIFERROR(rc)
+  rc=b.Serialize(buffercache,cur);
+  RETURNIFERROR(rc)
+  rc=right.Serialize(buffercache,ptr);
+  RETURNIFERROR(rc)
+  if (rightmost.valid && rightmost.leaf==cur) { 
+    // the new node is the rightmost leaf now
+    rightmost.leaf=ptr;
+    rightmost.hasfence=true;
+    rightmost.fence=upkey;
+  }
+
+  // Hand (upkey, ptr) to each parent in turn until one has room
+  for (SIZE_T level=1; !path.empty(); level++) { 
+    InsertPathEntry &parent=path.back();
+    BTreeNode &p=parent.node;
+    KEY_T sepkey=upkey;
+    SIZE_T newptr=ptr;
+
+    if (p.info.nodetype==BTREE_ROOT_NODE || InteriorHasRoom(p,sepkey)) { 
+      bool split;
+      return PutInteriorEntry(p,parent.block,level,parent.offset,sepkey,newptr,split,upkey,ptr);
+    }
+
+    rc=SplitInterior(p,parent.block,level,parent.offset,sepkey,newptr,right,ptr,upkey);
+    RETURNIFERROR(rc)
+    rc=SetRangePrefix(p,parent.haslow,parent.low,true,upkey);
+    RETURNIFERROR(rc)
+    rc=SetRangePrefix(right,true,upkey,parent.hashigh,parent.high);
+    RETURNIFERROR(rc)
+    rc=NarrowKeys(p);
+    RETURNIFERROR(rc)
+    rc=NarrowKeys(right);
+    RETURNIFERROR(rc)
+    rc=p.Serialize(buffercache,parent.block);
+    RETURNIFERROR(rc)
+    rc=right.Serialize(buffercache,ptr);
+    RETURNIFERROR(rc)
+    path.pop_back();
+  }
+
+  // A leaf has no parent only if the tree is broken
+  return ERROR_INSANE;
+}
+
+static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt, const BTreeIndex &index)
+{
+  SIZE_T runheader = index.IsUnique() ? 0 : BTREE_RUN_HEADER;
+  KEY_T key;
+  VALUE_T value;
+  SIZE_T ptr;
+  SIZE_T offset;
+  ERROR_T rc;
+  unsigned i;
+
+  if (dt==BTREE_DEPTH_DOT) { 
+    os << nodenum << " [ label=\""<<nodenum<<": ";
+  } else if (dt==BTREE_DEPTH) {
+    os << nodenum << ": ";
+  } else {
+  }
+
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (dt==BTREE_SORTED_KEYVAL) {
+    } else {
+      if (dt==BTREE_DEPTH_DOT) { 
+      } else { 
+	os << "Interior: ";
+      }
+      for (offset=0;offset<=b.info.numkeys;offset++) { 
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	os << "*" << ptr << " ";
+	// Last pointer
+	if (offset==b.info.numkeys) break;
+	rc=b.GetKey(offset,key);
+	if (rc) {  return rc; }
+	index.PrintKey(os,key);
+	os << " ";
+      }
+    }
+    break;
+  case BTREE_LEAF_NODE:
+    if (dt==BTREE_DEPTH_DOT || dt==BTREE_SORTED_KEYVAL) { 
+    } else {
+      os << "Leaf: ";
+    }
+    for (offset=0;offset<b.info.numkeys;offset++) { 
+      if (offset==0) { 
+	// special case for first pointer
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	if (dt!=BTREE_SORTED_KEYVAL) { 
+	  os << "*" << ptr << " ";
+	}
+      }
+      if (dt==BTREE_SORTED_KEYVAL) { 
+	os << "(";
+      }
+      rc=b.GetKey(offset,key);
+      if (rc) {  return rc; }
+      index.PrintKey(os,key);
+      if (dt==BTREE_SORTED_KEYVAL) { 
+	os << ",";
+      } else {
+	os << " ";
+      }
+      rc=b.GetVal(offset,value);
+      if (rc) {  return rc; }
+      if (index.HasBigValues()) { 
+	// where the value is, rather than what
+	SIZE_T length;
+	memcpy(&length,value.data,sizeof(SIZE_T));
+	memcpy(&ptr,value.data+sizeof(SIZE_T),sizeof(SIZE_T));
+	os << "[" << length << " bytes at *" << ptr << "]";
+      } else {
+	// just the first value of a run
+	for (i=runheader;i<runheader+index.ValueSize();i++) { 
+	  os << value.data[i];
+	}
+      }
+      if (dt==BTREE_SORTED_KEYVAL) { 
+	os << ")\n";
+      } else {
+	os << " ";
+      }
+    }
+    break;
+  default:
+    if (dt==BTREE_DEPTH_DOT) { 
+      os << "Unknown("<<b.info.nodetype<<")";
+    } else {
+      os << "Unsupported Node Type " << b.info.nodetype ;
+    }
+  }
+  if (dt==BTREE_DEPTH_DOT) { 
+    os << "\" ]";
+  }
+  return ERROR_NOERROR;
+}
+  
+BTreeCursor::BTreeCursor() : offset(0), hasend(false), runoffset(0)
+{}
+
+
+void BTreeCursor::SetEnd(const KEY_T &key)
+{
+  end=key;
+  hasend=true;
+}
+
+
+void BTreeCursor::ClearEnd()
+{
+  hasend=false;
+}
+
+
+//
+// Descend to the leaf that would hold key (or the leftmost leaf if 
+// key is null) and leave the cursor on it.  Only the leaf is copied
+// out of the cache; interior nodes are looked at in place, or in the
+// node cache.
+//
+ERROR_T BTreeIndex::SeekInternal(const KEY_T *key, BTreeCursor &cursor) const
+{
+  BTreeNodeView b;
+  BTreeNodeCache::Hop hop;
+  ERROR_T rc;
+  SIZE_T ptr=superblock.info.rootnode;
+
+  cursor.leaf=BTreeNode();
+  cursor.offset=0;
+  cursor.runoffset=0;
+
+  while (1) { 
+    rc=DescendCached(ptr,key,hop);
+    RETURNIFERROR(rc)
+    if (ptr==0) { 
+      // empty root with no leaf yet, so the cursor starts at the end
+      return ERROR_NOERROR;
+    }
+
+    rc=b.Pin(buffercache,ptr,hop.frame);
+    RETURNIFERROR(rc)
+    if (nodecache) { 
+      nodecache->Swizzle(hop,b);
+    }
+
+    switch (b.info.nodetype) { 
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      rc=b.GetPtr(key ? UpperBound(b,*key) : 0,ptr);
+      RETURNIFERROR(rc)
+      if (ptr==0) { 
+	return ERROR_NOERROR;
+      }
+      if (nodecache) { 
+	nodecache->Add(b);
+      }
+      break;
+    case BTREE_LEAF_NODE:
+      cursor.leaf=b;
+      cursor.offset = key ? LowerBound(b,*key) : 0;
+      return ERROR_NOERROR;
+    default:
+      return ERROR_INSANE;
+    }
+  }
+  return ERROR_INSANE;
+}
+
+
+ERROR_T BTreeIndex::Seek(const KEY_T &key, BTreeCursor &cursor) const
+{
+  if (key.length>superblock.info.keysize) { 
+    return ERROR_SIZE;
+  }
+  if (IsShortKey(key)) { 
+    KEY_T padded(PaddedKey(key));
+    return SeekInternal(&padded,cursor);
+  }
+  return SeekInternal(&key,cursor);
+}
+
+
+ERROR_T BTreeIndex::SeekFirst(BTreeCursor &cursor) const
+{
+  return SeekInternal(0,cursor);
+}
+
+
+//
+// Pins the leaf where key is or would be; ERROR_NONEXISTENT if there
+// are no leaves yet
+//
+ERROR_T BTreeIndex::FindLeaf(const KEY_T &key, BTreeNodeView &leaf) const
+{
+  BTreeNodeCache::Hop hop;
+  ERROR_T rc;
+  SIZE_T ptr=superblock.info.rootnode;
+
+  while (1) { 
+    rc=DescendCached(ptr,&key,hop);
+    RETURNIFERROR(rc)
+    if (ptr==0) { 
+      return ERROR_NONEXISTENT;
+    }
+
+    rc=leaf.Pin(buffercache,ptr,hop.frame);
+    RETURNIFERROR(rc)
+    if (nodecache) { 
+      nodecache->Swizzle(hop,leaf);
+    }
+
+    switch (leaf.info.nodetype) { 
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      rc=leaf.GetPtr(UpperBound(leaf,key),ptr);
+      RETURNIFERROR(rc)
+      if (ptr==0) { 
+	return ERROR_NONEXISTENT;
+      }
+      if (nodecache) { 
+	nodecache->Add(leaf);
+      }
+      break;
+    case BTREE_LEAF_NODE:
+      return ERROR_NOERROR;
+    default:
+      return ERROR_INSANE;
+    }
+  }
+  return ERROR_INSANE;
+}
+
+
+ERROR_T BTreeIndex::Next(BTreeCursor &cursor, KEY_T &key, VALUE_T &value) const
+{
+  ERROR_T rc;
+  SIZE_T next;
+
+  if (cursor.leaf.info.nodetype!=BTREE_LEAF_NODE) { 
+    return ERROR_NONEXISTENT;
+  }
+
+  // Step right along the leaf chain past exhausted (or empty) leaves
+  while (cursor.offset>=cursor.leaf.info.numkeys) { 
+    rc=cursor.leaf.GetPtr(0,next);
+    RETURNIFERROR(rc)
+    if (next==0) { 
+      return ERROR_NONEXISTENT;
+    }
+    rc=cursor.leaf.Unserialize(buffercache,next);
+    RETURNIFERROR(rc)
+    if (cursor.leaf.info.nodetype!=BTREE_LEAF_NODE) { 
+      return ERROR_INSANE;
+    }
+    cursor.offset=0;
+  }
+
+  if (cursor.hasend && cursor.leaf.CompareKey(cursor.offset,cursor.end)>=0) { 
+    return ERROR_NONEXISTENT;
+  }
+
+  rc=cursor.leaf.GetKey(cursor.offset,key);
+  RETURNIFERROR(rc)
+  if (IsUnique()) { 
+    rc= HasBigValues() ? ReadBigValue(cursor.leaf.ResolveVal(cursor.offset),value) :
+      cursor.leaf.GetVal(cursor.offset,value);
+    RETURNIFERROR(rc)
+    cursor.offset++;
+    return ERROR_NOERROR;
+  }
+
+  if (cursor.runoffset==0) { 
+    rc=ReadRun(cursor.leaf,cursor.offset,cursor.run);
+    RETURNIFERROR(rc)
+  }
+  value=cursor.run[cursor.runoffset++];
+  if (cursor.runoffset>=cursor.run.size()) { 
+    cursor.offset++;
+    cursor.runoffset=0;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::LeafDistance(double &avgdistance) const
+{
+  BTreeNodeView b;
+  ERROR_T rc;
+  SIZE_T ptr=superblock.info.rootnode;
+  SIZE_T next;
+  double total=0;
+  SIZE_T numpairs=0;
+
+  avgdistance=0;
+
+  // Down the left edge to the first leaf
+  while (1) { 
+    rc=b.Pin(buffercache,ptr);
+    RETURNIFERROR(rc)
+    if (b.info.nodetype==BTREE_LEAF_NODE) { 
+      break;
+    }
+    if (b.info.nodetype!=BTREE_ROOT_NODE && b.info.nodetype!=BTREE_INTERIOR_NODE) { 
+      return ERROR_INSANE;
+    }
+    rc=b.GetPtr(0,ptr);
+    RETURNIFERROR(rc)
+    if (ptr==0) { 
+      return ERROR_NOERROR;
+    }
+  }
+
+  // and along the chain
+  while (1) { 
+    rc=b.GetPtr(0,next);
+    RETURNIFERROR(rc)
+    if (next==0) { 
+      break;
+    }
+    total+=BlockDistance(ptr,next);
+    numpairs++;
+    ptr=next;
+    rc=b.Pin(buffercache,ptr);
+    RETURNIFERROR(rc)
+    if (b.info.nodetype!=BTREE_LEAF_NODE) { 
+      return ERROR_INSANE;
+    }
+  }
+
+  if (numpairs>0) { 
+    avgdistance=total/numpairs;
+  }
+  return ERROR_NOERROR;
+}
+
+  
+//
+// Runs of values, for an index that is not unique
+//
+// A run's values are in no particular order.  The first runvalues are
+// packed in the leaf entry, and only the rest go to overflow blocks.
+// New ones go into the entry while it has room, then into the run's 
+// first overflow block, or a new first block if that is full.  A value
+// taken out is replaced by the last value of the first block, or of 
+// the entry if there are no blocks, so the entry stays full while 
+// there are blocks and every overflow block but the first is full.
+//
+
+static void GetRun(const BTreeNode &b, const SIZE_T offset, SIZE_T &count, SIZE_T &overflow)
+{
+  char *p=b.ResolveVal(offset);
+
+  memcpy(&count,p,sizeof(SIZE_T));
+  memcpy(&overflow,p+sizeof(SIZE_T),sizeof(SIZE_T));
+}
+
+
+static void SetRun(BTreeNode &b, const SIZE_T offset, const SIZE_T count, const SIZE_T overflow)
+{
+  char *p=b.ResolveVal(offset);
+
+  memcpy(p,&count,sizeof(SIZE_T));
+  memcpy(p+sizeof(SIZE_T),&overflow,sizeof(SIZE_T));
+}
+
+
+// The stub in a leaf for a big value in overflow blocks from first
+static VALUE_T NewStub(const SIZE_T length, const SIZE_T first)
+{
+  VALUE_T stub(BTREE_BIG_VALUE_STUB);
+
+  memcpy(stub.data,&length,sizeof(SIZE_T));
+  memcpy(stub.data+sizeof(SIZE_T),&first,sizeof(SIZE_T));
+  return stub;
+}
+
+
+// The ith value packed in the run at offset in leaf b
+static char *RunValue(const BTreeNode &b, const SIZE_T offset, const SIZE_T i, const SIZE_T valuesize)
+{
+  return b.ResolveVal(offset)+BTREE_RUN_HEADER+i*valuesize;
+}
+
+
+// The leaf value for a new key: a run of just the one value
+static VALUE_T NewRun(const VALUE_T &value, const SIZE_T runsize)
+{
+  VALUE_T run(runsize);
+  SIZE_T count=1;
+  SIZE_T overflow=0;
+
+  memset(run.data,0,runsize);
+  memcpy(run.data,&count,sizeof(SIZE_T));
+  memcpy(run.data+sizeof(SIZE_T),&overflow,sizeof(SIZE_T));
+  memcpy(run.data+BTREE_RUN_HEADER,value.data,value.length);
+  return run;
+}
+
+
+bool BTreeIndex::IsUnique() const
+{
+  return !(superblock.info.options & BTREE_OPT_NONUNIQUE);
+}
+
+
+SIZE_T BTreeIndex::ValueSize() const
+{
+  if (HasBigValues()) { 
+    return superblock.info.bigvaluesize;
+  }
+  return IsUnique() ? superblock.info.valuesize : 
+    (superblock.info.valuesize-BTREE_RUN_HEADER)/superblock.info.runvalues;
+}
+
+
+//
+// Adds value to the run at offset in leaf, which the caller writes.
+// A new overflow block goes near the run's first one, or the leaf.
+//
+ERROR_T BTreeIndex::AddToRun(BTreeNode &leaf, const SIZE_T offset, const SIZE_T near, const BYTE_T *value)
+{
+  ERROR_T rc;
+  SIZE_T count;
+  SIZE_T overflow;
+  SIZE_T block;
+  BTreeNode head;
+
+  GetRun(leaf,offset,count,overflow);
+
+  if (count<superblock.info.runvalues) { 
+    memcpy(RunValue(leaf,offset,count,ValueSize()),value,ValueSize());
+    SetRun(leaf,offset,count+1,overflow);
+    return ERROR_NOERROR;
+  }
+
+  if (overflow!=0) { 
+    rc=head.Unserialize(buffercache,overflow);
+    RETURNIFERROR(rc)
+    if (head.info.numkeys<head.info.GetNumSlotsAsOverflow()) { 
+      head.info.numkeys++;
+      memcpy(head.ResolveVal(head.info.numkeys-1),value,ValueSize());
+      rc=head.Serialize(buffercache,overflow);
+      RETURNIFERROR(rc)
+      SetRun(leaf,offset,count+1,overflow);
+      return ERROR_NOERROR;
+    }
+  }
+
+  head=NewNode(BTREE_OVERFLOW_NODE);
+  rc=AllocateNode(block,OVERFLOW_LEVEL,overflow!=0 ? overflow : near);
+  RETURNIFERROR(rc)
+  rc=head.SetPtr(0,overflow);
+  RETURNIFERROR(rc)
+  head.info.numkeys=1;
+  memcpy(head.ResolveVal(0),value,ValueSize());
+  rc=head.Serialize(buffercache,block);
+  RETURNIFERROR(rc)
+  SetRun(leaf,offset,count+1,block);
+  return ERROR_NOERROR;
+}
+
+
+//
+// Takes value out of the run at offset in leaf, which the caller 
+// writes, and gives the number left.  When the value is the only one
+// the run is left alone and count is 0; the caller deletes the key.
+//
+ERROR_T BTreeIndex::RemoveFromRun(BTreeNode &leaf, const SIZE_T offset, const VALUE_T &value, SIZE_T &count)
+{
+  ERROR_T rc;
+  SIZE_T overflow;
+  SIZE_T block;
+  SIZE_T i;
+  SIZE_T packed;
+  BTreeNode head;
+  BTreeNode b;
+  char *found=0;
+  char *last;
+
+  if (value.length!=ValueSize()) { 
+    return ERROR_SIZE;
+  }
+
+  GetRun(leaf,offset,count,overflow);
+  packed=min(count,superblock.info.runvalues);
+  for (i=0;i<packed && !found;i++) { 
+    if (memcmp(RunValue(leaf,offset,i,ValueSize()),value.data,ValueSize())==0) { 
+      found=RunValue(leaf,offset,i,ValueSize());
+    }
+  }
+
+  if (overflow==0) { 
+    if (!found) { 
+      return ERROR_NONEXISTENT;
+    }
+    if (count==1) { 
+      count=0;
+      return ERROR_NOERROR;
+    }
+    memmove(found,RunValue(leaf,offset,count-1,ValueSize()),ValueSize());
+    count--;
+    SetRun(leaf,offset,count,overflow);
+    return ERROR_NOERROR;
+  }
+
+  rc=head.Unserialize(buffercache,overflow);
+  RETURNIFERROR(rc)
+  last=head.ResolveVal(head.info.numkeys-1);
+
+  if (found) { 
+    memcpy(found,last,ValueSize());
+  } else {
+    for (i=0;i<head.info.numkeys && memcmp(head.ResolveVal(i),value.data,ValueSize())!=0;i++) { 
+    }
+    if (i<head.info.numkeys) { 
+      memcpy(head.ResolveVal(i),last,ValueSize());
+    } else {
+      // somewhere further down the run
+      rc=head.GetPtr(0,block);
+      RETURNIFERROR(rc)
+      while (1) { 
+	if (block==0) { 
+	  return ERROR_NONEXISTENT;
+	}
+	rc=b.Unserialize(buffercache,block);
+	RETURNIFERROR(rc)
+	for (i=0;i<b.info.numkeys && memcmp(b.ResolveVal(i),value.data,ValueSize())!=0;i++) { 
+	}
+	if (i<b.info.numkeys) { 
+	  break;
+	}
+	rc=b.GetPtr(0,block);
+	RETURNIFERROR(rc)
+      }
+      memcpy(b.ResolveVal(i),last,ValueSize());
+      rc=b.Serialize(buffercache,block);
+      RETURNIFERROR(rc)
+    }
+  }
+
+  head.info.numkeys--;
+  if (head.info.numkeys==0) { 
+    block=overflow;
+    rc=head.GetPtr(0,overflow);
+    RETURNIFERROR(rc)
+    rc=DeallocateNode(block);
+    RETURNIFERROR(rc)
+  } else {
+    rc=head.Serialize(buffercache,overflow);
+    RETURNIFERROR(rc)
+  }
+  count--;
+  SetRun(leaf,offset,count,overflow);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::ReadRun(const BTreeNode &leaf, const SIZE_T offset, vector<VALUE_T> &values) const
+{
+  ERROR_T rc;
+  SIZE_T count;
+  SIZE_T block;
+  SIZE_T i;
+  BTreeNodeView b;
+  VALUE_T value(ValueSize());
+
+  GetRun(leaf,offset,count,block);
+  values.clear();
+  values.reserve(count);
+  for (i=0;i<min(count,superblock.info.runvalues);i++) { 
+    memcpy(value.data,RunValue(leaf,offset,i,ValueSize()),ValueSize());
+    values.push_back(value);
+  }
+
+  while (block!=0) { 
+    rc=b.Pin(buffercache,block);
+    RETURNIFERROR(rc)
+    if (b.info.nodetype!=BTREE_OVERFLOW_NODE) { 
+      return ERROR_INSANE;
+    }
+    for (i=0;i<b.info.numkeys;i++) { 
+      rc=b.GetVal(i,value);
+      RETURNIFERROR(rc)
+      values.push_back(value);
+    }
+    rc=b.GetPtr(0,block);
+    RETURNIFERROR(rc)
+  }
+  return values.size()==count ? ERROR_NOERROR : ERROR_INSANE;
+}
+
+
+ERROR_T BTreeIndex::FreeRun(SIZE_T overflow)
+{
+  ERROR_T rc;
+  BTreeNode b;
+  SIZE_T next;
+
+  while (overflow!=0) { 
+    rc=b.Unserialize(buffercache,overflow);
+    RETURNIFERROR(rc)
+    rc=b.GetPtr(0,next);
+    RETURNIFERROR(rc)
+    rc=DeallocateNode(overflow);
+    RETURNIFERROR(rc)
+    overflow=next;
+  }
+  return ERROR_NOERROR;
+}
+
+
+//
+// Writes a big value into the overflow blocks of the chain at first,
+// which holds one already, or if first is 0 into a new chain, given
+// back in first.  The blocks of a new chain are taken in order from 
+// extents of their own, so they do not come between the leaves.
+//
+ERROR_T BTreeIndex::WriteBigValue(const VALUE_T &value, SIZE_T &first)
+{
+  ERROR_T rc;
+  SIZE_T done;
+  SIZE_T n;
+  SIZE_T block;
+  SIZE_T next;
+
+  if (value.length!=ValueSize()) { 
+    return ERROR_SIZE;
+  }
+
+  if (first!=0) { 
+    // the same length as before, so the same blocks
+    BTreeNodeView b;
+
+    for (done=0,block=first; done<value.length; done+=n) { 
+      if (block==0) { 
+	return ERROR_INSANE;
+      }
+      rc=b.Pin(buffercache,block);
+      RETURNIFERROR(rc)
+      if (b.info.nodetype!=BTREE_OVERFLOW_NODE || b.info.numkeys==0) { 
+	return ERROR_INSANE;
+      }
+      n=min(b.info.numkeys,value.length-done);
+      memcpy(b.ResolveBytes(),value.data+done,n);
+      rc=b.MarkDirty();
+      RETURNIFERROR(rc)
+      rc=b.GetPtr(0,block);
+      RETURNIFERROR(rc)
+    }
+    return ERROR_NOERROR;
+  }
+
+  BTreeNode b=NewNode(BTREE_OVERFLOW_NODE);
+
+  rc=AllocateNode(first,OVERFLOW_LEVEL,0);
+  RETURNIFERROR(rc)
+  for (done=0,block=first; done<value.length; done+=n,block=next) { 
+    n=min(b.info.GetNumOverflowBytes(),value.length-done);
+    next=0;
+    if (done+n<value.length) { 
+      rc=AllocateNode(next,OVERFLOW_LEVEL,block);
+      RETURNIFERROR(rc)
+    }
+    b.info.numkeys=n;
+    memcpy(b.ResolveBytes(),value.data+done,n);
+    rc=b.SetPtr(0,next);
+    RETURNIFERROR(rc)
+    rc=b.Serialize(buffercache,block);
+    RETURNIFERROR(rc)
+  }
+  return ERROR_NOERROR;
+}
+
+
+// The big value whose stub is at stub, from its overflow blocks
+ERROR_T BTreeIndex::ReadBigValue(const char *stub, VALUE_T &value) const
+{
+  ERROR_T rc;
+  SIZE_T length;
+  SIZE_T block;
+  SIZE_T done;
+  BTreeNodeView b;
+
+  memcpy(&length,stub,sizeof(SIZE_T));
+  memcpy(&block,stub+sizeof(SIZE_T),sizeof(SIZE_T));
+  value.Resize(length,false);
+
+  for (done=0; done<length; done+=b.info.numkeys) { 
+    if (block==0) { 
+      return ERROR_INSANE;
+    }
+    rc=b.Pin(buffercache,block);
+    RETURNIFERROR(rc)
+    if (b.info.nodetype!=BTREE_OVERFLOW_NODE || 
+	b.info.numkeys==0 || b.info.numkeys>length-done) { 
+      return ERROR_INSANE;
+    }
+    memcpy(value.data+done,b.ResolveBytes(),b.info.numkeys);
+    rc=b.GetPtr(0,block);
+    RETURNIFERROR(rc)
+  }
+  return block==0 ? ERROR_NOERROR : ERROR_INSANE;
+}
+
+
+ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+{
+  ERROR_T rc;
+  VALUE_T run;
+
+  if (key.length>superblock.info.keysize) { 
+    return ERROR_SIZE;
+  }
+  if (IsShortKey(key)) { 
+    return Lookup(PaddedKey(key),value);
+  }
+  rc=PinUpperLevels();
+  RETURNIFERROR(rc)
+
+  if (HasBigValues()) { 
+    rc=LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, run);
+    RETURNIFERROR(rc)
+    return ReadBigValue((const char*)run.data,value);
+  }
+  if (IsUnique()) { 
+    return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+  }
+  rc=LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, run);
+  RETURNIFERROR(rc)
+  value.Resize(ValueSize(),false);
+  memcpy(value.data,run.data+BTREE_RUN_HEADER,ValueSize());
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::LookupAll(const KEY_T &key, vector<VALUE_T> &values)
+{
+  ERROR_T rc;
+  BTreeNodeView b;
+  SIZE_T offset;
+
+  if (key.length>superblock.info.keysize) { 
+    return ERROR_SIZE;
+  }
+  if (IsShortKey(key)) { 
+    return LookupAll(PaddedKey(key),values);
+  }
+  values.clear();
+  rc=PinUpperLevels();
+  RETURNIFERROR(rc)
+  rc=FindLeaf(key,b);
+  RETURNIFERROR(rc)
+  offset=LowerBound(b,key);
+  if (offset>=b.info.numkeys || b.CompareKey(offset,key)!=0) { 
+    return ERROR_NONEXISTENT;
+  }
+  if (IsUnique()) { 
+    values.resize(1);
+    return HasBigValues() ? ReadBigValue(b.ResolveVal(offset),values[0]) : b.GetVal(offset,values[0]);
+  }
+  return ReadRun(b,offset,values);
+}
+
+
+ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+  ERROR_T rc;
+  SIZE_T first=0;
+
+  if (key.length>superblock.info.keysize) { 
+    return ERROR_SIZE;
+  }
+  if (IsShortKey(key)) { 
+    return Insert(PaddedKey(key),value);
+  }
+  rc=PinUpperLevels();
+  RETURNIFERROR(rc)
+  if (HasSlottedPages() && value.length>superblock.info.valuesize) { 
+    return ERROR_SIZE;
+  }
+  if (HasBigValues()) { 
+    VALUE_T stub;
+    // a key that is there already costs no chain
+    rc=LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, stub);
+    if (rc==ERROR_NOERROR) { 
+      return ERROR_CONFLICT;
+    }
+    if (rc!=ERROR_NONEXISTENT) { 
+      return rc;
+    }
+    rc=WriteBigValue(value,first);
+    RETURNIFERROR(rc)
+    rc=InsertInternal(superblock.info.rootnode, BTREE_OP_INSERT, key, NewStub(value.length,first));
+    if (rc!=ERROR_NOERROR) { 
+      // no room for the stub
+      ERROR_T freerc=FreeRun(first);
+      RETURNIFERROR(freerc)
+    }
+    return rc;
+  }
+  if (IsUnique()) { 
+    return InsertInternal(superblock.info.rootnode, BTREE_OP_INSERT, key, value);
+  }
+  if (value.length!=ValueSize()) { 
+    return ERROR_SIZE;
+  }
+  return InsertInternal(superblock.info.rootnode, BTREE_OP_INSERT, key, 
+			NewRun(value,superblock.info.valuesize));
+}
+  
+ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+  ERROR_T rc;
+  SIZE_T count;
+  SIZE_T first;
+  VALUE_T run;
+
+  if (key.length>superblock.info.keysize) { 
+    return ERROR_SIZE;
+  }
+  if (IsShortKey(key)) { 
+    return Update(PaddedKey(key),value);
+  }
+  rc=PinUpperLevels();
+  RETURNIFERROR(rc)
+  if (HasBigValues()) { 
+    if (value.length!=ValueSize()) { 
+      return ERROR_SIZE;
+    }
+    rc=LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, run);
+    RETURNIFERROR(rc)
+    memcpy(&first,run.data+sizeof(SIZE_T),sizeof(SIZE_T));
+    if (first==0) { 
+      return ERROR_INSANE;
+    }
+    // over the old bytes; the stub stays as it is
+    return WriteBigValue(value,first);
+  }
+  if (HasSlottedPages()) { 
+    VALUE_T v(value);
+    if (value.length>superblock.info.valuesize) { 
+      return ERROR_SIZE;
+    }
+    rc=LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, v);
+    if (rc!=ERROR_NOSPACE) { 
+      return rc;
+    }
+    // too long for what is left of its leaf, which splits
+    return InsertInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, value);
+  }
+  if (IsUnique()) { 
+    VALUE_T v(value);
+    return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, v);
+  }
+  if (value.length!=ValueSize()) { 
+    return ERROR_SIZE;
+  }
+  rc=LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, run);
+  RETURNIFERROR(rc)
+  memcpy(&count,run.data,sizeof(SIZE_T));
+  if (count!=1) { 
+    return ERROR_CONFLICT;
+  }
+  memcpy(run.data+BTREE_RUN_HEADER,value.data,ValueSize());
+  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, run);
+}
+
+  
+ERROR_T BTreeIndex::Delete(const KEY_T &key)
+{
+  ERROR_T rc;
+  bool underflow;
+  bool split;
+  SIZE_T level;
+  KEY_T upkey;
+  SIZE_T upptr;
+  SIZE_T overflow;
+  VALUE_T run;
+
+  if (key.length>superblock.info.keysize) { 
+    return ERROR_SIZE;
+  }
+  if (IsShortKey(key)) { 
+    return Delete(PaddedKey(key));
+  }
+  rc=PinUpperLevels();
+  RETURNIFERROR(rc)
+  overflow=0;
+  if (!IsUnique() || HasBigValues()) { 
+    // a run and a stub both have their first overflow block second
+    rc=LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, run);
+    RETURNIFERROR(rc)
+    memcpy(&overflow,run.data+sizeof(SIZE_T),sizeof(SIZE_T));
+  }
+  rightmost.valid=false;
+  rc=DeleteInternal(superblock.info.rootnode, key, underflow, level, split, upkey, upptr);
+  RETURNIFERROR(rc)
+  // only once no leaf points at them
+  return FreeRun(overflow);
+}
+
+
+ERROR_T BTreeIndex::Delete(const KEY_T &key, const VALUE_T &value)
+{
+  ERROR_T rc;
+  BTreeNodeView b;
+  SIZE_T offset;
+  SIZE_T count;
+
+  if (key.length>superblock.info.keysize) { 
+    return ERROR_SIZE;
+  }
+  if (IsShortKey(key)) { 
+    return Delete(PaddedKey(key),value);
+  }
+  rc=PinUpperLevels();
+  RETURNIFERROR(rc)
+  rc=FindLeaf(key,b);
+  RETURNIFERROR(rc)
+  offset=LowerBound(b,key);
+  if (offset>=b.info.numkeys || b.CompareKey(offset,key)!=0) { 
+    return ERROR_NONEXISTENT;
+  }
+  if (HasBigValues()) { 
+    VALUE_T v;
+    rc=ReadBigValue(b.ResolveVal(offset),v);
+    RETURNIFERROR(rc)
+    if (value.length!=v.length || memcmp(v.data,value.data,value.length)!=0) { 
+      return ERROR_NONEXISTENT;
+    }
+    count=0;
+  } else if (IsUnique()) { 
+    if (value.length!=(HasSlottedPages() ? b.GetValLength(offset) : superblock.info.valuesize) || 
+	memcmp(b.ResolveVal(offset),value.data,value.length)!=0) { 
+      return ERROR_NONEXISTENT;
+    }
+    count=0;
+  } else {
+    rc=RemoveFromRun(b,offset,value,count);
+    RETURNIFERROR(rc)
+  }
+  if (count>0) { 
+    return b.MarkDirty();
+  }
+  rc=b.Unpin();
+  RETURNIFERROR(rc)
+  return Delete(key);
+}
+
+
+
+
+ERROR_T BTreeIndex::DeleteInternal(const SIZE_T &node,
+                                   const KEY_T &key,
+                                   bool &underflow,
+                                   SIZE_T &level,
+                                   bool &split,
+                                   KEY_T &upkey,
+                                   SIZE_T &upptr)
+{
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T offset;
+  SIZE_T ptr;
+  bool childunderflow;
+  bool childsplit;
+  bool merged;
+  bool moved;
+  KEY_T sep;
+  SIZE_T sepoff, sepptr;
+
+  underflow=false;
+  split=false;
+  level=0;
+
+  rc=b.Unserialize(buffercache,node);
+  RETURNIFERROR(rc)
+
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
   case BTREE_INTERIOR_NODE:
-    if (dt==BTREE_SORTED_KEYVAL) {
-    } else {
-      if (dt==BTREE_DEPTH_DOT) { 
-      } else { 
-	os << "Interior: ";
-      }
-      for (offset=0;offset<=b.info.numkeys;offset++) { 
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	os << "*" << ptr << " ";
-	// Last pointer
-	if (offset==b.info.numkeys) break;
-	rc=b.GetKey(offset,key);
-	if (rc) {  return rc; }
-	for (i=0;i<b.info.keysize;i++) { 
-	  os << key.data[i];
-	}
-	os << " ";
+    offset=UpperBound(b,key);
+    rc=b.GetPtr(offset,ptr);
+    RETURNIFERROR(rc)
+    if (ptr==0) { 
+      // empty root with no leaf yet
+      return ERROR_NONEXISTENT;
+    }
+    rc=DeleteInternal(ptr,key,childunderflow,level,childsplit,sep,sepptr);
+    RETURNIFERROR(rc)
+    level++;
+    if (childsplit) { 
+      // the child took a separator it had no room for
+      return PutInteriorEntry(b,node,level,offset,sep,sepptr,split,upkey,upptr);
+    }
+    if (!childunderflow || b.info.numkeys==0) { 
+      // Nothing to fix, or a root over a single leaf, which may 
+      // get as small as it likes
+      return ERROR_NOERROR;
+    }
+    rc=RebalanceChild(b,offset,merged,moved,sep,sepoff,sepptr);
+    RETURNIFERROR(rc)
+    if (moved) { 
+      return PutInteriorEntry(b,node,level,sepoff,sep,sepptr,split,upkey,upptr);
+    }
+    if (!merged) { 
+      return b.Serialize(buffercache,node);
+    }
+    if (b.info.nodetype==BTREE_INTERIOR_NODE) { 
+      underflow = Underfull(b);
+      return b.Serialize(buffercache,node);
+    }
+    if (b.info.numkeys==0) { 
+      // The root has lost its last key.  If its only child is an
+      // interior node, pull that child up into the root block, 
+      // and the tree gets one level shorter.
+      BTreeNode child;
+      rc=b.GetPtr(0,ptr);
+      RETURNIFERROR(rc)
+      rc=child.Unserialize(buffercache,ptr);
+      RETURNIFERROR(rc)
+      if (child.info.nodetype==BTREE_INTERIOR_NODE) { 
+        // the root's range is everything, so no prefix
+        child.info.nodetype=BTREE_ROOT_NODE;
+        rc=child.SetPrefix(child.ResolvePrefix(),0);
+        RETURNIFERROR(rc)
+        rc=child.Serialize(buffercache,node);
+        RETURNIFERROR(rc)
+        return DeallocateNode(ptr);
       }
     }
-    break;
+    return b.Serialize(buffercache,node);
   case BTREE_LEAF_NODE:
-    if (dt==BTREE_DEPTH_DOT || dt==BTREE_SORTED_KEYVAL) { 
+    offset=LowerBound(b,key);
+    if (offset>=b.info.numkeys || b.CompareKey(offset,key)!=0) { 
+      return ERROR_NONEXISTENT;
+    }
+    rc=RemoveLeafEntry(b,offset);
+    RETURNIFERROR(rc)
+    underflow = Underfull(b);
+    return b.Serialize(buffercache,node);
+  default:
+    return ERROR_INSANE;
+  }
+
+  return ERROR_INSANE;
+}
+
+
+//
+// The child at pointer offset of parent has underflowed.  Borrow an
+// entry from an adjacent sibling if it can spare one, otherwise merge
+// the two, dropping the separator from parent and freeing the right
+// hand node.  The children are written here; the caller writes parent.
+//
+// With suffix truncation the separator a borrow sends up may need 
+// more bytes than parent keeps and has room for, and so may a longer
+// one with slotted pages.  Then parent drops the old separator and
+// the pointer after it, and moved says the caller must put sep and
+// sepptr back as entry sepoff, splitting parent if need be.  Slotted
+// nodes merge whenever the two fit in one.
+//
+ERROR_T BTreeIndex::RebalanceChild(BTreeNode &parent,
+                                   const SIZE_T offset,
+                                   bool &merged,
+                                   bool &moved,
+                                   KEY_T &sep,
+                                   SIZE_T &sepoff,
+                                   SIZE_T &sepptr)
+{
+  ERROR_T rc;
+  SIZE_T leftoff;
+  SIZE_T leftptr, rightptr;
+  BTreeNode left, right;
+  KEY_T tempkey;
+  SIZE_T tempptr;
+  KeyValuePair kv;
+
+  merged=false;
+  moved=false;
+
+  // Work on the pair (leftoff, leftoff+1) that contains the child;
+  // prefer the left sibling when there is one
+  leftoff = offset>0 ? offset-1 : offset;
+
+  rc=parent.GetPtr(leftoff,leftptr);
+  RETURNIFERROR(rc)
+  rc=parent.GetPtr(leftoff+1,rightptr);
+  RETURNIFERROR(rc)
+  rc=parent.GetKey(leftoff,sep);
+  RETURNIFERROR(rc)
+  rc=left.Unserialize(buffercache,leftptr);
+  RETURNIFERROR(rc)
+  rc=right.Unserialize(buffercache,rightptr);
+  RETURNIFERROR(rc)
+
+  BTreeNode &child = (leftoff==offset) ? left : right;
+  BTreeNode &sibling = (leftoff==offset) ? right : left;
+
+  if ((child.info.options & BTREE_NODE_SLOTTED) ? !MergeFits(left,right,sep) : 
+      sibling.info.numkeys > MinKeys(sibling.info)) { 
+    // Redistribute one entry through the parent, which takes the 
+    // separator between what each side is left with
+    if (child.info.nodetype==BTREE_LEAF_NODE) { 
+      KEY_T last, first;
+      SIZE_T at= (&sibling==&left) ? left.info.numkeys-1 : 1;
+      rc=sibling.GetKey(at-1,last);
+      RETURNIFERROR(rc)
+      rc=sibling.GetKey(at,first);
+      RETURNIFERROR(rc)
+      Separator(last,first,sep);
     } else {
-      os << "Leaf: ";
+      rc=sibling.GetKey((&sibling==&left) ? left.info.numkeys-1 : 0,sep);
+      RETURNIFERROR(rc)
     }
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      if (offset==0) { 
-	// special case for first pointer
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	if (dt!=BTREE_SORTED_KEYVAL) { 
-	  os << "*" << ptr << " ";
-	}
-      }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << "(";
-      }
-      rc=b.GetKey(offset,key);
-      if (rc) {  return rc; }
-      for (i=0;i<b.info.keysize;i++) { 
-	os << key.data[i];
-      }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << ",";
+    moved=!InteriorHasRoomAt(parent,leftoff,sep);
+    rc=parent.GetKey(leftoff,tempkey);
+    RETURNIFERROR(rc)
+    rc=SharePrefix(child,sibling);
+    RETURNIFERROR(rc)
+    if (child.info.nodetype==BTREE_LEAF_NODE) { 
+      if (&sibling==&left) { 
+        rc=left.GetKeyVal(left.info.numkeys-1,kv);
+        RETURNIFERROR(rc)
+        rc=RemoveLeafEntry(left,left.info.numkeys-1);
+        RETURNIFERROR(rc)
+        rc=InsertLeafEntry(right,0,kv.key,kv.value);
+        RETURNIFERROR(rc)
       } else {
-	os << " ";
-      }
-      rc=b.GetVal(offset,value);
-      if (rc) {  return rc; }
-      for (i=0;i<b.info.valuesize;i++) { 
-	os << value.data[i];
+        rc=right.GetKeyVal(0,kv);
+        RETURNIFERROR(rc)
+        rc=RemoveLeafEntry(right,0);
+        RETURNIFERROR(rc)
+        rc=InsertLeafEntry(left,left.info.numkeys,kv.key,kv.value);
+        RETURNIFERROR(rc)
       }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << ")\n";
+    } else {
+      // tempkey, the old separator, comes down into child and sep, the
+      // sibling's key nearest it, goes up
+      if (&sibling==&left) { 
+        rc=right.GetPtr(0,tempptr);
+        RETURNIFERROR(rc)
+        rc=InsertInteriorEntry(right,0,tempkey,tempptr);
+        RETURNIFERROR(rc)
+        rc=left.GetPtr(left.info.numkeys,tempptr);
+        RETURNIFERROR(rc)
+        rc=right.SetPtr(0,tempptr);
+        RETURNIFERROR(rc)
+        left.info.numkeys--;
       } else {
-	os << " ";
+        rc=right.GetPtr(0,tempptr);
+        RETURNIFERROR(rc)
+        rc=InsertInteriorEntry(left,left.info.numkeys,tempkey,tempptr);
+        RETURNIFERROR(rc)
+        rc=right.GetPtr(1,tempptr);
+        RETURNIFERROR(rc)
+        rc=RemoveInteriorEntry(right,0);
+        RETURNIFERROR(rc)
+        rc=right.SetPtr(0,tempptr);
+        RETURNIFERROR(rc)
       }
     }
-    break;
-  default:
-    if (dt==BTREE_DEPTH_DOT) { 
-      os << "Unknown("<<b.info.nodetype<<")";
-    } else {
-      os << "Unsupported Node Type " << b.info.nodetype ;
+    if (moved) { 
+      sepoff=leftoff;
+      sepptr=rightptr;
+      rc=RemoveInteriorEntry(parent,leftoff);
+    } else {
+      rc=WidenFor(parent,sep);
+      RETURNIFERROR(rc)
+      rc=parent.SetKey(leftoff,sep);
+    }
+    RETURNIFERROR(rc)
+    rc=left.Serialize(buffercache,leftptr);
+    RETURNIFERROR(rc)
+    return right.Serialize(buffercache,rightptr);
+  }
+
+  // Merge right into left
+  rc=SharePrefix(left,right);
+  RETURNIFERROR(rc)
+  if (left.info.nodetype==BTREE_LEAF_NODE) { 
+    // right drops out of the leaf chain
+    rc=right.GetPtr(0,tempptr);
+    RETURNIFERROR(rc)
+    rc=left.SetPtr(0,tempptr);
+    RETURNIFERROR(rc)
+    rc=MoveLeafTail(right,0,left);
+    RETURNIFERROR(rc)
+  } else {
+    rc=right.GetPtr(0,tempptr);
+    RETURNIFERROR(rc)
+    rc=InsertInteriorEntry(left,left.info.numkeys,sep,tempptr);
+    RETURNIFERROR(rc)
+    rc=MoveInteriorTail(right,0,left);
+    RETURNIFERROR(rc)
+  }
+  rc=RemoveInteriorEntry(parent,leftoff);
+  RETURNIFERROR(rc)
+  rc=left.Serialize(buffercache,leftptr);
+  RETURNIFERROR(rc)
+  merged=true;
+  return DeallocateNode(rightptr);
+}
+
+
+BTreeBulkLoad::BTreeBulkLoad() : active(false), leafkeys(0), interiorkeys(0), leafbytes(0), leafblock(0)
+{}
+
+
+ERROR_T BTreeIndex::BulkLoadBegin(const double fillfactor)
+{
+  ERROR_T rc;
+  BTreeNode root;
+  BTreeNode leaf;
+  SIZE_T ptr;
+  NodeMetadata info=superblock.info;
+
+  if (bulk.active || fillfactor<0.5 || fillfactor>1.0) { 
+    return ERROR_INSANE;
+  }
+
+  // Only an empty index can be bulk loaded.  Give back its empty
+  // leaf, if any, so the load starts at the head of the free list.
+  rc=root.Unserialize(buffercache,superblock.info.rootnode);
+  RETURNIFERROR(rc)
+  if (root.info.numkeys>0) { 
+    return ERROR_CONFLICT;
+  }
+  rc=root.GetPtr(0,ptr);
+  RETURNIFERROR(rc)
+  if (ptr!=0) { 
+    rc=leaf.Unserialize(buffercache,ptr);
+    RETURNIFERROR(rc)
+    if (leaf.info.numkeys>0) { 
+      return ERROR_CONFLICT;
+    }
+    rc=root.SetPtr(0,0);
+    RETURNIFERROR(rc)
+    rc=root.Serialize(buffercache,superblock.info.rootnode);
+    RETURNIFERROR(rc)
+    rc=DeallocateNode(ptr);
+    RETURNIFERROR(rc)
+  }
+
+  bulk=BTreeBulkLoad();
+  bulk.active=true;
+  rightmost.valid=false;
+
+  // Never below the fill that Delete maintains
+  info.nodetype=BTREE_LEAF_NODE;
+  bulk.leafkeys=(SIZE_T)(fillfactor*info.GetNumSlotsAsLeaf());
+  if (bulk.leafkeys<MinKeys(info)) { 
+    bulk.leafkeys=MinKeys(info);
+  }
+  if (bulk.leafkeys<1) { 
+    bulk.leafkeys=1;
+  }
+  bulk.leafbytes=(SIZE_T)(fillfactor*info.GetNumSlottedBytes());
+  info.nodetype=BTREE_INTERIOR_NODE;
+  bulk.interiorkeys=(SIZE_T)(fillfactor*info.GetNumSlotsAsInterior());
+  if (bulk.interiorkeys<MinKeys(info)) { 
+    bulk.interiorkeys=MinKeys(info);
+  }
+  if (bulk.interiorkeys<1) { 
+    bulk.interiorkeys=1;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::BulkLoadAppend(const KEY_T &key, const VALUE_T &value)
+{
+  ERROR_T rc;
+  SIZE_T next;
+  KEY_T sep;
+
+  if (key.length>superblock.info.keysize) { 
+    return ERROR_SIZE;
+  }
+  if (IsShortKey(key)) { 
+    return BulkLoadAppend(PaddedKey(key),value);
+  }
+  if (!bulk.active) { 
+    return ERROR_INSANE;
+  }
+  if (HasSlottedPages() ? value.length>superblock.info.valuesize : value.length!=ValueSize()) { 
+    return ERROR_SIZE;
+  }
+
+  if (bulk.leaf.info.nodetype!=BTREE_LEAF_NODE) { 
+    // first pair
+    rc=AllocateNode(bulk.leafblock,0,0);
+    RETURNIFERROR(rc)
+    bulk.leaf=NewNode(BTREE_LEAF_NODE);
+    bulk.leaflow=key;
+  } else {
+    if (!IsUnique() && CompareKeys(bulk.lastkey,key)==0) { 
+      return AddToRun(bulk.leaf,bulk.leaf.info.numkeys-1,bulk.leafblock,value.data);
+    }
+    if (CompareKeys(bulk.lastkey,key)>=0) { 
+      return ERROR_CONFLICT;
+    }
+    if (HasSlottedPages() ? 
+	bulk.leaf.GetUsedBytes()+BTreeSlottedEntryBytes(key.length,value.length)>bulk.leafbytes :
+	bulk.leaf.info.numkeys>=bulk.leafkeys) { 
+      // This leaf is done.  Its successor is allocated first so
+      // the leaf can be written with its chain pointer in place.
+      rc=AllocateNode(next,0,bulk.leafblock);
+      RETURNIFERROR(rc)
+      rc=bulk.leaf.SetPtr(0,next);
+      RETURNIFERROR(rc)
+      // Its range ends at the separator before the next leaf
+      Separator(bulk.lastkey,key,sep);
+      rc=SetRangePrefix(bulk.leaf,!bulk.blocks.empty(),bulk.leaflow,true,sep);
+      RETURNIFERROR(rc)
+      rc=bulk.leaf.Serialize(buffercache,bulk.leafblock);
+      RETURNIFERROR(rc)
+      bulk.leaflows.push_back(bulk.leaflow);
+      bulk.blocks.push_back(bulk.leafblock);
+      bulk.leaflow=sep;
+      bulk.leafblock=next;
+      bulk.leaf.info.numkeys=0;
+      rc=bulk.leaf.SetPrefix(bulk.leaf.ResolvePrefix(),0);
+      RETURNIFERROR(rc)
+      rc=bulk.leaf.SetPtr(0,0);
+      RETURNIFERROR(rc)
     }
   }
-  if (dt==BTREE_DEPTH_DOT) { 
-    os << "\" ]";
+
+  bulk.lastkey=key;
+  if (!IsUnique()) { 
+    return InsertLeafEntry(bulk.leaf,bulk.leaf.info.numkeys,key,NewRun(value,superblock.info.valuesize));
   }
-  return ERROR_NOERROR;
-}
-  
-ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
-{
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+  if (HasBigValues()) { 
+    SIZE_T first=0;
+    rc=WriteBigValue(value,first);
+    RETURNIFERROR(rc)
+    return InsertLeafEntry(bulk.leaf,bulk.leaf.info.numkeys,key,NewStub(value.length,first));
+  }
+  return InsertLeafEntry(bulk.leaf,bulk.leaf.info.numkeys,key,value);
 }
 
-ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
-{
-  // WRITE ME
-  return InsertInternal(superblock.info.rootnode, BTREE_OP_INSERT, key, value);
-}
-  
-ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
-{
-    VALUE_T v(value);
-    return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, v);
-}
 
-  
-ERROR_T BTreeIndex::Delete(const KEY_T &key)
+ERROR_T BTreeIndex::BulkLoadEnd()
 {
-  // This is optional extra credit 
-  //
-  // 
-  return ERROR_UNIMPL;
+  ERROR_T rc;
+  BTreeNode root;
+  KEY_T lastkey, firstkey;
+  KeyValuePair kv;
+  vector<KEY_T> keys;
+  vector<SIZE_T> ptrs;
+
+  if (!bulk.active) { 
+    return ERROR_INSANE;
+  }
+  bulk.active=false;
+
+  if (bulk.leaf.info.nodetype==BTREE_LEAF_NODE) { 
+    if (bulk.blocks.size()>0 && Underfull(bulk.leaf)) { 
+      // The last leaf came up short.  Share with the previous leaf,
+      // or fold into it if there is not enough for two.
+      BTreeNode prev;
+      SIZE_T prevblock=bulk.blocks.back();
+      rc=prev.Unserialize(buffercache,prevblock);
+      RETURNIFERROR(rc)
+      bool slotted=HasSlottedPages();
+      SIZE_T total=prev.info.numkeys+bulk.leaf.info.numkeys;
+      if (slotted ? !MergeFits(prev,bulk.leaf,bulk.lastkey) : total>=2*MinKeys(bulk.leaf.info)) { 
+	while (slotted ? bulk.leaf.GetUsedBytes()<prev.GetUsedBytes() : bulk.leaf.info.numkeys<total/2) { 
+	  rc=prev.GetKeyVal(prev.info.numkeys-1,kv);
+	  RETURNIFERROR(rc)
+	  rc=RemoveLeafEntry(prev,prev.info.numkeys-1);
+	  RETURNIFERROR(rc)
+	  rc=InsertLeafEntry(bulk.leaf,0,kv.key,kv.value);
+	  RETURNIFERROR(rc)
+	}
+	rc=prev.GetKey(prev.info.numkeys-1,lastkey);
+	RETURNIFERROR(rc)
+	rc=bulk.leaf.GetKey(0,firstkey);
+	RETURNIFERROR(rc)
+	Separator(lastkey,firstkey,bulk.leaflow);
+	rc=prev.Serialize(buffercache,prevblock);
+	RETURNIFERROR(rc)
+      } else {
+	// prev becomes the last leaf, open ended
+	rc=prev.SetPrefix(prev.ResolvePrefix(),0);
+	RETURNIFERROR(rc)
+	rc=MoveLeafTail(bulk.leaf,0,prev);
+	RETURNIFERROR(rc)
+	rc=prev.SetPtr(0,0);
+	RETURNIFERROR(rc)
+	rc=prev.Serialize(buffercache,prevblock);
+	RETURNIFERROR(rc)
+	rc=bulk.leaf.Serialize(buffercache,bulk.leafblock);
+	RETURNIFERROR(rc)
+	rc=DeallocateNode(bulk.leafblock);
+	RETURNIFERROR(rc)
+	bulk.leaf.info.numkeys=0;
+      }
+    }
+    if (bulk.leaf.info.numkeys>0) { 
+      rc=bulk.leaf.Serialize(buffercache,bulk.leafblock);
+      RETURNIFERROR(rc)
+      bulk.leaflows.push_back(bulk.leaflow);
+      bulk.blocks.push_back(bulk.leafblock);
+    }
+  }
+
+  // Now build the interior levels, each from the separator below and
+  // block of every node on the level below, until they fit in the root
+  SIZE_T perinterior=bulk.interiorkeys;
+  keys.swap(bulk.leaflows);
+  ptrs.swap(bulk.blocks);
+  bulk=BTreeBulkLoad();
+
+  NodeMetadata info=superblock.info;
+  info.nodetype=BTREE_INTERIOR_NODE;
+  SIZE_T minchildren=MinKeys(info)+1;
+
+  for (SIZE_T level=1; ptrs.size()>info.GetNumSlotsAsInterior()+1; level++) { 
+    vector<KEY_T> upkeys;
+    vector<SIZE_T> upptrs;
+    SIZE_T numnodes=(ptrs.size()+perinterior)/(perinterior+1);
+    SIZE_T start=0;
+
+    // Spread the children evenly, keeping every node at least half full
+    while (numnodes>1 && ptrs.size()/numnodes<minchildren) { 
+      numnodes--;
+    }
+
+    for (SIZE_T i=0;i<numnodes;i++) { 
+      SIZE_T count=ptrs.size()/numnodes + (i<ptrs.size()%numnodes ? 1 : 0);
+      SIZE_T n;
+      BTreeNode node=NewNode(BTREE_INTERIOR_NODE);
+      rc=AllocateNode(n,level,upptrs.empty() ? 0 : upptrs.back());
+      RETURNIFERROR(rc)
+      rc=SetRangePrefix(node,start>0,keys[start],start+count<keys.size(),
+			start+count<keys.size() ? keys[start+count] : keys[start]);
+      RETURNIFERROR(rc)
+      for (SIZE_T j=1;j<count;j++) { 
+	rc=WidenFor(node,keys[start+j]);
+	RETURNIFERROR(rc)
+      }
+      rc=node.SetPtr(0,ptrs[start]);
+      RETURNIFERROR(rc)
+      for (SIZE_T j=1;j<count;j++) { 
+	rc=InsertInteriorEntry(node,j-1,keys[start+j],ptrs[start+j]);
+	RETURNIFERROR(rc)
+      }
+      rc=node.Serialize(buffercache,n);
+      RETURNIFERROR(rc)
+      upkeys.push_back(keys[start]);
+      upptrs.push_back(n);
+      start+=count;
+    }
+    keys.swap(upkeys);
+    ptrs.swap(upptrs);
+  }
+
+  rc=root.Unserialize(buffercache,superblock.info.rootnode);
+  RETURNIFERROR(rc)
+  for (SIZE_T j=1;j<ptrs.size();j++) { 
+    rc=WidenFor(root,keys[j]);
+    RETURNIFERROR(rc)
+  }
+  rc=root.SetPtr(0, ptrs.size()>0 ? ptrs[0] : 0);
+  RETURNIFERROR(rc)
+  for (SIZE_T j=1;j<ptrs.size();j++) { 
+    rc=InsertInteriorEntry(root,j-1,keys[j],ptrs[j]);
+    RETURNIFERROR(rc)
+  }
+  return root.Serialize(buffercache,superblock.info.rootnode);
 }
 
   
@@ -903,7 +3498,7 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
     return rc;
   }
 
-  rc = PrintNode(o,node,b,display_type);
+  rc = PrintNode(o,node,b,display_type,*this);
   
   if (rc) { return rc; }
 
@@ -949,6 +3544,25 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
 ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
 {
   ERROR_T rc;
+  if (display_type==BTREE_SORTED_KEYVAL) { 
+    // Just walk the leaves in order
+    BTreeCursor cursor;
+    KEY_T key;
+    VALUE_T value;
+    unsigned i;
+    rc=SeekFirst(cursor);
+    if (rc) { return rc; }
+    while ((rc=Next(cursor,key,value))==ERROR_NOERROR) { 
+      o << "(";
+      PrintKey(o,key);
+      o << ",";
+      for (i=0;i<value.length;i++) { 
+	o << value.data[i];
+      }
+      o << ")\n";
+    }
+    return rc==ERROR_NONEXISTENT ? ERROR_NOERROR : rc;
+  }
   if (display_type==BTREE_DEPTH_DOT) { 
     o << "digraph tree { \n";
   }
@@ -960,17 +3574,620 @@ ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
 }
 
 
+//
+// SanityCheck reads the tree a level at a time.  The level above
+// gives the blocks of the next one in key order, each with the range
+// its keys must fall in.  A level is read in block order, a batch at a
+// time, so the disk sweeps across it instead of seeking to and fro,
+// and the nodes of a batch are checked on several threads.  Reading
+// stays on the calling thread, as the buffer cache is not thread safe.
+// Last, every block on the disk is accounted for.
+//
+
+#define SANITY_THREADS 4
+#define SANITY_BATCH   1024
+
+// What a block was found to be
+#define SANITY_UNSEEN 0
+#define SANITY_INUSE  1   // the superblock or a node
+#define SANITY_FREE   2   // on the free list or not yet handed out
+
+struct SanityNode {
+  SIZE_T block;
+  bool   haslow;
+  bool   hashigh;
+  KEY_T  low;     // keys must be >= low
+  KEY_T  high;    // and < high
+  bool   alone;   // only child of a root with no keys, so may be underfull
+
+  SanityNode() : block(0), haslow(false), hashigh(false), alone(false) {}
+};
+
+// The overflow blocks of a run or a big value, from a leaf
+struct SanityRun {
+  SIZE_T block;   // the first
+  SIZE_T values;  // they hold between them (bytes, of a big value)
+
+  SanityRun(const SIZE_T b, const SIZE_T v) : block(b), values(v) {}
+};
+
+struct SanityBlockOrder {
+  const vector<SanityNode> *level;
+
+  bool operator()(const SIZE_T a, const SIZE_T b) const { 
+    return (*level)[a].block < (*level)[b].block;
+  }
+};
+
+// One thread's share of a batch
+struct SanityWork {
+  const NodeMetadata          *super;
+  SIZE_T                       numblocks;
+  bool                         underfull;  // one key is enough
+  bool                         unique;
+  bool                         big;        // leaves hold stubs of big values
+  const vector<SanityNode>    *level;
+  const vector<SIZE_T>        *order;      // level offsets in block order
+  SIZE_T                       first;      // of the batch in order
+  const vector<BTreeNode>     *nodes;      // the batch
+  vector<vector<SanityNode> > *children;   // per level offset
+  vector<vector<SanityRun> >  *runs;       // likewise
+  SIZE_T                       thread;     // checks nodes thread, 
+  SIZE_T                       stride;     // thread+stride, ...
+  ERROR_T                      rc;
+};
+
+
+//
+// Checks one node against what its parent says about it and lists
+// its children, or for a leaf, its runs' overflow blocks.  nextleaf is
+// the leaf that must follow a leaf.
+//
+static ERROR_T SanityCheckNode(const BTreeNode &b, 
+			       const SanityNode &where,
+			       const SIZE_T nextleaf,
+			       const SanityWork &w,
+			       vector<SanityNode> &children,
+			       vector<SanityRun> &runs)
+{
+  SIZE_T i;
+  SIZE_T ptr;
+  SIZE_T count;
+  SIZE_T numslots;
+  SIZE_T minkeys;
+  ERROR_T rc;
+
+  if (b.info.keysize!=w.super->keysize || 
+      b.info.valuesize!=w.super->valuesize ||
+      b.info.blocksize!=w.super->blocksize) { 
+    return ERROR_INSANE;
+  }
+
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
+    if (where.block!=w.super->rootnode) { 
+      return ERROR_INSANE;
+    }
+    numslots=b.info.GetNumSlotsAsInterior();
+    minkeys=0;
+    break;
+  case BTREE_INTERIOR_NODE:
+    numslots=b.info.GetNumSlotsAsInterior();
+    minkeys= w.underfull ? 1 : MinKeys(b.info);
+    break;
+  case BTREE_LEAF_NODE:
+    numslots=b.info.GetNumSlotsAsLeaf();
+    minkeys= where.alone ? 0 : w.underfull ? 1 : MinKeys(b.info);
+    break;
+  default:
+    return ERROR_INSANE;
+  }
+  if (((b.info.options & BTREE_NODE_SLOTTED)!=0)!=((w.super->options & BTREE_OPT_SLOTTED)!=0)) { 
+    return ERROR_INSANE;
+  }
+  if (b.info.options & BTREE_NODE_SLOTTED) { 
+    // bytes run out rather than slots, and Delete keeps a key
+    if (!b.SlotsMatch() || b.GetUsedBytes()>b.info.GetNumSlottedBytes()) { 
+      return ERROR_INSANE;
+    }
+    numslots=b.info.numkeys;
+    minkeys=min(minkeys,(SIZE_T)1);
+  }
+  if (b.info.numkeys>numslots || b.info.numkeys<minkeys) { 
+    return ERROR_INSANE;
+  }
+  // Only interior nodes leave out a zero tail, and no more than they may
+  if (b.info.zerotail>0 && 
+      (b.info.nodetype==BTREE_LEAF_NODE || b.info.zerotail>b.info.GetMaxZeroTail())) { 
+    return ERROR_INSANE;
+  }
+
+  // In strict order, so no key twice, and within the parent's range
+  for (i=1;i<b.info.numkeys;i++) { 
+    if (b.info.options & BTREE_NODE_SLOTTED) { 
+      KEY_T key;
+      rc=b.GetKey(i,key);
+      RETURNIFERROR(rc)
+      if (b.CompareKey(i-1,key)>=0) { 
+	return ERROR_INSANE;
+      }
+    } else if (memcmp(b.ResolveKey(i-1),b.ResolveKey(i),b.info.GetKeyBytes())>=0) { 
+      return ERROR_INSANE;
+    }
+  }
+  if (!b.DirectoryMatches()) { 
+    return ERROR_INSANE;
+  }
+  // A prefix must be shared by everything in the node's range
+  if (b.info.prefixlen>0) { 
+    if (b.info.prefixlen>=b.info.keysize || !where.haslow || !where.hashigh ||
+	b.ComparePrefix(where.low)!=0 || b.ComparePrefix(where.high)!=0) { 
+      return ERROR_INSANE;
+    }
+  }
+  if (b.info.numkeys>0) { 
+    if (where.haslow && b.CompareKey(0,where.low)<0) { 
+      return ERROR_INSANE;
+    }
+    if (where.hashigh && b.CompareKey(b.info.numkeys-1,where.high)>=0) { 
+      return ERROR_INSANE;
+    }
+  }
+
+  rc=b.GetPtr(0,ptr);
+  RETURNIFERROR(rc)
+  if (b.info.nodetype==BTREE_LEAF_NODE) { 
+    if (ptr!=nextleaf) { 
+      return ERROR_INSANE;
+    }
+    for (i=0;!w.unique && i<b.info.numkeys;i++) { 
+      GetRun(b,i,count,ptr);
+      if (count==0 || (count<=w.super->runvalues)!=(ptr==0)) { 
+	return ERROR_INSANE;
+      }
+      if (ptr!=0) { 
+	runs.push_back(SanityRun(ptr,count-w.super->runvalues));
+      }
+    }
+    for (i=0;w.big && i<b.info.numkeys;i++) { 
+      // a stub: the length and first block
+      GetRun(b,i,count,ptr);
+      if (count!=w.super->bigvaluesize || ptr==0) { 
+	return ERROR_INSANE;
+      }
+      runs.push_back(SanityRun(ptr,count));
+    }
+    return ERROR_NOERROR;
+  }
+
+  if (b.info.numkeys==0 && ptr==0) { 
+    // an empty root, before its first leaf
+    return b.info.nodetype==BTREE_ROOT_NODE ? ERROR_NOERROR : ERROR_INSANE;
+  }
+  children.resize(b.info.numkeys+1);
+  for (i=0;i<=b.info.numkeys;i++) { 
+    SanityNode &c=children[i];
+    rc=b.GetPtr(i,c.block);
+    RETURNIFERROR(rc)
+    if (c.block==0 || c.block>=w.numblocks) { 
+      return ERROR_INSANE;
+    }
+    if (i>0) { 
+      rc=b.GetKey(i-1,c.low);
+      RETURNIFERROR(rc)
+      c.haslow=true;
+    } else {
+      c.low=where.low;
+      c.haslow=where.haslow;
+    }
+    if (i<b.info.numkeys) { 
+      rc=b.GetKey(i,c.high);
+      RETURNIFERROR(rc)
+      c.hashigh=true;
+    } else {
+      c.high=where.high;
+      c.hashigh=where.hashigh;
+    }
+    c.alone = b.info.nodetype==BTREE_ROOT_NODE && b.info.numkeys==0;
+  }
+  return ERROR_NOERROR;
+}
+
+
+static void *SanityCheckWorker(void *arg)
+{
+  SanityWork &w=*(SanityWork *)arg;
+  SIZE_T i;
+
+  for (i=w.thread; i<w.nodes->size() && w.rc==ERROR_NOERROR; i+=w.stride) { 
+    SIZE_T offset=(*w.order)[w.first+i];
+    const BTreeNode &b=(*w.nodes)[i];
+    SIZE_T nextleaf= offset+1<w.level->size() ? (*w.level)[offset+1].block : 0;
+
+    w.rc=SanityCheckNode(b,(*w.level)[offset],nextleaf,w,(*w.children)[offset],(*w.runs)[offset]);
+  }
+  return 0;
+}
+
+
+//
+// The superblock and the nodes reached from the root must be 
+// allocated and reached once.  Everything else below the high water 
+// mark must be on the free list or not yet handed out of an extent, and
+// must not be allocated; nothing from the high water mark on is.
+// Leaves must all be at the same depth, in the order of the leaf chain.
+// Nodes other than the root must be at least half full, or hold a key
+// if nodes may ever have been split at the insert point.  The node 
+// cache, if any, must hold only what the buffer cache does.  Pinned
+// blocks must be resident and pinned; unless the pins are stale they
+// must be whole interior levels from the root down, as many as 
+// PinUpperLevels would take.
+//
 ERROR_T BTreeIndex::SanityCheck() const
 {
-  // WRITE ME
-  return ERROR_UNIMPL;
+  ERROR_T rc;
+  SIZE_T numblocks=buffercache->GetNumBlocks();
+  SIZE_T i, j;
+  SIZE_T block;
+  BTreeNode node;
+  vector<char> seen(numblocks,SANITY_UNSEEN);
+  vector<SanityNode> level(1);
+  map<SIZE_T,BTreeExtent>::const_iterator e;
+  vector<SIZE_T> pins(pinned);
+  bool pinning=true;
+  SIZE_T pinnedlevels=0, pinnedblocks=0;
+
+  if (superblock.info.nodetype!=BTREE_SUPERBLOCK ||
+      superblock.info.highwater>numblocks ||
+      superblock.info.rootnode==superblock_index ||
+      superblock.info.rootnode>=superblock.info.highwater) { 
+    return ERROR_INSANE;
+  }
+  if (nodecache) { 
+    rc=nodecache->Check();
+    RETURNIFERROR(rc)
+  }
+  sort(pins.begin(),pins.end());
+  if (adjacent_find(pins.begin(),pins.end())!=pins.end()) { 
+    return ERROR_INSANE;
+  }
+  for (i=0;i<pins.size();i++) { 
+    if (!buffercache->IsBlockPinned(pins[i])) { 
+      return ERROR_INSANE;
+    }
+  }
+  seen[superblock_index]=SANITY_INUSE;
+  seen[superblock.info.rootnode]=SANITY_INUSE;
+  level[0].block=superblock.info.rootnode;
+
+  while (!level.empty()) { 
+    vector<SIZE_T> order(level.size());
+    vector<vector<SanityNode> > children(level.size());
+    vector<vector<SanityRun> > runs(level.size());
+    vector<SanityNode> next;
+    SanityBlockOrder byblock;
+    int nodetype=-1;
+
+    for (i=0;i<order.size();i++) { 
+      order[i]=i;
+    }
+    byblock.level=&level;
+    sort(order.begin(),order.end(),byblock);
+
+    for (i=0;i<order.size();i+=SANITY_BATCH) { 
+      vector<BTreeNode> nodes(min((SIZE_T)SANITY_BATCH,(SIZE_T)order.size()-i));
+      SanityWork work[SANITY_THREADS];
+      pthread_t threads[SANITY_THREADS];
+      bool started[SANITY_THREADS];
+      SIZE_T numthreads=min((SIZE_T)SANITY_THREADS,(SIZE_T)nodes.size());
+
+      for (j=0;j<nodes.size();j++) { 
+	rc=nodes[j].Unserialize(buffercache,level[order[i+j]].block);
+	RETURNIFERROR(rc)
+	if (nodetype<0) { 
+	  nodetype=nodes[j].info.nodetype;
+	} else if (nodes[j].info.nodetype!=nodetype) { 
+	  // leaves at different depths
+	  return ERROR_INSANE;
+	}
+      }
+
+      for (j=0;j<numthreads;j++) { 
+	work[j].super=&superblock.info;
+	work[j].numblocks=numblocks;
+	work[j].underfull=(superblock.info.options & BTREE_OPT_MAY_BE_UNDERFULL)!=0;
+	work[j].unique=IsUnique();
+	work[j].big=HasBigValues();
+	work[j].level=&level;
+	work[j].order=&order;
+	work[j].first=i;
+	work[j].nodes=&nodes;
+	work[j].children=&children;
+	work[j].runs=&runs;
+	work[j].thread=j;
+	work[j].stride=numthreads;
+	work[j].rc=ERROR_NOERROR;
+	// the calling thread takes the first share, and any that
+	// could not be started
+	started[j] = j>0 && pthread_create(&threads[j],0,SanityCheckWorker,&work[j])==0;
+      }
+      for (j=0;j<numthreads;j++) { 
+	if (!started[j]) { 
+	  SanityCheckWorker(&work[j]);
+	}
+      }
+      for (j=0;j<numthreads;j++) { 
+	if (started[j]) { 
+	  pthread_join(threads[j],0);
+	}
+      }
+      for (j=0;j<numthreads;j++) { 
+	RETURNIFERROR(work[j].rc)
+      }
+    }
+
+    for (i=0;i<children.size();i++) { 
+      for (j=0;j<children[i].size();j++) { 
+	block=children[i][j].block;
+	if (seen[block]!=SANITY_UNSEEN) { 
+	  return ERROR_INSANE;
+	}
+	seen[block]=SANITY_INUSE;
+	next.push_back(children[i][j]);
+      }
+    }
+    for (i=0;i<runs.size();i++) { 
+      for (j=0;j<runs[i].size();j++) { 
+	SIZE_T left=runs[i][j].values;
+	for (block=runs[i][j].block; block!=0; ) { 
+	  if (block>=numblocks || seen[block]!=SANITY_UNSEEN) { 
+	    return ERROR_INSANE;
+	  }
+	  seen[block]=SANITY_INUSE;
+	  rc=node.Unserialize(buffercache,block);
+	  RETURNIFERROR(rc)
+	  if (node.info.nodetype!=BTREE_OVERFLOW_NODE ||
+	      node.info.valuesize!=(HasBigValues() ? superblock.info.valuesize : ValueSize()) ||
+	      node.info.blocksize!=superblock.info.blocksize ||
+	      node.info.numkeys==0 || node.info.numkeys>left ||
+	      (HasBigValues() ? node.info.numkeys!=min(left,node.info.GetNumOverflowBytes()) :
+	       block!=runs[i][j].block && node.info.numkeys!=node.info.GetNumSlotsAsOverflow())) { 
+	    return ERROR_INSANE;
+	  }
+	  left-=node.info.numkeys;
+	  rc=node.GetPtr(0,block);
+	  RETURNIFERROR(rc)
+	}
+	if (left!=0) { 
+	  return ERROR_INSANE;
+	}
+      }
+    }
+    if (!pinsstale) { 
+      SIZE_T numpinned=0;
+      for (i=0;i<level.size();i++) { 
+	if (binary_search(pins.begin(),pins.end(),level[i].block)) { 
+	  numpinned++;
+	}
+      }
+      if (numpinned>0) { 
+	if (numpinned!=level.size() || !pinning || nodetype==BTREE_LEAF_NODE) { 
+	  return ERROR_INSANE;
+	}
+	pinnedlevels++;
+	pinnedblocks+=numpinned;
+      } else if (pinning) { 
+	// the first level not pinned must be one that could not be
+	pinning=false;
+	if (nodetype!=BTREE_LEAF_NODE && pinnedlevels<pinlevels && 
+	    pinnedblocks+level.size()<=PinLimit()) { 
+	  return ERROR_INSANE;
+	}
+      }
+    }
+    level.swap(next);
+  }
+  if (!pinsstale && pinnedblocks!=pins.size()) { 
+    return ERROR_INSANE;
+  }
+
+  for (block=superblock.info.freelist; block!=0; block=node.info.freelist) { 
+    if (block>=superblock.info.highwater || seen[block]!=SANITY_UNSEEN) { 
+      return ERROR_INSANE;
+    }
+    seen[block]=SANITY_FREE;
+    rc=node.Unserialize(buffercache,block);
+    RETURNIFERROR(rc)
+    if (node.info.nodetype!=BTREE_UNALLOCATED_BLOCK) { 
+      return ERROR_INSANE;
+    }
+  }
+  for (e=extents.begin(); e!=extents.end(); ++e) { 
+    for (block=e->second.next; block<e->second.end; block++) { 
+      if (block>=superblock.info.highwater || seen[block]!=SANITY_UNSEEN) { 
+	return ERROR_INSANE;
+      }
+      seen[block]=SANITY_FREE;
+    }
+  }
+
+  for (block=0;block<numblocks;block++) { 
+    if ((seen[block]==SANITY_UNSEEN) != (block>=superblock.info.highwater) ||
+	buffercache->IsBlockAllocated(block) != (seen[block]==SANITY_INUSE)) { 
+      return ERROR_INSANE;
+    }
+  }
+  return ERROR_NOERROR;
 }
   
 
 
+BTreeLevelStats::BTreeLevelStats() : nodes(0), keys(0), slots(0)
+{
+  for (int i=0;i<BTREE_FILL_BUCKETS;i++) { 
+    fill[i]=0;
+  }
+}
+
+
+double BTreeLevelStats::GetFill() const
+{
+  return slots>0 ? (double)keys/slots : 0;
+}
+
+
+BTreeStats::BTreeStats() : entries(0), keybytes(0), overflowblocks(0), freelistblocks(0), unusedblocks(0)
+{}
+
+
+SIZE_T BTreeStats::GetHeight() const
+{
+  return levels.size();
+}
+
+
+double BTreeStats::GetAvgKeyBytes() const
+{
+  SIZE_T keys=0;
+
+  for (SIZE_T i=0;i<levels.size();i++) { 
+    keys+=levels[i].keys;
+  }
+  return keys>0 ? (double)keybytes/keys : 0;
+}
+
+
+ostream & BTreeStats::Print(ostream &os) const
+{
+  SIZE_T i;
+  int j;
+
+  os << "height "<<GetHeight()<<", "<<entries<<" entries, "
+     << GetAvgKeyBytes()<<" bytes per key\n";
+  os << "overflow "<<overflowblocks<<" blocks, free list "<<freelistblocks
+     << " blocks, unused "<<unusedblocks<<" blocks\n";
+  os << "level\tnodes\tkeys\tfill\tnodes by tenths full\n";
+  for (i=0;i<levels.size();i++) { 
+    os << i<<"\t"<<levels[i].nodes<<"\t"<<levels[i].keys<<"\t"
+       << (int)(100*levels[i].GetFill()+0.5)<<"%\t";
+    for (j=0;j<BTREE_FILL_BUCKETS;j++) { 
+      os << (j>0 ? " " : "")<<levels[i].fill[j];
+    }
+    os << "\n";
+  }
+  return os;
+}
+
+
+ERROR_T BTreeIndex::GetStats(BTreeStats &stats) const
+{
+  ERROR_T rc;
+  BTreeNodeView b;
+  BTreeNode node;
+  SIZE_T i;
+  SIZE_T ptr;
+  SIZE_T numslots;
+  vector<SIZE_T> level(1,superblock.info.rootnode);
+  map<SIZE_T,BTreeExtent>::const_iterator e;
+
+  stats=BTreeStats();
+
+  while (!level.empty()) { 
+    vector<SIZE_T> next;
+    BTreeLevelStats l;
+
+    sort(level.begin(),level.end());
+    for (i=0;i<level.size();i++) { 
+      rc=b.Pin(buffercache,level[i]);
+      RETURNIFERROR(rc)
+      if (b.info.nodetype==BTREE_LEAF_NODE) { 
+	numslots=b.info.GetNumSlotsAsLeaf();
+	if (HasBigValues()) { 
+	  SIZE_T perblock=b.info.GetNumOverflowBytes();
+	  stats.entries+=b.info.numkeys;
+	  stats.overflowblocks+=b.info.numkeys*((ValueSize()+perblock-1)/perblock);
+	} else if (IsUnique()) { 
+	  stats.entries+=b.info.numkeys;
+	} else {
+	  // every overflow block of a run is full but the first
+	  SIZE_T perblock=NewNode(BTREE_OVERFLOW_NODE).info.GetNumSlotsAsOverflow();
+	  SIZE_T packed=superblock.info.runvalues;
+	  for (SIZE_T j=0;j<b.info.numkeys;j++) { 
+	    SIZE_T count;
+	    GetRun(b,j,count,ptr);
+	    stats.entries+=count;
+	    stats.overflowblocks+= count>packed ? (count-packed+perblock-1)/perblock : 0;
+	  }
+	}
+      } else if (b.info.nodetype==BTREE_ROOT_NODE || b.info.nodetype==BTREE_INTERIOR_NODE) { 
+	numslots=b.info.GetNumSlotsAsInterior();
+	rc=b.GetPtr(0,ptr);
+	RETURNIFERROR(rc)
+	if (b.info.numkeys>0 || ptr!=0) { 
+	  for (SIZE_T j=0;j<=b.info.numkeys;j++) { 
+	    rc=b.GetPtr(j,ptr);
+	    RETURNIFERROR(rc)
+	    next.push_back(ptr);
+	  }
+	}
+      } else {
+	return ERROR_INSANE;
+      }
+      if (b.info.options & BTREE_NODE_SLOTTED) { 
+	// as many more keys as are like these and fit
+	SIZE_T used=b.GetUsedBytes();
+	numslots= used>0 ? b.info.numkeys*b.info.GetNumSlottedBytes()/used : numslots;
+	for (SIZE_T j=0;j<b.info.numkeys;j++) { 
+	  stats.keybytes+=b.GetKeyLength(j);
+	}
+      } else {
+	stats.keybytes+=b.info.numkeys*b.info.GetKeyBytes()+b.info.prefixlen;
+      }
+      l.nodes++;
+      l.keys+=b.info.numkeys;
+      l.slots+=numslots;
+      l.fill[min((SIZE_T)BTREE_FILL_BUCKETS-1,b.info.numkeys*BTREE_FILL_BUCKETS/numslots)]++;
+    }
+    stats.levels.push_back(l);
+    level.swap(next);
+  }
+  rc=b.Unpin();
+  RETURNIFERROR(rc)
+
+  for (ptr=superblock.info.freelist; ptr!=0; ptr=node.info.freelist) { 
+    rc=node.Unserialize(buffercache,ptr);
+    RETURNIFERROR(rc)
+    stats.freelistblocks++;
+  }
+  stats.unusedblocks=buffercache->GetNumBlocks()-superblock.info.highwater;
+  for (e=extents.begin(); e!=extents.end(); ++e) { 
+    stats.unusedblocks+=e->second.end-e->second.next;
+  }
+  return ERROR_NOERROR;
+}
+
+
 ostream & BTreeIndex::Print(ostream &os) const
 {
-  // WRITE ME
+  BTreeStats stats;
+
+  os << "BTreeIndex(keysize="<<superblock.info.keysize
+     << ", valuesize="<<superblock.info.valuesize
+     << ", blocksize="<<superblock.info.blocksize
+     << ", rootnode="<<superblock.info.rootnode
+     << ", splitpolicy="<<(GetSplitPolicy()==BTREE_SPLIT_AT_INSERT ? "atinsert" : "middle")
+     << ", interior="<<(HasKeysApart() ? "soa" : "together")
+     << ", directory="<<(HasKeyDirectory() ? "grouped" : "flat")
+     << ", keys="<<(HasPrefixCompression() ? "prefix" : "full")
+     << ", separators="<<(HasSuffixTruncation() ? "cut" : "whole")
+     << ", pages="<<(HasSlottedPages() ? "slotted" : "fixed")
+     << ", values="<<(HasBigValues() ? "overflow" : "inline")
+     << ", nodecache="<<nodecachesize
+     << ", pinnedlevels="<<pinlevels
+     << ")\n";
+  if (GetStats(stats)==ERROR_NOERROR) { 
+    os << stats;
+  }
   return os;
 }
 
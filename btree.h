@@ -3,6 +3,8 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
+#include <map>
 
 #include "global.h"
 #include "block.h"
@@ -37,22 +39,267 @@ struct KeyValuePair {
 
 };
 
+//
+// A position in a forward range scan.  The cursor holds a copy of
+// the leaf it is on and follows the leaf chain to the right, so a
+// scan costs one descent plus one block read per leaf.  If an end
+// key is set, the scan stops before the first key >= end.  In an 
+// index that is not unique, each value of a key is returned in turn.
+//
+struct BTreeCursor {
+  BTreeNode leaf;
+  SIZE_T    offset;   // next entry to return from leaf
+  KEY_T     end;
+  bool      hasend;
+  vector<VALUE_T> run;      // values of that entry, if not unique
+  SIZE_T          runoffset;  // next one to return, 0 = run not read yet
+
+  BTreeCursor();
+  void SetEnd(const KEY_T &key);
+  void ClearEnd();
+};
+
+//
+// State kept between BulkLoadBegin and BulkLoadEnd
+//
+struct BTreeBulkLoad {
+  bool           active;
+  SIZE_T         leafkeys;      // entries per leaf
+  SIZE_T         interiorkeys;  // keys per interior node
+  SIZE_T         leafbytes;     // slotted: bytes of entries per leaf
+  BTreeNode      leaf;          // the leaf being filled
+  SIZE_T         leafblock;
+  KEY_T          lastkey;
+  KEY_T          leaflow;       // separator below the leaf being filled
+  vector<KEY_T>  leaflows;      // and below each finished leaf
+  vector<SIZE_T> blocks;        // and where that leaf was written
+
+  BTreeBulkLoad();
+};
+
+//
+// A run of never used blocks set aside for nodes of one level of the
+// tree that are near each other in key order
+//
+struct BTreeExtent {
+  SIZE_T level; // 0 for leaves
+  SIZE_T next;  // next block to hand out
+  SIZE_T end;   // one past the last block
+
+  BTreeExtent();
+};
+
+//
+// The rightmost leaf as last seen by Insert, and the separator above
+// it (none if it is also the leftmost leaf)
+//
+struct BTreeRightmost {
+  bool   valid;
+  SIZE_T leaf;
+  bool   hasfence;
+  KEY_T  fence;
+
+  BTreeRightmost();
+};
+
+//
+// Interior nodes kept decoded by block, so a descent searches the upper
+// levels straight from memory, with no pin and no copy.  Each remembers
+// the frame it came from, which a hit keeps warm in the buffer cache;
+// the buffer cache tells it when that block is written or evicted and
+// the node goes too, so no node here is older than its block.  Holds
+// at most size nodes, letting the least recently used go first.
+//
+// Child pointers are swizzled: once a child has been reached from a 
+// node here, the node holds the child's own entry if it is here too,
+// or else the child's frame, and a descent follows that rather than 
+// looking the block up.  Either is let go, the pointer going back to
+// a plain block number, when the child's block is written or evicted
+// or when the node itself goes.
+//
+class BTreeNodeCache : public BufferCacheObserver {
+ public:
+  struct Node {
+    BTreeNode      node;
+    SIZE_T         block;
+    Block         *frame;
+    SIZE_T         lastused;
+    vector<Node *>  children;     // swizzled: child i's entry, if here
+    vector<Block *> childframes;  // and its frame, if resident
+  };
+
+  // Where a descent left the cached nodes: from's child slot, and that
+  // child's frame if it is swizzled (else 0)
+  struct Hop {
+    Node   *from;
+    SIZE_T  fromblock;
+    SIZE_T  slot;
+    Block  *frame;
+
+    Hop();
+  };
+
+  BTreeNodeCache(BufferCache *cache, const SIZE_T size);
+  virtual ~BTreeNodeCache();
+
+  Node *Find(const SIZE_T block);     // 0 if not here
+  // from's child slot if it is here, swizzling the pointer to it; if
+  // not, 0 and hop says where the descent stopped
+  Node *Child(Node *from, const SIZE_T slot, Hop &hop);
+  void  Add(const BTreeNodeView &node);
+  // Swizzles the pointer hop stopped at to child, now pinned
+  void  Swizzle(const Hop &hop, const BTreeNodeView &child);
+  virtual void BlockChanged(const SIZE_T block);
+  // ERROR_INSANE unless each node here is the interior node its block
+  // holds now, in the frame it remembers, and there are at most size;
+  // and each swizzled pointer leads to the child's resident frame and
+  // its entry here if it has one, and is listed in parents
+  ERROR_T Check() const;
+
+  SIZE_T hits, misses;
+
+ private:
+  BufferCache       *cache;
+  SIZE_T             size;
+  SIZE_T             clock;
+  map<SIZE_T,Node>   nodes;
+  map<SIZE_T,Hop>    parents;   // each swizzled child, and the pointer to it
+
+  void  Use(Node &n);
+  void  Link(Node *from, const SIZE_T slot, const SIZE_T child);
+  void  Unlink(const SIZE_T child);
+  void  Drop(const SIZE_T block);
+
+  BTreeNodeCache(const BTreeNodeCache &rhs);
+  BTreeNodeCache & operator=(const BTreeNodeCache &rhs);
+};
+
+//
+// Shape and occupancy of an index, from GetStats
+//
+#define BTREE_FILL_BUCKETS 10
+
+struct BTreeLevelStats {
+  SIZE_T nodes;
+  SIZE_T keys;
+  SIZE_T slots;                     // keys the nodes have room for
+  SIZE_T fill[BTREE_FILL_BUCKETS];  // nodes by tenths full, full ones in the last
+
+  BTreeLevelStats();
+  double GetFill() const;           // keys/slots
+};
+
+struct BTreeStats {
+  vector<BTreeLevelStats> levels;   // the root first, the leaves last
+  SIZE_T entries;                   // key/value pairs, counting each value of a run
+  SIZE_T keybytes;                  // spent on keys, on all levels
+  SIZE_T overflowblocks;            // holding runs of values, or big values
+  SIZE_T freelistblocks;
+  SIZE_T unusedblocks;              // never used, or not yet handed out
+
+  BTreeStats();
+  SIZE_T GetHeight() const;
+  double GetAvgKeyBytes() const;    // per key stored, on all levels
+
+  ostream &Print(ostream &os) const;
+};
+
+inline ostream & operator<<(ostream &os, const BTreeStats &s) { return s.Print(os); }
+
 enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE,BTREE_OP_LOOKUP};
 
 enum BTreeDisplayType {BTREE_DEPTH, BTREE_DEPTH_DOT, BTREE_SORTED_KEYVAL};
 
+enum BTreeSplitPolicy {BTREE_SPLIT_MIDDLE, BTREE_SPLIT_AT_INSERT};
+
 class BTreeIndex {
  private:
   BufferCache *buffercache;
   SIZE_T       superblock_index;
   BTreeNode    superblock;
+  bool         superblockdirty;         // superblock differs from disk
+  SIZE_T       checkpointinterval;      // 0 = only when asked
+  SIZE_T       changessincecheckpoint;
+  SIZE_T       extentsize;              // blocks per extent
+  map<SIZE_T,BTreeExtent> extents;      // this attach's extents by first block
+  vector<SIZE_T> currentextent;         // last extent opened per level, leaves first
+  BTreeBulkLoad bulk;
+  BTreeRightmost rightmost;             // fast path for appends
+  SIZE_T       nodecachesize;           // 0 = no node cache
+  BTreeNodeCache *nodecache;            // this attach's, if any
+  SIZE_T       pinlevels;               // top levels to keep pinned
+  SIZE_T       pinbytes;                // and at most this many bytes of them, 0 = any
+  vector<SIZE_T> pinned;                // blocks this index has pinned
+  bool         pinsstale;               // pinned may no longer be those levels
 
  protected:
 
-    ERROR_T      AllocateNode(SIZE_T &node);
+    ERROR_T      AllocateNode(SIZE_T &node,
+                              const SIZE_T level,
+                              const SIZE_T near);
+
+    SIZE_T       FindExtent(const SIZE_T block,
+                            const SIZE_T level) const;
+
+    ERROR_T      TakeFromExtent(const SIZE_T start, SIZE_T &node);
+
+    ERROR_T      ReleaseExtent(const SIZE_T start);
+    ERROR_T      StoreExtents();
+    ERROR_T      LoadExtents();
 
     ERROR_T      DeallocateNode(const SIZE_T &node);
 
+    ERROR_T      PinUpperLevels();
+    SIZE_T       PinLimit() const;
+    ERROR_T      UnpinUpperLevels();
+
+    ERROR_T      SuperblockChanged();
+
+    bool         IsShortKey(const KEY_T &key) const;
+    KEY_T        PaddedKey(const KEY_T &key) const;
+
+    BTreeNode    NewNode(const int nodetype) const;
+
+    ERROR_T      SetRangePrefix(BTreeNode &b,
+                                const bool haslow, const KEY_T &low,
+                                const bool hashigh, const KEY_T &high) const;
+
+    ERROR_T      SharePrefix(BTreeNode &b, const BTreeNode &other) const;
+
+    void         Separator(const KEY_T &last, const KEY_T &first, KEY_T &sep) const;
+    void         CutSeparator(KEY_T &sep, const SIZE_T common) const;
+
+    ERROR_T      NarrowKeys(BTreeNode &b) const;
+
+    SIZE_T       LowerBound(const BTreeNode &b, const KEY_T &key) const;
+    SIZE_T       UpperBound(const BTreeNode &b, const KEY_T &key) const;
+
+    ERROR_T      FindLeaf(const KEY_T &key, BTreeNodeView &leaf) const;
+
+    ERROR_T      DescendCached(SIZE_T &ptr,
+                                   const KEY_T *key,
+                                   BTreeNodeCache::Hop &hop) const;
+
+    ERROR_T      AddToRun(BTreeNode &leaf,
+                          const SIZE_T offset,
+                          const SIZE_T near,
+                          const BYTE_T *value);
+
+    ERROR_T      RemoveFromRun(BTreeNode &leaf,
+                               const SIZE_T offset,
+                               const VALUE_T &value,
+                               SIZE_T &count);
+
+    ERROR_T      ReadRun(const BTreeNode &leaf,
+                         const SIZE_T offset,
+                         vector<VALUE_T> &values) const;
+
+    ERROR_T      FreeRun(SIZE_T overflow);
+
+    ERROR_T      WriteBigValue(const VALUE_T &value, SIZE_T &first);
+
+    ERROR_T      ReadBigValue(const char *stub, VALUE_T &value) const;
+
     ERROR_T      LookupOrUpdateInternal(const SIZE_T &Node,
 				      const BTreeOp op, 
 				      const KEY_T &key,
@@ -63,18 +310,58 @@ class BTreeIndex {
                                    const KEY_T &key,
                                    const VALUE_T &value);
 
-    ERROR_T    InsertHelper(SIZE_T &node,
-                KEY_T &key,
-                const VALUE_T &value);
+    SIZE_T     SplitPoint(const BTreeNode &b,
+                          const SIZE_T insertat,
+                          const SIZE_T newbytes,
+                          const bool leaf) const;
+
+    ERROR_T    SplitLeaf(BTreeNode &b,
+                         const SIZE_T block,
+                         const SIZE_T insertat,
+                         const KEY_T &key,
+                         const VALUE_T &value,
+                         BTreeNode &right,
+                         SIZE_T &rightptr,
+                         KEY_T &upkey);
+
+    ERROR_T    SplitInterior(BTreeNode &b,
+                             const SIZE_T block,
+                             const SIZE_T level,
+                             const SIZE_T insertat,
+                             const KEY_T &key,
+                             const SIZE_T ptr,
+                             BTreeNode &right,
+                             SIZE_T &rightptr,
+                             KEY_T &upkey);
+
+    ERROR_T    PutInteriorEntry(BTreeNode &b,
+                                const SIZE_T block,
+                                const SIZE_T level,
+                                const SIZE_T offset,
+                                const KEY_T &key,
+                                const SIZE_T ptr,
+                                bool &split,
+                                KEY_T &upkey,
+                                SIZE_T &upptr);
 
-    ERROR_T    InsertKeyPtr(SIZE_T &node,
-                            KEY_T &key,
-                            SIZE_T &ptr);
+    ERROR_T    DeleteInternal(const SIZE_T &node,
+                              const KEY_T &key,
+                              bool &underflow,
+                              SIZE_T &level,
+                              bool &split,
+                              KEY_T &upkey,
+                              SIZE_T &upptr);
 
-    ERROR_T    InsertKeyPtrHelper(const SIZE_T &curnode,
-                                    SIZE_T &node,
-                                    KEY_T &key,
-                                    SIZE_T &ptr);
+    ERROR_T    RebalanceChild(BTreeNode &parent,
+                              const SIZE_T offset,
+                              bool &merged,
+                              bool &moved,
+                              KEY_T &sep,
+                              SIZE_T &sepoff,
+                              SIZE_T &sepptr);
+
+    ERROR_T    SeekInternal(const KEY_T *key,
+                            BTreeCursor &cursor) const;
 
     ERROR_T      DisplayInternal(const SIZE_T &node,
 			       ostream &o, 
@@ -90,6 +377,9 @@ public:
   // otherwise, the expectation is that keysize and valuesize
   // will be zero and will be read when Attach(initialblock,false) is 
   // invoked
+  // With unique false, each key keeps a run of values, stored in its
+  // leaf entry and in overflow blocks.  This too is kept in the 
+  // superblock.
   BTreeIndex(SIZE_T keysize, 
 	     SIZE_T valuesize,
 	     BufferCache *cache,
@@ -109,37 +399,204 @@ public:
   // This should be your superblock, which contains the information 
   // you need to find the elements of the tree.
   // return zero on success or ERROR_NOTANINDEX if we are
-  // giving you an incorrect block to start with
+  // giving you an incorrect block to start with, or ERROR_VERSION for
+  // an index laid out by another version of this code
   ERROR_T Attach(const SIZE_T initblock, const bool create=false );
   
   // This is called after all inserts, updates, or deletes are done.
   // We expect you to tell us the number of your superblock, which
   // we will return to you on the next attach
   ERROR_T Detach(SIZE_T &initblock);
+
+  // Writes the superblock if it has changed since it was last written.
+  // Detach does this too.  Allocation only changes the superblock in
+  // memory; with an interval set, it is also written after every that
+  // many allocations and deallocations.  0, the default, means only
+  // at Detach and Checkpoint.
+  ERROR_T Checkpoint();
+  void    SetCheckpointInterval(const SIZE_T changes);
+
+  // Where full nodes split.  BTREE_SPLIT_MIDDLE, the default, halves
+  // them.  BTREE_SPLIT_AT_INSERT splits right at the new key when it
+  // goes past either end of the node, so ascending or descending 
+  // inserts leave full nodes behind; other inserts split in the middle.
+  // The policy is kept in the superblock.  It may be set before an 
+  // Attach that creates the index.
+  ERROR_T SetSplitPolicy(const BTreeSplitPolicy policy);
+  BTreeSplitPolicy GetSplitPolicy() const;
+
+  // Integer keys.  Set before the Attach that creates the index, 
+  // whose keysize must be 4 or 8 (ERROR_SIZE if not), and kept in the
+  // superblock.  Keys are then signed integers of that size, made with
+  // IntegerKey; searches compare them as integers.  ParseKey makes a
+  // key from text, a number if the keys are integers.  PrintKey 
+  // writes one the same way.
+  ERROR_T SetIntegerKeys();
+  bool    HasIntegerKeys() const;
+  KEY_T   IntegerKey(const long long x) const;
+  long long IntegerKeyValue(const KEY_T &key) const;
+  ERROR_T ParseKey(const char *text, KEY_T &key) const;
+  ostream & PrintKey(ostream &os, const KEY_T &key) const;
+
+  // Interior nodes with their keys apart from their pointers, so a
+  // search reads one packed array of keys; with integer keys the last
+  // few are compared many at a time with vector instructions.  Set 
+  // before the Attach that creates the index.  Only nodes made after
+  // it is set have the layout, so an index may have both kinds.
+  ERROR_T SetKeysApart();
+  bool    HasKeysApart() const;
+
+  // A key directory at the end of each interior and leaf node: a small
+  // tree over groups of keys, so that a search in a big block reads a
+  // few cache lines of keys rather than one per halving.  It takes 
+  // some slots.  Set before the Attach that creates the index.
+  ERROR_T SetKeyDirectory();
+  bool    HasKeyDirectory() const;
+
+  // Prefix compression: each interior and leaf node bounded on both
+  // sides by separators keeps the bytes its keys must share once, and
+  // only the rest of each key in its slots, so more keys fit.  Set 
+  // before the Attach that creates the index.
+  ERROR_T SetPrefixCompression();
+  bool    HasPrefixCompression() const;
+
+  // Suffix truncation: a split passes up only as much of the first key
+  // of the new node as tells it from the last key of the old one, and
+  // interior nodes leave out the zeros their keys end with, so more 
+  // separators fit in each and the upper levels take fewer blocks.  
+  // Set before the Attach that creates the index.
+  ERROR_T SetSuffixTruncation();
+  bool    HasSuffixTruncation() const;
+
+  // Slotted pages: interior and leaf nodes keep a slot per entry and 
+  // the entries themselves in a heap, so keys and values take only 
+  // their own length, up to keysize and valuesize, and a node holds as
+  // many as fit.  Separators cut short with suffix truncation lose 
+  // their zero fill.  Set before the Attach that creates the index, 
+  // which must be unique and without prefixes, keys apart or a 
+  // directory (ERROR_CONFLICT if not).  ERROR_SIZE unless a block 
+  // holds four of the longest entries.
+  ERROR_T SetSlottedPages();
+  bool    HasSlottedPages() const;
+
+  // Big values: with a valuesize over threshold, each value is kept in
+  // a chain of overflow blocks and its leaf entry holds just its length
+  // and first block, so leaves hold many keys however big the values
+  // are, and searches, splits and merges never read them.  Set before
+  // the Attach that creates the index, which must be unique with fixed
+  // pages (ERROR_CONFLICT if not).  With a smaller valuesize it does 
+  // nothing.
+  ERROR_T SetBigValues(const SIZE_T threshold);
+  bool    HasBigValues() const;
+
+  // Keep up to nodes interior nodes decoded in memory, so that Lookup,
+  // Update, Seek and the like search the upper levels without going to
+  // the buffer cache for them.  They are dropped whenever their blocks
+  // are written or evicted.  Takes effect at the next Attach and is not
+  // kept in the superblock.  0, the default, means none.
+  void    SetNodeCache(const SIZE_T nodes);
+
+  // Keep the root and the interior levels below it, down to levels in
+  // all, pinned in the buffer cache so that a scan cannot push them 
+  // out, and a lookup goes to disk at most for its leaf.  With bytes, 
+  // only as many whole levels as fit in that much; never more than 
+  // half the buffer cache.  The pins are taken at Attach, follow the
+  // tree as it grows or shrinks at each Insert, Update, Delete and 
+  // Lookup, and are let go at Detach.  Not kept in the superblock.  
+  // 0 levels, the default, means none.
+  void    SetPinnedLevels(const SIZE_T levels, const SIZE_T bytes=0);
+
+  // New nodes are placed in per-level extents of this many blocks
+  // taken from the never used part of the disk.  Default 16.
+  void    SetExtentSize(const SIZE_T blocks);
+
+  // Average distance, in blocks, between each leaf and the next one
+  // in key order.  Sequential leaves give 1; 0 if there is one leaf.
+  ERROR_T LeafDistance(double &avgdistance) const;
   
+  bool IsUnique() const;
+
+  // Size of a value, as opposed to the run or stub a leaf keeps for it
+  SIZE_T ValueSize() const;
+
+  // A key shorter than keysize is taken as zero filled to keysize, 
+  // here and wherever else a key is passed in, except with slotted 
+  // pages; one longer is ERROR_SIZE.
+  //
   // return zero on success
   // return ERROR_NOSPACE if you run out of disk space
   // return ERROR_SIZE if the key or value are the wrong size for this index
   // return ERROR_CONFLICT if the key already exists and it's a unique index
+  // If it's not, the value is added to the key's run
   ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
   
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   // return ERROR_SIZE if the key or value are the wrong size for this index
+  // return ERROR_CONFLICT if the key has more than one value
+  // With slotted pages a value that no longer fits in its leaf splits
+  // the leaf, as an Insert would; if that fails the old value stays
   ERROR_T Update(const KEY_T &key, const VALUE_T &value);
   
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   // return ERROR_SIZE if the key or value are the wrong size for this index
+  // Deletes the key with all its values
   ERROR_T Delete(const KEY_T &key);
+
+  // Deletes one value of the key, and the key with its last value
+  // return zero on success
+  // return ERROR_NONEXISTENT  if the key doesn't have the value
+  ERROR_T Delete(const KEY_T &key, const VALUE_T &value);
   
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
+  // Gives the first value of the key's run if the index isn't unique
   ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
 
-  // Here you should figure out if your index makes sense
-  // Is it a tree?  Is it in order?  Is it balanced?  Does each node have
-  // a valid use ratio?
+  // All the values of the key, from one visit to its leaf and one to
+  // each overflow block of its run
+  // return zero on success
+  // return ERROR_NONEXISTENT  if the key doesn't exist
+  ERROR_T LookupAll(const KEY_T &key, vector<VALUE_T> &values);
+
+  // Bulk loading
+  // Builds the tree bottom up from pairs given in strictly increasing 
+  // key order, into an index that must be empty (ERROR_CONFLICT if
+  // not).  Nodes are filled to fillfactor (0.5 to 1.0) of their slots,
+  // or with slotted pages leaves to that much of their bytes.
+  // All the leaves, then each interior level in turn, are allocated and
+  // written in order, so a freshly created index is laid out 
+  // sequentially on disk.  The tree is complete only after BulkLoadEnd.
+  // BulkLoadAppend returns ERROR_SIZE for a wrong sized key or value 
+  // and ERROR_CONFLICT if the key is not larger than the last one; in
+  // an index that is not unique, the same key again adds to its run.
+  ERROR_T BulkLoadBegin(const double fillfactor=1.0);
+  ERROR_T BulkLoadAppend(const KEY_T &key, const VALUE_T &value);
+  ERROR_T BulkLoadEnd();
+
+  // Walks the tree once, a level at a time in block order, and then
+  // the free list
+  ERROR_T GetStats(BTreeStats &stats) const;
+
+  // Range scans
+  // Seek leaves the cursor before the first key >= key, SeekFirst
+  // before the smallest key.  Each Next returns the following pair in
+  // key order; it returns ERROR_NONEXISTENT past the last key or on
+  // reaching the cursor's end key, which the range leaves out.  
+  // Changing the index invalidates cursors.
+  ERROR_T Seek(const KEY_T &key, BTreeCursor &cursor) const;
+  ERROR_T SeekFirst(BTreeCursor &cursor) const;
+  ERROR_T Next(BTreeCursor &cursor, KEY_T &key, VALUE_T &value) const;
+
+  // Checks that the index makes sense: that it is a tree, in order, 
+  // balanced, with nodes no fuller than they can be and, apart from the
+  // root, at least half full (or holding a key, once nodes have been
+  // split at the insert point), that the leaf chain follows key order,
+  // and that each block is a node, free, or never used, and allocated
+  // on the disk just when it is the superblock or a node.  Each level 
+  // is read in block order and checked on several threads.
+  // return zero if so, ERROR_INSANE if not
   ERROR_T SanityCheck() const;
 
   // Display tree
@@ -154,6 +611,7 @@ public:
   // sorted in order of keys.
   ERROR_T Display(ostream &o, BTreeDisplayType display_type=BTREE_DEPTH) const;
   
+  // The index's settings and its stats
   ostream & Print(ostream &os) const;
   
 };
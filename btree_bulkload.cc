@@ -0,0 +1,85 @@
+#include <stdlib.h>
+#include "btree.h"
+
+void usage() 
+{
+  cerr << "usage: btree_bulkload filestem cachesize fillfactor < sorted_key_value_lines\n";
+}
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize;
+  SIZE_T superblocknum;
+  double fillfactor;
+  string key, value;
+  SIZE_T numpairs;
+
+  if (argc!=4) { 
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  fillfactor=atof(argv[3]);
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(0,0,&cache);
+  
+  ERROR_T rc;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) { 
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0))!=ERROR_NOERROR) { 
+    cerr << "Can't attach to index  due to error "<<rc<<endl;
+    return -1;
+  } else {
+    cerr << "Index attached!"<<endl;
+    if ((rc=btree.BulkLoadBegin(fillfactor))!=ERROR_NOERROR) { 
+      cerr <<"Can't start bulk load due to error "<<rc<<endl;
+    } else {
+      numpairs=0;
+      while (cin >> key >> value) { 
+	KEY_T k;
+	if ((rc=btree.ParseKey(key.c_str(),k))!=ERROR_NOERROR || 
+	    (rc=btree.BulkLoadAppend(k,VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
+	  cerr <<"Can't load ("<<key<<", "<<value<<") due to error "<<rc<<endl;
+	  break;
+	}
+	numpairs++;
+      }
+      if ((rc=btree.BulkLoadEnd())!=ERROR_NOERROR) { 
+	cerr <<"Can't finish bulk load due to error "<<rc<<endl;
+      } else {
+	cerr <<"Loaded "<<numpairs<<" pairs\n";
+      }
+    }
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+    if ((rc=cache.Detach())!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from cache due to error "<<rc<<endl;
+      return -1;
+    }
+    cerr << "Performance statistics:\n";
+    
+    cerr << "numallocs       = "<<cache.GetNumAllocs()<<endl;
+    cerr << "numdeallocs     = "<<cache.GetNumDeallocs()<<endl;
+    cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+    cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+    cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+    cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+    cerr << endl;
+    
+    cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+    return 0;
+  }
+}
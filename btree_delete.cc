@@ -40,7 +40,8 @@ int main(int argc, char **argv)
     return -1;
   } else {
     cerr << "Index attached!"<<endl;
-    if ((rc=btree.Delete(KEY_T(key)))!=ERROR_NOERROR) { 
+    KEY_T k;
+    if ((rc=btree.ParseKey(key,k))!=ERROR_NOERROR || (rc=btree.Delete(k))!=ERROR_NOERROR) { 
       cerr <<"Can't delete from index due to error "<<rc<<endl;
     } else {
       cerr <<"Delete succeeded\n";
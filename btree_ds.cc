@@ -2,6 +2,12 @@
 #include <iostream>
 #include <assert.h>
 #include <string.h>
+#include <algorithm>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BTREE_X86_KERNELS 1
+#endif
 
 #include "btree_ds.h"
 #include "buffercache.h"
@@ -19,12 +25,136 @@ SIZE_T NodeMetadata::GetNumDataBytes() const
 
 SIZE_T NodeMetadata::GetNumSlotsAsInterior() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+sizeof(SIZE_T));  // floor intended
+  return GetNumSlots(GetKeyBytes()+sizeof(SIZE_T));
 }
 
 SIZE_T NodeMetadata::GetNumSlotsAsLeaf() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+valuesize);  // floor intended
+  return GetNumSlots(GetKeyBytes()+valuesize);
+}
+
+SIZE_T NodeMetadata::GetKeyBytes() const
+{
+  return keysize-prefixlen-zerotail;
+}
+
+// Each key keeps at least a byte, and the node no more than twice 
+// less two the slots it would have for keys without a zero tail, so 
+// either half of it split, plus the key that split it, fits even 
+// when that key has no zero tail
+SIZE_T NodeMetadata::GetMaxZeroTail() const
+{
+  NodeMetadata m=*this;
+  SIZE_T whole;
+
+  m.zerotail=0;
+  whole=m.GetNumSlotsAsInterior();
+  for (m.zerotail=keysize-prefixlen-1; m.zerotail>0; m.zerotail--) { 
+    if (m.GetNumSlotsAsInterior()+2<=2*whole) { 
+      break;
+    }
+  }
+  return m.zerotail;
+}
+
+// Slots of entrysize bytes after the first pointer and the prefix, 
+// and room for a directory over them if the node has one.  A slotted
+// node counts the entries of the longest keys and values it fits.
+SIZE_T NodeMetadata::GetNumSlots(const SIZE_T entrysize) const
+{
+  SIZE_T avail=GetNumDataBytes()-sizeof(SIZE_T)-prefixlen;
+  SIZE_T keybytes=GetKeyBytes();
+  SIZE_T group, n;
+
+  if (options & BTREE_NODE_SLOTTED) { 
+    return avail/BTreeSlottedEntryBytes(entrysize,0);  // floor intended
+  }
+  if (!(options & BTREE_NODE_KEY_DIRECTORY)) { 
+    return avail/entrysize;  // floor intended
+  }
+
+  // A directory costs about a key per group-1 slots, so start there 
+  // and settle on the most that fit
+  group=GetDirectoryGroup();
+  avail-=sizeof(SIZE_T);
+  n=avail*(group-1)/(entrysize*(group-1)+keybytes);
+  while ((n+1)*entrysize+BTreeDirectoryKeys(n+1,group)*keybytes<=avail) { 
+    n++;
+  }
+  while (n>0 && n*entrysize+BTreeDirectoryKeys(n,group)*keybytes>avail) { 
+    n--;
+  }
+  return n;
+}
+
+SIZE_T NodeMetadata::GetNumSlottedBytes() const
+{
+  return GetNumDataBytes()-sizeof(SIZE_T);
+}
+
+SIZE_T NodeMetadata::GetDirectoryGroup() const
+{
+  // A cache line of keys, but no fewer than 8 so the directory stays
+  // small next to the keys
+  return GetKeyBytes()>=8 ? 8 : 64/GetKeyBytes();
+}
+
+SIZE_T NodeMetadata::GetNumDirectoryBytes() const
+{
+  SIZE_T n;
+
+  if (!(options & BTREE_NODE_KEY_DIRECTORY)) { 
+    return 0;
+  }
+  switch (nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    n=GetNumSlotsAsInterior();
+    break;
+  case BTREE_LEAF_NODE:
+    n=GetNumSlotsAsLeaf();
+    break;
+  default:
+    return 0;
+  }
+  return sizeof(SIZE_T)+BTreeDirectoryKeys(n,GetDirectoryGroup())*GetKeyBytes();
+}
+
+
+SIZE_T BTreeDirectoryKeys(const SIZE_T n, const SIZE_T group)
+{
+  SIZE_T total=0;
+  SIZE_T size=n;
+
+  while (size>group) { 
+    size=(size+group-1)/group;
+    total+=size;
+  }
+  return total;
+}
+
+SIZE_T BTreeZeroTail(const KEY_T &k)
+{
+  SIZE_T n;
+
+  for (n=0; n<k.length && k.data[k.length-1-n]==0; n++) { 
+  }
+  return n;
+}
+
+SIZE_T BTreeSlottedEntryBytes(const SIZE_T keylen, const SIZE_T vallen)
+{
+  return 3*sizeof(BTREE_SLOT_T)+keylen+vallen;
+}
+
+SIZE_T NodeMetadata::GetNumSlotsAsOverflow() const
+{
+  return (GetNumDataBytes()-sizeof(SIZE_T))/valuesize;  // floor intended
+}
+
+SIZE_T NodeMetadata::GetNumOverflowBytes() const
+{
+  return GetNumDataBytes()-sizeof(SIZE_T);
 }
 
 
@@ -34,15 +164,21 @@ ostream & NodeMetadata::Print(ostream &os) const
 				   nodetype==BTREE_SUPERBLOCK ? "SUPERBLOCK" :
 				   nodetype==BTREE_ROOT_NODE ? "ROOT_NODE" :
 				   nodetype==BTREE_INTERIOR_NODE ? "INTERIOR_NODE" :
-				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" : "UNKNOWN_TYPE")
+				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" : 
+				   nodetype==BTREE_OVERFLOW_NODE ? "OVERFLOW_NODE" : "UNKNOWN_TYPE")
      << ", keysize="<<keysize<<", valuesize="<<valuesize<<", blocksize="<<blocksize
-     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys<<")";
+     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", highwater="<<highwater<<", options="<<options<<", numkeys="<<numkeys<<", prefixlen="<<prefixlen<<", zerotail="<<zerotail<<", heaptop="<<heaptop<<", bigvaluesize="<<bigvaluesize<<", runvalues="<<runvalues<<")";
   return os;
 }
 
 BTreeNode::BTreeNode() 
 {
   info.nodetype=BTREE_UNALLOCATED_BLOCK;
+  info.prefixlen=0;
+  info.zerotail=0;
+  info.heaptop=0;
+  info.bigvaluesize=0;
+  info.runvalues=0;
   data=0;
 }
 
@@ -64,9 +200,16 @@ BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T b
   info.blocksize=block_size;
   info.rootnode=0;
   info.freelist=0;
+  info.highwater=0;
+  info.options=0;
   info.numkeys=0;				       
+  info.prefixlen=0;
+  info.zerotail=0;
+  info.heaptop=0;
+  info.bigvaluesize=0;
+  info.runvalues=0;
   data=0;
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
+  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK) {
     data = new char [info.GetNumDataBytes()];
     memset(data,0,info.GetNumDataBytes());
   }
@@ -80,7 +223,14 @@ BTreeNode::BTreeNode(const BTreeNode &rhs)
   info.blocksize=rhs.info.blocksize;
   info.rootnode=rhs.info.rootnode;
   info.freelist=rhs.info.freelist;
+  info.highwater=rhs.info.highwater;
+  info.options=rhs.info.options;
   info.numkeys=rhs.info.numkeys;				       
+  info.prefixlen=rhs.info.prefixlen;
+  info.zerotail=rhs.info.zerotail;
+  info.heaptop=rhs.info.heaptop;
+  info.bigvaluesize=rhs.info.bigvaluesize;
+  info.runvalues=rhs.info.runvalues;
   data=0;
   if (rhs.data) { 
    data=new char [info.GetNumDataBytes()];
@@ -91,7 +241,14 @@ BTreeNode::BTreeNode(const BTreeNode &rhs)
 
 BTreeNode & BTreeNode::operator=(const BTreeNode &rhs) 
 {
-  return *(new (this) BTreeNode(rhs));
+  if (this!=&rhs) { 
+    if (data) { 
+      delete [] data;
+    }
+    data=0;
+    new (this) BTreeNode(rhs);
+  }
+  return *this;
 }
 
 
@@ -100,11 +257,13 @@ ERROR_T BTreeNode::Serialize(BufferCache *b, const SIZE_T blocknum) const
   assert((unsigned)info.blocksize==b->GetBlockSize());
 
   Block block(sizeof(info)+info.GetNumDataBytes());
+  NodeMetadata out=info;
 
-  memcpy(block.data,&info,sizeof(info));
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) { 
+  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK) { 
     memcpy(block.data+sizeof(info),data,info.GetNumDataBytes());
+    BuildDirectory(out,(char*)(block.data+sizeof(info)));
   }
+  memcpy(block.data,&out,sizeof(out));
 
   return b->WriteBlock(blocknum,block);
 }
@@ -131,7 +290,7 @@ ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
 
   assert(b->GetBlockSize()==(unsigned)info.blocksize);
 
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
+  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK) {
     data = new char [info.GetNumDataBytes()];
     memcpy(data,block.data+sizeof(info),info.GetNumDataBytes());
   }
@@ -146,11 +305,20 @@ char * BTreeNode::ResolveKey(const SIZE_T offset) const
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(sizeof(SIZE_T)+info.keysize);
+    if (info.options & BTREE_NODE_SLOTTED) { 
+      return ResolveEntry(offset)+sizeof(BTREE_SLOT_T);
+    }
+    if (info.options & BTREE_NODE_KEYS_APART) { 
+      return data+(info.GetNumSlotsAsInterior()+1)*sizeof(SIZE_T)+offset*info.GetKeyBytes();
+    }
+    return data+sizeof(SIZE_T)+offset*(sizeof(SIZE_T)+info.GetKeyBytes());
     break;
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize);
+    if (info.options & BTREE_NODE_SLOTTED) { 
+      return ResolveEntry(offset)+sizeof(BTREE_SLOT_T);
+    }
+    return data+sizeof(SIZE_T)+offset*(info.GetKeyBytes()+info.valuesize);
     break;
   default:
     return 0;
@@ -164,9 +332,17 @@ char * BTreeNode::ResolvePtr(const SIZE_T offset) const
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
     assert(offset<=info.numkeys);
-    return data+offset*(sizeof(SIZE_T)+info.keysize);
+    if (info.options & BTREE_NODE_SLOTTED) { 
+      // the pointer right of key offset-1 is its entry's value
+      return offset==0 ? data : ResolveKey(offset-1)+GetKeyLength(offset-1)+sizeof(BTREE_SLOT_T);
+    }
+    if (info.options & BTREE_NODE_KEYS_APART) { 
+      return data+offset*sizeof(SIZE_T);
+    }
+    return data+offset*(sizeof(SIZE_T)+info.GetKeyBytes());
     break;
   case BTREE_LEAF_NODE:
+  case BTREE_OVERFLOW_NODE:
     assert(offset==0);
     return data;
     break;
@@ -182,7 +358,14 @@ char * BTreeNode::ResolveVal(const SIZE_T offset) const
   switch (info.nodetype) { 
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize)+info.keysize;
+    if (info.options & BTREE_NODE_SLOTTED) { 
+      return ResolveKey(offset)+GetKeyLength(offset)+sizeof(BTREE_SLOT_T);
+    }
+    return data+sizeof(SIZE_T)+offset*(info.GetKeyBytes()+info.valuesize)+info.GetKeyBytes();
+    break;
+  case BTREE_OVERFLOW_NODE:
+    assert(offset<info.numkeys);
+    return data+sizeof(SIZE_T)+offset*info.valuesize;
     break;
   default:
     return 0;
@@ -196,6 +379,12 @@ char * BTreeNode::ResolveKeyVal(const SIZE_T offset) const
   return ResolveKey(offset);
 }
 
+
+char * BTreeNode::ResolveBytes() const
+{
+  return info.nodetype==BTREE_OVERFLOW_NODE ? data+sizeof(SIZE_T) : 0;
+}
+
 ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
 {
   char *p=ResolveKey(offset);
@@ -204,8 +393,15 @@ ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
     return ERROR_NOMEM;
   }
   
+  if (info.options & BTREE_NODE_SLOTTED) { 
+    k.Resize(GetKeyLength(offset),false);
+    memcpy(k.data,p,k.length);
+    return ERROR_NOERROR;
+  }
   k.Resize(info.keysize,false);
-  memcpy(k.data,p,info.keysize);
+  memcpy(k.data,ResolvePrefix(),info.prefixlen);
+  memcpy(k.data+info.prefixlen,p,info.GetKeyBytes());
+  memset(k.data+info.keysize-info.zerotail,0,info.zerotail);
   return ERROR_NOERROR;
 }
 
@@ -229,8 +425,10 @@ ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
     return ERROR_NOMEM;
   }
   
-  v.Resize(info.valuesize,false);
-  memcpy(v.data,p,info.valuesize);
+  SIZE_T n= info.options & BTREE_NODE_SLOTTED ? GetValLength(offset) : info.valuesize;
+
+  v.Resize(n,false);
+  memcpy(v.data,p,n);
   return ERROR_NOERROR;
 }
 
@@ -255,7 +453,26 @@ ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
     return ERROR_NOMEM;
   }
 
-  memcpy(p,k.data,info.keysize);
+  if (info.options & BTREE_NODE_SLOTTED) { 
+    if (k.length!=GetKeyLength(offset)) { 
+      if (info.nodetype==BTREE_LEAF_NODE) { 
+	return WriteEntry(offset,(char*)k.data,k.length,ResolveVal(offset),GetValLength(offset),false);
+      }
+      return WriteEntry(offset,(char*)k.data,k.length,ResolvePtr(offset+1),sizeof(SIZE_T),false);
+    }
+    memcpy(p,k.data,k.length);
+    return ERROR_NOERROR;
+  }
+  if (memcmp(k.data,ResolvePrefix(),info.prefixlen)!=0) { 
+    // not in the range of this node
+    return ERROR_INSANE;
+  }
+  if (BTreeZeroTail(k)<info.zerotail) { 
+    // needs more bytes than the node keeps
+    return ERROR_INSANE;
+  }
+  memcpy(p,k.data+info.prefixlen,info.GetKeyBytes());
+  info.options&=~(SIZE_T)BTREE_NODE_DIRECTORY_BUILT;
 
   return ERROR_NOERROR;
 }
@@ -284,6 +501,13 @@ ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v)
     return ERROR_NOMEM;
   }
   
+  if (info.nodetype==BTREE_LEAF_NODE && (info.options & BTREE_NODE_SLOTTED)) { 
+    if (v.length!=GetValLength(offset)) { 
+      return WriteEntry(offset,ResolveKey(offset),GetKeyLength(offset),(char*)v.data,v.length,false);
+    }
+    memcpy(p,v.data,v.length);
+    return ERROR_NOERROR;
+  }
   memcpy(p,v.data,info.valuesize);
   
   return ERROR_NOERROR;
@@ -303,6 +527,746 @@ ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
 
 
 
+SIZE_T BTreeNode::KeyStride() const
+{
+  if (info.nodetype==BTREE_LEAF_NODE) { 
+    return info.GetKeyBytes()+info.valuesize;
+  }
+  if (info.options & BTREE_NODE_KEYS_APART) { 
+    return info.GetKeyBytes();
+  }
+  return info.GetKeyBytes()+sizeof(SIZE_T);
+}
+
+
+// Same kind of node, with the same slots and the same stored part of
+// each key
+bool BTreeNode::SameLayout(const BTreeNode &rhs) const
+{
+  bool leaf=info.nodetype==BTREE_LEAF_NODE;
+
+  return (rhs.info.nodetype==BTREE_LEAF_NODE)==leaf &&
+    !(info.options & BTREE_NODE_SLOTTED) && !(rhs.info.options & BTREE_NODE_SLOTTED) &&
+    (info.options & BTREE_NODE_KEYS_APART)==(rhs.info.options & BTREE_NODE_KEYS_APART) &&
+    info.keysize==rhs.info.keysize && info.valuesize==rhs.info.valuesize && 
+    info.prefixlen==rhs.info.prefixlen && info.zerotail==rhs.info.zerotail &&
+    memcmp(ResolvePrefix(),rhs.ResolvePrefix(),info.prefixlen)==0;
+}
+
+
+void BTreeNode::OpenGap(const SIZE_T offset)
+{
+  SIZE_T n=info.numkeys-offset;
+  char *p;
+
+  info.numkeys++;
+  p=ResolveKey(offset);
+  memmove(p+KeyStride(),p,n*KeyStride());
+  if (info.nodetype!=BTREE_LEAF_NODE && (info.options & BTREE_NODE_KEYS_APART)) { 
+    p=ResolvePtr(offset+1);
+    memmove(p+sizeof(SIZE_T),p,n*sizeof(SIZE_T));
+  }
+  info.options&=~(SIZE_T)BTREE_NODE_DIRECTORY_BUILT;
+}
+
+
+void BTreeNode::CloseGap(const SIZE_T offset)
+{
+  SIZE_T n=info.numkeys-offset-1;
+  char *p;
+
+  p=ResolveKey(offset);
+  memmove(p,p+KeyStride(),n*KeyStride());
+  if (info.nodetype!=BTREE_LEAF_NODE && (info.options & BTREE_NODE_KEYS_APART)) { 
+    p=ResolvePtr(offset+1);
+    memmove(p,p+sizeof(SIZE_T),n*sizeof(SIZE_T));
+  }
+  info.numkeys--;
+  info.options&=~(SIZE_T)BTREE_NODE_DIRECTORY_BUILT;
+}
+
+
+ERROR_T BTreeNode::MoveTail(const SIZE_T first, BTreeNode &to)
+{
+  SIZE_T n=info.numkeys-first;
+  SIZE_T at=to.info.numkeys;
+
+  if (!SameLayout(to)) { 
+    return ERROR_INSANE;
+  }
+  if (at+n > (info.nodetype==BTREE_LEAF_NODE ? to.info.GetNumSlotsAsLeaf() : to.info.GetNumSlotsAsInterior())) { 
+    return ERROR_NOSPACE;
+  }
+  if (n==0) { 
+    return ERROR_NOERROR;
+  }
+  to.info.numkeys+=n;
+  memcpy(to.ResolveKey(at),ResolveKey(first),n*KeyStride());
+  if (info.nodetype!=BTREE_LEAF_NODE && (info.options & BTREE_NODE_KEYS_APART)) { 
+    memcpy(to.ResolvePtr(at+1),ResolvePtr(first+1),n*sizeof(SIZE_T));
+  }
+  info.numkeys=first;
+  info.options&=~(SIZE_T)BTREE_NODE_DIRECTORY_BUILT;
+  to.info.options&=~(SIZE_T)BTREE_NODE_DIRECTORY_BUILT;
+  return ERROR_NOERROR;
+}
+
+
+int BTreeNode::CompareKey(const SIZE_T offset, const KEY_T &k) const
+{
+  SIZE_T width=info.GetKeyBytes();
+  SIZE_T whole=info.keysize-info.prefixlen;
+  SIZE_T rest, n;
+  int c;
+
+  if (info.options & BTREE_NODE_SLOTTED) { 
+    return BTreeByteKeyTraits::Compare(ResolveKey(offset),GetKeyLength(offset),
+				       BTreeByteKeyTraits::MakeProbe(k));
+  }
+  if (info.prefixlen==0 && info.zerotail==0) { 
+    return BTreeByteKeyTraits::Compare(ResolveKey(offset),info.keysize,
+				       BTreeByteKeyTraits::MakeProbe(k));
+  }
+  c=ComparePrefix(k);
+  if (c!=0) { 
+    return c;
+  }
+  // as the byte traits do, on what follows the prefix, the stored 
+  // bytes and then the zero tail
+  rest=k.length-info.prefixlen;
+  n= width<rest ? width : rest;
+  c=memcmp(ResolveKey(offset),k.data+info.prefixlen,n);
+  if (c!=0) { 
+    return c;
+  }
+  for (; n<rest && n<whole; n++) { 
+    if (k.data[info.prefixlen+n]!=0) { 
+      return -1;
+    }
+  }
+  return whole<rest ? -1 : whole>rest ? 1 : 0;
+}
+
+
+SIZE_T BTreeNode::SearchSuffix(const KEY_T &k, const bool upper) const
+{
+  SIZE_T width=info.GetKeyBytes();
+  SIZE_T whole=info.keysize-info.prefixlen;
+  SIZE_T n=k.length-info.prefixlen;
+  SIZE_T i;
+  int c=ComparePrefix(k);
+
+  if (c!=0) { 
+    return c>0 ? 0 : info.numkeys;
+  }
+
+  if (info.zerotail>0 && n>=width) { 
+    // Past the stored bytes every key here is zeros to keysize.  A 
+    // search key that is too is the same as its stored bytes; one 
+    // with something else there is above a key equal in those, as 
+    // is a byte more of it.  Only one that ends in zeros short of 
+    // keysize is below, and that takes comparing whole keys.
+    for (i=width; i<n && i<whole && k.data[info.prefixlen+i]==0; i++) { 
+    }
+    if (i<n && i<whole) { 
+      n=width+1;
+    } else if (n==whole) { 
+      n=width;
+    } else if (n>whole) { 
+      n=width+1;
+    } else {
+      SIZE_T lo=0, hi=info.numkeys;
+      while (lo<hi) { 
+	SIZE_T mid=lo+(hi-lo)/2;
+	c=CompareKey(mid,k);
+	if (c<0 || (upper && c==0)) { 
+	  lo=mid+1;
+	} else {
+	  hi=mid;
+	}
+      }
+      return lo;
+    }
+  }
+
+  // the bytes of k after the prefix, where they are
+  return SearchProbe<BTreeByteKeyTraits>(BTreeByteKeyTraits::MakeProbe(k.data+info.prefixlen,n),
+					 upper);
+}
+
+
+SIZE_T BTreeNode::SearchSlotted(const KEY_T &k, const bool upper) const
+{
+  SIZE_T lo=0, hi=info.numkeys;
+  int c;
+
+  while (lo<hi) { 
+    SIZE_T mid=lo+(hi-lo)/2;
+    c=CompareKey(mid,k);
+    if (c<0 || (upper && c==0)) { 
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+  return lo;
+}
+
+
+char *BTreeNode::ResolvePrefix() const
+{
+  return data+info.GetNumDataBytes()-info.GetNumDirectoryBytes()-info.prefixlen;
+}
+
+
+int BTreeNode::ComparePrefix(const KEY_T &k) const
+{
+  SIZE_T n= info.prefixlen<k.length ? info.prefixlen : k.length;
+  int c;
+
+  if (info.prefixlen==0) { 
+    return 0;
+  }
+  c=memcmp(ResolvePrefix(),k.data,n);
+  if (c!=0) { 
+    return c;
+  }
+  // k is a proper start of the prefix, so shorter than every key here
+  return k.length<info.prefixlen ? 1 : 0;
+}
+
+
+ERROR_T BTreeNode::SetPrefix(const char *prefix, const SIZE_T len)
+{
+  return SetLayout(prefix,len,info.zerotail);
+}
+
+
+ERROR_T BTreeNode::SetZeroTail(const SIZE_T zerotail)
+{
+  return SetLayout(ResolvePrefix(),info.prefixlen,zerotail);
+}
+
+
+ERROR_T BTreeNode::SetLayout(const char *prefix, const SIZE_T len, const SIZE_T zerotail)
+{
+  BTreeNode old(*this);
+  KEY_T newprefix(len);
+  KEY_T key;
+  VALUE_T value;
+  SIZE_T ptr;
+  SIZE_T numslots;
+  ERROR_T rc;
+
+  if (info.options & BTREE_NODE_SLOTTED) { 
+    // keys are kept whole, so there is nothing to lay out again
+    return len==0 && zerotail==0 ? ERROR_NOERROR : ERROR_INSANE;
+  }
+  if (len>=info.keysize) { 
+    return ERROR_SIZE;
+  }
+  // prefix may well point into this node
+  memcpy(newprefix.data,prefix,len);
+
+  info.prefixlen=len;
+  info.zerotail=0;
+  switch (info.nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    info.zerotail=min(zerotail,info.GetMaxZeroTail());
+    numslots=info.GetNumSlotsAsInterior();
+    break;
+  case BTREE_LEAF_NODE:
+    numslots=info.GetNumSlotsAsLeaf();
+    break;
+  default:
+    info.prefixlen=old.info.prefixlen;
+    info.zerotail=old.info.zerotail;
+    return ERROR_INSANE;
+  }
+  if (info.numkeys>numslots) { 
+    info.prefixlen=old.info.prefixlen;
+    info.zerotail=old.info.zerotail;
+    return ERROR_NOSPACE;
+  }
+
+  // Everything moves, so copy it all back from the old layout
+  memset(data,0,info.GetNumDataBytes());
+  memcpy(ResolvePrefix(),newprefix.data,len);
+  info.options&=~(SIZE_T)BTREE_NODE_DIRECTORY_BUILT;
+  for (SIZE_T i=0;i<info.numkeys;i++) { 
+    rc=old.GetKey(i,key);
+    if (rc==ERROR_NOERROR) { 
+      rc=SetKey(i,key);
+    }
+    if (rc==ERROR_NOERROR && info.nodetype==BTREE_LEAF_NODE) { 
+      rc=old.GetVal(i,value);
+      if (rc==ERROR_NOERROR) { 
+	rc=SetVal(i,value);
+      }
+    } else if (rc==ERROR_NOERROR) { 
+      rc=old.GetPtr(i+1,ptr);
+      if (rc==ERROR_NOERROR) { 
+	rc=SetPtr(i+1,ptr);
+      }
+    }
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
+  rc=old.GetPtr(0,ptr);
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+  return SetPtr(0,ptr);
+}
+
+
+//
+// Slotted nodes
+//
+static SIZE_T GetSlotted(const char *p)
+{
+  BTREE_SLOT_T x;
+
+  memcpy(&x,p,sizeof(x));
+  return x;
+}
+
+static void SetSlotted(char *p, const SIZE_T n)
+{
+  BTREE_SLOT_T x=(BTREE_SLOT_T)n;
+
+  memcpy(p,&x,sizeof(x));
+}
+
+static char *ResolveSlot(char *data, const SIZE_T offset)
+{
+  return data+sizeof(SIZE_T)+offset*sizeof(BTREE_SLOT_T);
+}
+
+
+char *BTreeNode::ResolveEntry(const SIZE_T offset) const
+{
+  return data+GetSlotted(ResolveSlot(data,offset));
+}
+
+
+SIZE_T BTreeNode::GetKeyLength(const SIZE_T offset) const
+{
+  return GetSlotted(ResolveEntry(offset));
+}
+
+
+SIZE_T BTreeNode::GetValLength(const SIZE_T offset) const
+{
+  char *p=ResolveEntry(offset);
+
+  return GetSlotted(p+sizeof(BTREE_SLOT_T)+GetSlotted(p));
+}
+
+
+SIZE_T BTreeNode::GetUsedBytes() const
+{
+  SIZE_T n=0;
+
+  for (SIZE_T i=0;i<info.numkeys;i++) { 
+    n+=BTreeSlottedEntryBytes(GetKeyLength(i),GetValLength(i));
+  }
+  return n;
+}
+
+
+SIZE_T BTreeNode::GetFreeBytes() const
+{
+  return info.GetNumSlottedBytes()-GetUsedBytes();
+}
+
+
+ERROR_T BTreeNode::InsertSlot(const SIZE_T offset, const KEY_T &key, const char *val, const SIZE_T vallen)
+{
+  if (offset>info.numkeys) { 
+    return ERROR_INSANE;
+  }
+  return WriteEntry(offset,(char*)key.data,key.length,val,vallen,true);
+}
+
+
+ERROR_T BTreeNode::RemoveSlot(const SIZE_T offset)
+{
+  char *slot;
+
+  if (offset>=info.numkeys) { 
+    return ERROR_INSANE;
+  }
+  slot=ResolveSlot(data,offset);
+  if (GetSlotted(slot)==info.heaptop) { 
+    // the lowest entry in the heap is given back at once
+    info.heaptop+=BTreeSlottedEntryBytes(GetKeyLength(offset),GetValLength(offset))-sizeof(BTREE_SLOT_T);
+  }
+  memmove(slot,slot+sizeof(BTREE_SLOT_T),(info.numkeys-offset-1)*sizeof(BTREE_SLOT_T));
+  info.numkeys--;
+  return ERROR_NOERROR;
+}
+
+
+void BTreeNode::Compact()
+{
+  PackEntries(info.numkeys);
+}
+
+
+// Writes the ith entry, as a new one if added and otherwise in place 
+// of the one there.  The entry is built aside first, as key or val 
+// may point into the node.
+ERROR_T BTreeNode::WriteEntry(const SIZE_T offset, const char *key, const SIZE_T keylen,
+			      const char *val, const SIZE_T vallen, const bool added)
+{
+  SIZE_T bytes=BTreeSlottedEntryBytes(keylen,vallen)-sizeof(BTREE_SLOT_T);
+  SIZE_T slots=sizeof(SIZE_T)+(info.numkeys+(added ? 1 : 0))*sizeof(BTREE_SLOT_T);
+  SIZE_T room=GetFreeBytes();
+  Block entry(bytes);
+
+  if (!added) { 
+    room+=BTreeSlottedEntryBytes(GetKeyLength(offset),GetValLength(offset));
+  }
+  if (room<bytes+sizeof(BTREE_SLOT_T)) { 
+    return ERROR_NOSPACE;
+  }
+  SetSlotted((char*)entry.data,keylen);
+  memcpy(entry.data+sizeof(BTREE_SLOT_T),key,keylen);
+  SetSlotted((char*)entry.data+sizeof(BTREE_SLOT_T)+keylen,vallen);
+  memcpy(entry.data+2*sizeof(BTREE_SLOT_T)+keylen,val,vallen);
+
+  if (info.heaptop<slots+bytes) { 
+    PackEntries(added ? info.numkeys : offset);
+  }
+  info.heaptop-=bytes;
+  memcpy(data+info.heaptop,entry.data,bytes);
+  if (added) { 
+    char *slot=ResolveSlot(data,offset);
+    memmove(slot+sizeof(BTREE_SLOT_T),slot,(info.numkeys-offset)*sizeof(BTREE_SLOT_T));
+    info.numkeys++;
+  }
+  SetSlotted(ResolveSlot(data,offset),info.heaptop);
+  return ERROR_NOERROR;
+}
+
+
+// Packs the live entries, all but the skipth, against the end of data
+void BTreeNode::PackEntries(const SIZE_T skip)
+{
+  SIZE_T end=info.GetNumDataBytes();
+  SIZE_T top=end;
+  Block heap(end);
+
+  for (SIZE_T i=0;i<info.numkeys;i++) { 
+    if (i!=skip) { 
+      SIZE_T bytes=BTreeSlottedEntryBytes(GetKeyLength(i),GetValLength(i))-sizeof(BTREE_SLOT_T);
+      top-=bytes;
+      memcpy(heap.data+top,ResolveEntry(i),bytes);
+      SetSlotted(ResolveSlot(data,i),top);
+    }
+  }
+  memcpy(data+top,heap.data+top,end-top);
+  info.heaptop=top;
+}
+
+
+bool BTreeNode::SlotsMatch() const
+{
+  SIZE_T end=info.GetNumDataBytes();
+  SIZE_T maxval= info.nodetype==BTREE_LEAF_NODE ? info.valuesize : sizeof(SIZE_T);
+  vector<pair<SIZE_T,SIZE_T> > entries;
+
+  if (info.heaptop>end || 
+      info.heaptop<sizeof(SIZE_T)+info.numkeys*sizeof(BTREE_SLOT_T)) { 
+    return false;
+  }
+  for (SIZE_T i=0;i<info.numkeys;i++) { 
+    SIZE_T start=GetSlotted(ResolveSlot(data,i));
+    SIZE_T keylen, vallen;
+
+    if (start<info.heaptop || start+2*sizeof(BTREE_SLOT_T)>end) { 
+      return false;
+    }
+    keylen=GetKeyLength(i);
+    if (keylen>info.keysize || start+2*sizeof(BTREE_SLOT_T)+keylen>end) { 
+      return false;
+    }
+    vallen=GetValLength(i);
+    if (vallen>maxval || (info.nodetype!=BTREE_LEAF_NODE && vallen!=maxval) ||
+	start+2*sizeof(BTREE_SLOT_T)+keylen+vallen>end) { 
+      return false;
+    }
+    entries.push_back(make_pair(start,start+2*sizeof(BTREE_SLOT_T)+keylen+vallen));
+  }
+  sort(entries.begin(),entries.end());
+  for (SIZE_T i=1;i<entries.size();i++) { 
+    if (entries[i].first<entries[i-1].second) { 
+      return false;
+    }
+  }
+  return true;
+}
+
+
+SIZE_T BTreeNode::LowerBound(const KEY_T &k) const
+{
+  return LowerBoundAs<BTreeByteKeyTraits>(k);
+}
+
+
+SIZE_T BTreeNode::UpperBound(const KEY_T &k) const
+{
+  return UpperBoundAs<BTreeByteKeyTraits>(k);
+}
+
+
+
+const char *BTreeNode::Directory() const
+{
+  const char *dir;
+  SIZE_T count;
+
+  if ((info.options & (BTREE_NODE_KEY_DIRECTORY|BTREE_NODE_DIRECTORY_BUILT))!=
+      (BTREE_NODE_KEY_DIRECTORY|BTREE_NODE_DIRECTORY_BUILT) || 
+      info.numkeys<=info.GetDirectoryGroup()) { 
+    return 0;
+  }
+  dir=data+info.GetNumDataBytes()-info.GetNumDirectoryBytes();
+  memcpy(&count,dir,sizeof(SIZE_T));
+  return count==info.numkeys ? dir+sizeof(SIZE_T) : 0;
+}
+
+
+void BTreeNode::BuildDirectory(NodeMetadata &toinfo, char *to) const
+{
+  SIZE_T dirbytes=info.GetNumDirectoryBytes();
+  SIZE_T group=info.GetDirectoryGroup();
+  SIZE_T width=info.GetKeyBytes();
+  SIZE_T stride, size, next;
+  const char *from;
+  char *dir;
+
+  if (dirbytes==0) { 
+    return;
+  }
+  dir=to+info.GetNumDataBytes()-dirbytes;
+  memcpy(dir,&info.numkeys,sizeof(SIZE_T));
+  dir+=sizeof(SIZE_T);
+
+  // Each level takes the last key of each group of the one below
+  from= info.numkeys>0 ? to+(ResolveKey(0)-data) : 0;
+  stride=KeyStride();
+  for (size=info.numkeys; size>group; size=next) { 
+    next=(size+group-1)/group;
+    for (SIZE_T i=0;i<next;i++) { 
+      SIZE_T last= (i+1)*group<size ? (i+1)*group-1 : size-1;
+      memcpy(dir+i*width,from+last*stride,width);
+    }
+    from=dir;
+    stride=width;
+    dir+=next*width;
+  }
+  toinfo.options|=BTREE_NODE_DIRECTORY_BUILT;
+}
+
+
+bool BTreeNode::DirectoryMatches() const
+{
+  const char *dir=Directory();
+  SIZE_T dirbytes=info.GetNumDirectoryBytes();
+
+  if (!dir) { 
+    return true;
+  }
+
+  BTreeNode copy(*this);
+
+  copy.BuildDirectory(copy.info,copy.data);
+  return memcmp(copy.data+info.GetNumDataBytes()-dirbytes,
+		data+info.GetNumDataBytes()-dirbytes,dirbytes)==0;
+}
+
+
+//
+// Counting integer keys below a probe
+//
+// Keys are big endian, and unsigned as stored, so each vector of them
+// is byte swapped and has its sign bits flipped to get numbers the
+// signed vector compares order rightly.  The probe is flipped the same
+// way.  Whichever of AVX2, SSE or plain code the processor can run is 
+// picked the first time, unless BTreeSetCountKernel names one.
+//
+static BTreeCountKernel countkernel=BTREE_KERNEL_BEST;
+
+static bool HasCountKernel(const BTreeCountKernel kernel)
+{
+#ifdef BTREE_X86_KERNELS
+  __builtin_cpu_init();
+  switch (kernel) { 
+  case BTREE_KERNEL_AVX2:
+    return __builtin_cpu_supports("avx2");
+  case BTREE_KERNEL_SSE:
+    return __builtin_cpu_supports("sse4.2");
+  default:
+    return true;
+  }
+#else
+  return kernel==BTREE_KERNEL_BEST || kernel==BTREE_KERNEL_SCALAR;
+#endif
+}
+
+
+bool BTreeSetCountKernel(const BTreeCountKernel kernel)
+{
+  if (!HasCountKernel(kernel)) { 
+    return false;
+  }
+  countkernel=kernel;
+  return true;
+}
+
+
+static BTreeCountKernel CountKernel()
+{
+  if (countkernel==BTREE_KERNEL_BEST) { 
+    countkernel = HasCountKernel(BTREE_KERNEL_AVX2) ? BTREE_KERNEL_AVX2 :
+                  HasCountKernel(BTREE_KERNEL_SSE) ? BTREE_KERNEL_SSE : BTREE_KERNEL_SCALAR;
+  }
+  return countkernel;
+}
+
+
+template <class UINT>
+static SIZE_T CountIntKeysScalar(const char *keys, const SIZE_T n, const UINT probe, const bool orequal)
+{
+  SIZE_T i;
+
+  for (i=0; i<n && BTreeIntKeyTraits<UINT>::Compare(keys+i*sizeof(UINT),sizeof(UINT),probe)<(orequal ? 1 : 0); i++) { 
+  }
+  return i;
+}
+
+
+#ifdef BTREE_X86_KERNELS
+
+__attribute__((target("avx2")))
+static SIZE_T CountIntKeysAVX2(const char *keys, const SIZE_T n, const unsigned int probe, const bool orequal)
+{
+  const __m256i swap=_mm256_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12,
+				      3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+  const __m256i sign=_mm256_set1_epi32((int)0x80000000);
+  const __m256i p=_mm256_set1_epi32((int)(probe^0x80000000));
+  SIZE_T count=0;
+  SIZE_T i;
+
+  for (i=0; i+8<=n; i+=8) { 
+    __m256i k=_mm256_loadu_si256((const __m256i *)(keys+i*4));
+    k=_mm256_xor_si256(_mm256_shuffle_epi8(k,swap),sign);
+    // lanes with k > p (orequal) or p > k
+    __m256i m= orequal ? _mm256_cmpgt_epi32(k,p) : _mm256_cmpgt_epi32(p,k);
+    int c=__builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(m)));
+    count+= orequal ? 8-c : c;
+  }
+  return count+CountIntKeysScalar<unsigned int>(keys+i*4,n-i,probe,orequal);
+}
+
+
+__attribute__((target("avx2")))
+static SIZE_T CountIntKeysAVX2(const char *keys, const SIZE_T n, const unsigned long long probe, const bool orequal)
+{
+  const __m256i swap=_mm256_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8,
+				      7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8);
+  const __m256i sign=_mm256_set1_epi64x((long long)0x8000000000000000ULL);
+  const __m256i p=_mm256_set1_epi64x((long long)(probe^0x8000000000000000ULL));
+  SIZE_T count=0;
+  SIZE_T i;
+
+  for (i=0; i+4<=n; i+=4) { 
+    __m256i k=_mm256_loadu_si256((const __m256i *)(keys+i*8));
+    k=_mm256_xor_si256(_mm256_shuffle_epi8(k,swap),sign);
+    __m256i m= orequal ? _mm256_cmpgt_epi64(k,p) : _mm256_cmpgt_epi64(p,k);
+    int c=__builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(m)));
+    count+= orequal ? 4-c : c;
+  }
+  return count+CountIntKeysScalar<unsigned long long>(keys+i*8,n-i,probe,orequal);
+}
+
+
+__attribute__((target("sse4.2")))
+static SIZE_T CountIntKeysSSE(const char *keys, const SIZE_T n, const unsigned int probe, const bool orequal)
+{
+  const __m128i swap=_mm_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+  const __m128i sign=_mm_set1_epi32((int)0x80000000);
+  const __m128i p=_mm_set1_epi32((int)(probe^0x80000000));
+  SIZE_T count=0;
+  SIZE_T i;
+
+  for (i=0; i+4<=n; i+=4) { 
+    __m128i k=_mm_loadu_si128((const __m128i *)(keys+i*4));
+    k=_mm_xor_si128(_mm_shuffle_epi8(k,swap),sign);
+    __m128i m= orequal ? _mm_cmpgt_epi32(k,p) : _mm_cmpgt_epi32(p,k);
+    int c=__builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(m)));
+    count+= orequal ? 4-c : c;
+  }
+  return count+CountIntKeysScalar<unsigned int>(keys+i*4,n-i,probe,orequal);
+}
+
+
+__attribute__((target("sse4.2")))
+static SIZE_T CountIntKeysSSE(const char *keys, const SIZE_T n, const unsigned long long probe, const bool orequal)
+{
+  const __m128i swap=_mm_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8);
+  const __m128i sign=_mm_set1_epi64x((long long)0x8000000000000000ULL);
+  const __m128i p=_mm_set1_epi64x((long long)(probe^0x8000000000000000ULL));
+  SIZE_T count=0;
+  SIZE_T i;
+
+  for (i=0; i+2<=n; i+=2) { 
+    __m128i k=_mm_loadu_si128((const __m128i *)(keys+i*8));
+    k=_mm_xor_si128(_mm_shuffle_epi8(k,swap),sign);
+    __m128i m= orequal ? _mm_cmpgt_epi64(k,p) : _mm_cmpgt_epi64(p,k);
+    int c=__builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(m)));
+    count+= orequal ? 2-c : c;
+  }
+  return count+CountIntKeysScalar<unsigned long long>(keys+i*8,n-i,probe,orequal);
+}
+
+#endif
+
+
+SIZE_T BTreeCountIntKeys(const char *keys, const SIZE_T n, const unsigned int probe, const bool orequal)
+{
+  switch (CountKernel()) { 
+#ifdef BTREE_X86_KERNELS
+  case BTREE_KERNEL_AVX2:
+    return CountIntKeysAVX2(keys,n,probe,orequal);
+  case BTREE_KERNEL_SSE:
+    return CountIntKeysSSE(keys,n,probe,orequal);
+#endif
+  default:
+    return CountIntKeysScalar<unsigned int>(keys,n,probe,orequal);
+  }
+}
+
+
+SIZE_T BTreeCountIntKeys(const char *keys, const SIZE_T n, const unsigned long long probe, const bool orequal)
+{
+  switch (CountKernel()) { 
+#ifdef BTREE_X86_KERNELS
+  case BTREE_KERNEL_AVX2:
+    return CountIntKeysAVX2(keys,n,probe,orequal);
+  case BTREE_KERNEL_SSE:
+    return CountIntKeysSSE(keys,n,probe,orequal);
+#endif
+  default:
+    return CountIntKeysScalar<unsigned long long>(keys,n,probe,orequal);
+  }
+}
+
+
 
 ostream & BTreeNode::Print(ostream &os) const 
 {
@@ -345,3 +1309,80 @@ ostream & BTreeNode::Print(ostream &os) const
   os <<")";
   return os;
 }
+
+
+
+BTreeNodeView::BTreeNodeView() : cache(0), block(0), frame(0)
+{}
+
+
+BTreeNodeView::~BTreeNodeView()
+{
+  Unpin();
+}
+
+
+ERROR_T BTreeNodeView::Pin(BufferCache *b, const SIZE_T blocknum, Block *known)
+{
+  ERROR_T rc;
+
+  rc=Unpin();
+
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+
+  if (known) { 
+    b->PinFrame(known);
+    frame=known;
+  } else {
+    rc=b->PinBlock(blocknum,frame);
+
+    if (rc!=ERROR_NOERROR) { 
+      frame=0;
+      return rc;
+    }
+  }
+
+  cache=b;
+  block=blocknum;
+
+  memcpy(&info,frame->data,sizeof(info));
+
+  assert(b->GetBlockSize()==(unsigned)info.blocksize);
+
+  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK) {
+    data=(char*)(frame->data+sizeof(info));
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNodeView::Unpin()
+{
+  // The frame is not ours to free
+  data=0;
+
+  if (!frame) { 
+    return ERROR_NOERROR;
+  }
+
+  Block *f=frame;
+
+  frame=0;
+  return cache->UnpinFrame(f);
+}
+
+
+ERROR_T BTreeNodeView::MarkDirty()
+{
+  if (!frame) { 
+    return ERROR_INSANE;
+  }
+
+  BuildDirectory(info,data);
+  memcpy(frame->data,&info,sizeof(info));
+
+  return cache->MarkDirty(block);
+}
@@ -2,6 +2,7 @@
 #define _btree_ds
 
 #include <iostream>
+#include <string.h>
 #include "global.h"
 #include "block.h"
 
@@ -13,6 +14,28 @@ using namespace std;
 #define BTREE_ROOT_NODE 2
 #define BTREE_INTERIOR_NODE 3
 #define BTREE_LEAF_NODE 4
+#define BTREE_OVERFLOW_NODE 5
+
+// Index options, kept in the superblock
+#define BTREE_OPT_SPLIT_AT_INSERT 0x1
+#define BTREE_OPT_MAY_BE_UNDERFULL 0x2   // split at insert at some point, so not cleared
+#define BTREE_OPT_NONUNIQUE 0x4          // a key may have many values
+#define BTREE_OPT_INT_KEYS 0x8           // keys are 4 or 8 byte integers
+#define BTREE_OPT_KEYS_APART 0x10        // new interior nodes keep keys apart
+#define BTREE_OPT_KEY_DIRECTORY 0x20     // interior and leaf nodes have a key directory
+#define BTREE_OPT_PREFIX 0x40            // nodes keep the prefix their keys share once
+#define BTREE_OPT_TRUNCATE 0x80          // separators are cut short
+#define BTREE_OPT_SLOTTED 0x200          // keys and values of any length up to the sizes
+#define BTREE_OPT_BIG_VALUES 0x400       // values are kept in overflow blocks
+
+// Node options.  BTREE_NODE_KEY_DIRECTORY and BTREE_NODE_SLOTTED have
+// the same values as BTREE_OPT_KEY_DIRECTORY and BTREE_OPT_SLOTTED, so
+// a copy of the superblock's metadata gives the slot counts of the 
+// index's nodes.
+#define BTREE_NODE_KEYS_APART 0x1        // interior: keys apart from pointers
+#define BTREE_NODE_KEY_DIRECTORY 0x20    // interior or leaf: room for a directory
+#define BTREE_NODE_DIRECTORY_BUILT 0x40  // ... and it is up to date
+#define BTREE_NODE_SLOTTED 0x200         // interior or leaf: slots and a heap of entries
 
 
 typedef Block Buffer;
@@ -24,6 +47,116 @@ typedef KeyOrValue VALUE_T;
 class BufferCache;
 struct KeyValuePair;
 
+
+//
+// Key traits, for searching the keys of a node.  A trait makes a
+// probe from the search key once and compares stored keys with it.
+// A search narrows down to Window keys and Count finishes it off,
+// counting the keys below the probe (or, with orequal, not above it).
+//
+// Bytes are the default: stored keys are exactly keysize bytes, but 
+// the search key may be shorter or longer (e.g., from the command line
+// tools), so the common bytes are compared and then the shorter one 
+// sorts first.
+//
+struct BTreeByteKeyTraits {
+  // The bytes of a key, or of the part of one after a prefix, in place
+  struct Probe {
+    const BYTE_T *data;
+    SIZE_T        length;
+  };
+
+  enum { Window = 1 };
+
+  static Probe MakeProbe(const KEY_T &k) { return MakeProbe(k.data,k.length); }
+
+  static Probe MakeProbe(const BYTE_T *data, const SIZE_T length) { 
+    Probe k;
+
+    k.data=data;
+    k.length=length;
+    return k;
+  }
+
+  static int Compare(const char *p, const SIZE_T keysize, const Probe &k) { 
+    SIZE_T n = keysize<k.length ? keysize : k.length;
+    int c = memcmp(p,k.data,n);
+
+    if (c) { 
+      return c;
+    }
+    return keysize<k.length ? -1 : keysize>k.length ? 1 : 0;
+  }
+
+  static SIZE_T Count(const char *keys, const SIZE_T n, const SIZE_T stride, 
+		      const SIZE_T keysize, const Probe &k, const bool orequal) { 
+    SIZE_T i;
+
+    for (i=0; i<n && Compare(keys+i*stride,keysize,k)<(orequal ? 1 : 0); i++) { 
+    }
+    return i;
+  }
+};
+
+// Number of n contiguous big endian integer keys below probe (or not
+// above it), a vector at a time with AVX2 or SSE where the processor
+// has them
+SIZE_T BTreeCountIntKeys(const char *keys, const SIZE_T n, const unsigned int probe, const bool orequal);
+SIZE_T BTreeCountIntKeys(const char *keys, const SIZE_T n, const unsigned long long probe, const bool orequal);
+
+// Which code BTreeCountIntKeys runs: the best the processor has, as
+// by default, or the one named, so each can be tested.  False if the
+// processor (or the build) does not have it.
+enum BTreeCountKernel {BTREE_KERNEL_BEST, BTREE_KERNEL_SCALAR, BTREE_KERNEL_SSE, BTREE_KERNEL_AVX2};
+
+bool BTreeSetCountKernel(const BTreeCountKernel kernel);
+
+//
+// Integer keys are stored big endian with the sign bit flipped, so 
+// their bytes sort as the integers do and comparing bytes is right
+// everywhere.  A search loads each as an unsigned integer of the same 
+// width instead.  The search key must be keysize bytes.
+//
+template <class UINT>
+struct BTreeIntKeyTraits {
+  typedef UINT Probe;
+
+  enum { Window = 64/sizeof(UINT) };
+
+  static UINT Load(const void *p) { 
+    UINT x;
+
+    memcpy(&x,p,sizeof(UINT));
+#if __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+    x = sizeof(UINT)==4 ? (UINT)__builtin_bswap32((unsigned int)x) : (UINT)__builtin_bswap64(x);
+#endif
+    return x;
+  }
+
+  static Probe MakeProbe(const KEY_T &k) { return Load(k.data); }
+
+  static int Compare(const char *p, const SIZE_T keysize, const Probe &k) { 
+    UINT x=Load(p);
+
+    return x<k ? -1 : x>k ? 1 : 0;
+  }
+
+  static SIZE_T Count(const char *keys, const SIZE_T n, const SIZE_T stride, 
+		      const SIZE_T keysize, const Probe &k, const bool orequal) { 
+    SIZE_T i;
+
+    if (stride==sizeof(UINT)) { 
+      return BTreeCountIntKeys(keys,n,k,orequal);
+    }
+    for (i=0; i<n && Compare(keys+i*stride,keysize,k)<(orequal ? 1 : 0); i++) { 
+    }
+    return i;
+  }
+};
+
+typedef BTreeIntKeyTraits<unsigned int>       BTreeInt32KeyTraits;
+typedef BTreeIntKeyTraits<unsigned long long> BTreeInt64KeyTraits;
+
 struct NodeMetadata {
   int nodetype;
   SIZE_T keysize; 
@@ -31,17 +164,43 @@ struct NodeMetadata {
   SIZE_T blocksize;
   SIZE_T rootnode; //meaningful only for superblock
   SIZE_T freelist; //meaningful only for superblock or a free block
+  SIZE_T highwater; //meaningful only for superblock: blocks from here on were never used
+  SIZE_T options; //superblock: BTREE_OPT_* flags, interior or root: BTREE_NODE_* flags
   SIZE_T numkeys;
+  SIZE_T prefixlen; //interior or leaf: leading bytes all its keys share, kept once
+  SIZE_T zerotail; //interior or root: trailing bytes all its keys have as zeros, not kept
+  SIZE_T heaptop; //slotted: where in data the heap of entries starts
+  SIZE_T bigvaluesize; //superblock, with BTREE_OPT_BIG_VALUES: size of the values
+  SIZE_T runvalues; //superblock, with BTREE_OPT_NONUNIQUE: values a run keeps in its leaf entry
 
   SIZE_T GetNumDataBytes() const;
   SIZE_T GetNumSlotsAsInterior() const;
   SIZE_T GetNumSlotsAsLeaf() const;
+  SIZE_T GetNumSlotsAsOverflow() const;
+  SIZE_T GetNumOverflowBytes() const;   // big values: bytes of a value per overflow block
+  SIZE_T GetDirectoryGroup() const;     // keys per directory entry
+  SIZE_T GetNumDirectoryBytes() const;  // 0 without a directory
+  SIZE_T GetKeyBytes() const;           // stored per key, keysize less prefix and zero tail
+  SIZE_T GetMaxZeroTail() const;        // most an interior node may leave out
+  SIZE_T GetNumSlottedBytes() const;    // slotted: room for slots and entries
 
   ostream &Print(ostream &rhs) const;
-			  
+
+ private:
+  SIZE_T GetNumSlots(const SIZE_T entrysize) const;
 };
 
 
+// Keys in all levels of a directory over n keys
+SIZE_T BTreeDirectoryKeys(const SIZE_T n, const SIZE_T group);
+
+// Trailing zero bytes of k
+SIZE_T BTreeZeroTail(const KEY_T &k);
+
+// Bytes a slotted node gives an entry, its slot included
+SIZE_T BTreeSlottedEntryBytes(const SIZE_T keylen, const SIZE_T vallen);
+
+
 inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return node.Print(os); }
 
 
@@ -51,18 +210,124 @@ inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return nod
 //
 // PTR KEY PTR KEY PTR KEY PTR
 //
+// or with BTREE_NODE_KEYS_APART, room for one more pointer than there
+// are key slots, then the keys
+//
+// PTR PTR PTR PTR ... KEY KEY KEY ...
+//
 // Leaf:
 //
 // PTR* KEY VALUE KEY VALUE KEY VALUE
 //
-// *Here this pointer is not used
+// *Here this pointer is the next leaf to the right (0 for the last)
+//
+// In an index that is not unique, the VALUE in a leaf is a run of
+// values for its key, packed in the entry:
+//
+// COUNT PTR** VALUE VALUE ...
+//
+// with room for the superblock's runvalues VALUEs, of which the first
+// COUNT (or all, if COUNT is more) are in use.  **The first overflow
+// block, holding the values that do not fit (0 if they all do).  The
+// valuesize of the nodes is that of the run, BTREE_RUN_HEADER more 
+// than runvalues values.  runvalues is as many as fit in 
+// BTREE_RUN_INLINE bytes, but at least two.
+//
+// Overflow:
+//
+// PTR*** VALUE VALUE VALUE
+//
+// ***The next overflow block of the run (0 for the last).  numkeys
+// counts the values, and valuesize is that of a value.  Only the 
+// first block of a run may be partly full.
+//
+// Big values:
+//
+// With BTREE_OPT_BIG_VALUES, the VALUE in a leaf is a stub
+//
+// LENGTH PTR
+//
+// giving the length of the value and the first overflow block of its
+// bytes.  The valuesize of the nodes is that of the stub, and the 
+// superblock's bigvaluesize that of the values.  Each overflow block
+// holds the next part of the value:
+//
+// PTR BYTES
+//
+// with PTR the next block (0 for the last) and numkeys counting the 
+// bytes.  Only the last block of a value may be partly full.
+//
+// Prefix:
+//
+// ... PREFIX DIRECTORY
+//
+// With prefixlen>0 every key of an interior or leaf node starts with 
+// the same prefixlen bytes, kept once before the directory (if any). 
+// The slots above hold only the rest of each key, so more of them 
+// fit.  GetKey and SetKey deal in whole keys.
+//
+// Key directory:
+//
+// With BTREE_NODE_KEY_DIRECTORY, interior and leaf nodes end with a
+// small static tree over their keys, so a search in a big block reads
+// a few cache lines instead of one per halving.  The keys are taken in
+// groups of GetDirectoryGroup(); level 1 holds the last key of each 
+// group, level 2 the last of each group of level 1, and so on up to a
+// level of at most one group.
+//
+// ... COUNT LEVEL1 LEVEL2 ... LEVELTOP
+//
+// COUNT is numkeys when it was built.  It is built as the node is
+// written, and used only while BTREE_NODE_DIRECTORY_BUILT is set and
+// COUNT still matches; changing a key clears the flag.
+//
+// Slotted:
+//
+// PTR SLOT SLOT SLOT ... free ... ENTRY ENTRY ENTRY
+//
+// With BTREE_NODE_SLOTTED, an interior or leaf node holds keys and 
+// values of any length up to keysize and valuesize.  The two byte 
+// SLOTs, in key order, give where in data each ENTRY starts; entries 
+// are taken from the heap at the end of data, downwards from heaptop,
+// in whatever order they come.
+//
+// ENTRY = KEYLEN KEY VALLEN VALUE
+//
+// with two byte lengths.  In an interior node VALUE is the pointer
+// to the right of KEY.  An entry removed or written again leaves its
+// old bytes dead in the heap; when the free bytes between the slots
+// and heaptop are too few, the live entries are packed up again.  
+// There is no prefix, zero tail or directory.
+//
+// Superblock:
+//
+// COUNT EXTENT EXTENT ... MAGIC VERSION
+//
+// The extents that still have blocks to hand out, COUNT of them, each
+//
+// EXTENT = FIRST LEVEL NEXT END
+//
+// The last two words of the superblock say that the disk holds an
+// index, and which version of the layout on disk it has.  Attach 
+// takes no other version; any change to what is kept on disk moves
+// BTREE_FORMAT_VERSION on.
+//
+#define BTREE_MAGIC 0x42547265
+#define BTREE_FORMAT_VERSION 4
+
+#define BTREE_RUN_HEADER (2*sizeof(SIZE_T))
+#define BTREE_RUN_INLINE 32
+#define BTREE_BIG_VALUE_STUB (2*sizeof(SIZE_T))
+
+typedef unsigned short BTREE_SLOT_T;
 
 
 struct BTreeNode {
   NodeMetadata  info;
   char         *data;
   //
-  // unallocated or superblock => blank
+  // unallocated => blank
+  // superblock => see above
   // interior => array of keys
   // leaf => array of key/value pairs
 
@@ -83,27 +348,213 @@ struct BTreeNode {
 
   char *ResolveKey(const SIZE_T offset) const; // Gives a pointer to the ith key  (interior or leaf)
   char *ResolvePtr(const SIZE_T offset) const; // Gives a pointer to the ith pointer (interior)
-  char *ResolveVal(const SIZE_T offset) const; // Gives a pointer to the ith value (leaf)
+  char *ResolveVal(const SIZE_T offset) const; // Gives a pointer to the ith value (leaf or overflow)
   char *ResolveKeyVal(const SIZE_T offset) const ; // Gives a pointer to the ith keyvalue pair (leaf)
+  char *ResolveBytes() const; // Gives a pointer to the bytes of a big value (overflow)
 
   ERROR_T GetKey(const SIZE_T offset, KEY_T &k) const ; // Gives the ith key  (interior or leaf)
   ERROR_T GetPtr(const SIZE_T offset, SIZE_T &p) const ;   // Gives the ith pointer (interior)
-  ERROR_T GetVal(const SIZE_T offset, VALUE_T &v) const ; // Gives  the ith value (leaf)
+  ERROR_T GetVal(const SIZE_T offset, VALUE_T &v) const ; // Gives  the ith value (leaf or overflow)
   ERROR_T GetKeyVal(const SIZE_T offset, KeyValuePair &p) const; // Gives  the ith key value pair (leaf)
 
 
   ERROR_T SetKey(const SIZE_T offset, const KEY_T &k); // Writesthe ith key  (interior or leaf)
   ERROR_T SetPtr(const SIZE_T offset, const SIZE_T &p);   // Writes the ith pointer (interior)
-  ERROR_T SetVal(const SIZE_T offset, const VALUE_T &v); // Writes the ith value (leaf)
+  ERROR_T SetVal(const SIZE_T offset, const VALUE_T &v); // Writes the ith value (leaf or overflow)
   ERROR_T SetKeyVal(const SIZE_T offset, const KeyValuePair &p); // Writes the ith key value pair (leaf)
 
+  // In-place search over the keys stored in data (interior or leaf)
+  // No key is copied out of the node while searching
+  int    CompareKey(const SIZE_T offset, const KEY_T &k) const; // <0, 0, >0 as in memcmp
+  SIZE_T LowerBound(const KEY_T &k) const; // offset of the first key >= k (numkeys if none)
+  SIZE_T UpperBound(const KEY_T &k) const; // offset of the first key >  k (numkeys if none)
+
+  // The same searches, comparing keys as KeyTraits says
+  template <class KeyTraits> SIZE_T LowerBoundAs(const KEY_T &k) const;
+  template <class KeyTraits> SIZE_T UpperBoundAs(const KEY_T &k) const;
+  template <class KeyTraits> SIZE_T SearchAs(const KEY_T &k, const bool upper) const;
+  template <class KeyTraits> SIZE_T SearchProbe(const typename KeyTraits::Probe &probe,
+						const bool upper) const;
+  SIZE_T SearchSuffix(const KEY_T &k, const bool upper) const;
+  SIZE_T SearchSlotted(const KEY_T &k, const bool upper) const;
+
+  // The prefix all keys share.  ComparePrefix gives >0 if every key 
+  // the node may hold is above k, <0 if every one is below, and 0 if
+  // k starts with the prefix.  SetLayout lays the node out again for
+  // a new prefix and zero tail, which the keys must all have; 
+  // ERROR_NOSPACE if they would not fit.  The zero tail is held to 
+  // GetMaxZeroTail().  SetPrefix and SetZeroTail change just the one.
+  char  *ResolvePrefix() const;
+  int     ComparePrefix(const KEY_T &k) const;
+  ERROR_T SetLayout(const char *prefix, const SIZE_T len, const SIZE_T zerotail);
+  ERROR_T SetPrefix(const char *prefix, const SIZE_T len);
+  ERROR_T SetZeroTail(const SIZE_T zerotail);
+
+  SIZE_T KeyStride() const; // bytes from one key to the next (interior or leaf)
+
+  // Fixed layouts.  OpenGap makes room for a new ith entry, moving the
+  // entries from i on up by one, and CloseGap takes the ith one out;
+  // an interior entry is key i and pointer i+1.  MoveTail appends the
+  // entries from first on to to and leaves first; to must be laid out
+  // the same (ERROR_INSANE if not, see SameLayout) and have room for 
+  // them (ERROR_NOSPACE).  Each is a memmove or two over data.
+  bool    SameLayout(const BTreeNode &rhs) const;
+  void    OpenGap(const SIZE_T offset);
+  void    CloseGap(const SIZE_T offset);
+  ERROR_T MoveTail(const SIZE_T first, BTreeNode &to);
+
+  // Slotted nodes.  GetKeyLength and GetValLength give the bytes of
+  // the ith key and value, GetUsedBytes the bytes of slots and live 
+  // entries and GetFreeBytes what else would fit once packed.  
+  // InsertSlot makes a new ith entry (val is the pointer to the right
+  // of key in an interior node), and RemoveSlot takes the ith one out;
+  // ERROR_NOSPACE if it would not fit, and the node is left as it was.
+  // Compact packs the live entries at the end of data.
+  SIZE_T  GetKeyLength(const SIZE_T offset) const;
+  SIZE_T  GetValLength(const SIZE_T offset) const;
+  SIZE_T  GetUsedBytes() const;
+  SIZE_T  GetFreeBytes() const;
+  ERROR_T InsertSlot(const SIZE_T offset, const KEY_T &key, const char *val, const SIZE_T vallen);
+  ERROR_T RemoveSlot(const SIZE_T offset);
+  void    Compact();
+  // Whether the slots point at entries that lie within the heap, 
+  // apart and of lengths the index allows
+  bool    SlotsMatch() const;
+
+  // Level 1 of the key directory, or 0 if there is none to use
+  const char *Directory() const;
+  // Writes the directory over the keys in to, a copy of data, and 
+  // marks toinfo as having it
+  void BuildDirectory(NodeMetadata &toinfo, char *to) const;
+  // Whether a directory in use agrees with the keys
+  bool DirectoryMatches() const;
+
   ostream &Print(ostream &rhs) const;
+
+ private:
+  char   *ResolveEntry(const SIZE_T offset) const;
+  ERROR_T WriteEntry(const SIZE_T offset, const char *key, const SIZE_T keylen,
+		     const char *val, const SIZE_T vallen, const bool added);
+  void    PackEntries(const SIZE_T skip);
 };
 
 
 inline ostream & operator<<(ostream &os, const BTreeNode &node) { return node.Print(os); }
 
 
+template <class KeyTraits>
+SIZE_T BTreeNode::LowerBoundAs(const KEY_T &k) const
+{
+  return SearchAs<KeyTraits>(k,false);
+}
+
+
+template <class KeyTraits>
+SIZE_T BTreeNode::UpperBoundAs(const KEY_T &k) const
+{
+  return SearchAs<KeyTraits>(k,true);
+}
+
+
+// Offset of the first key > k if upper, else the first key >= k.  
+// The stored parts of keys behind a prefix or before a zero tail, and
+// the keys of slotted nodes, are compared as bytes.
+template <class KeyTraits>
+SIZE_T BTreeNode::SearchAs(const KEY_T &k, const bool upper) const
+{
+  if (info.options & BTREE_NODE_SLOTTED) { 
+    return SearchSlotted(k,upper);
+  }
+  if (info.prefixlen>0 || info.zerotail>0) { 
+    return SearchSuffix(k,upper);
+  }
+  return SearchProbe<KeyTraits>(KeyTraits::MakeProbe(k),upper);
+}
+
+
+template <class KeyTraits>
+SIZE_T BTreeNode::SearchProbe(const typename KeyTraits::Probe &probe, const bool upper) const
+{
+  const char *keys;
+  SIZE_T stride=KeyStride();
+  SIZE_T width=info.GetKeyBytes();
+  SIZE_T lo=0, hi=info.numkeys;
+  int c;
+
+  if (info.numkeys==0) { 
+    return 0;
+  }
+  keys=ResolveKey(0);
+  if (const char *dir=Directory()) { 
+    // Descend the directory to one group of keys
+    SIZE_T group=info.GetDirectoryGroup();
+    SIZE_T sizes[64];
+    const char *levels[64];
+    SIZE_T top=0;
+    SIZE_T g=0;
+
+    sizes[0]=info.numkeys;
+    levels[0]=keys;
+    while (sizes[top]>group) { 
+      sizes[top+1]=(sizes[top]+group-1)/group;
+      levels[top+1]= top==0 ? dir : levels[top]+sizes[top]*width;
+      top++;
+    }
+    for (SIZE_T level=top; level>0; level--) { 
+      SIZE_T first=g*group;
+      SIZE_T n= sizes[level]-first<group ? sizes[level]-first : group;
+      g=first+KeyTraits::Count(levels[level]+first*width,n,width,width,probe,upper);
+      if (g==sizes[level]) { 
+	return info.numkeys;
+      }
+    }
+    lo=g*group;
+    hi= info.numkeys-lo<group ? info.numkeys : lo+group;
+  }
+  while (hi-lo>(SIZE_T)KeyTraits::Window) { 
+    SIZE_T mid=lo+(hi-lo)/2;
+    c=KeyTraits::Compare(keys+mid*stride,width,probe);
+    if (c<0 || (upper && c==0)) { 
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+  return lo+KeyTraits::Count(keys+lo*stride,hi-lo,stride,width,probe,upper);
+}
+
+
+//
+// A view of a node that lives in a frame pinned in the buffer cache.
+// data points straight into the frame, so the accessors above read
+// and write the cached block in place and nothing is allocated.
+// Only the small info header is held here; MarkDirty writes it back
+// and tells the cache the frame must be written out.
+//
+// Serialize/Unserialize are not for views - use Pin instead.  A view
+// may be copied into a plain BTreeNode, which gives an owned copy.
+//
+struct BTreeNodeView : public BTreeNode {
+  BufferCache  *cache;
+  SIZE_T        block;
+  Block        *frame;
+
+  BTreeNodeView();
+  // Unpins if still pinned
+  ~BTreeNodeView();
+
+  // With frame, the block's frame as kept from an earlier pin, it is
+  // pinned without being looked up
+  ERROR_T Pin(BufferCache *b, const SIZE_T block, Block *frame=0);
+  ERROR_T Unpin();
+  ERROR_T MarkDirty();
+
+ private:
+  BTreeNodeView(const BTreeNodeView &rhs);
+  BTreeNodeView & operator=(const BTreeNodeView &rhs);
+};
+
+
 
 
 
@@ -4,7 +4,7 @@
 
 void usage() 
 {
-  cerr << "usage: btree_init filestem cachesize keysize valuesize\n";
+  cerr << "usage: btree_init filestem cachesize keysize valuesize [middle|atinsert] [unique|nonunique] [bytes|int] [together|soa] [flat|grouped] [full|prefix] [whole|cut] [fixed|varlen] [inline|overflow]\n";
 }
 
 
@@ -13,8 +13,18 @@ int main(int argc, char **argv)
   char *filestem;
   SIZE_T cachesize, keysize, valuesize;
   SIZE_T superblocknum;
+  bool atinsert=false;
+  bool unique=true;
+  bool intkeys=false;
+  bool apart=false;
+  bool directory=false;
+  bool prefix=false;
+  bool truncate=false;
+  bool slotted=false;
+  bool big=false;
+  int i;
 
-  if (argc!=5) { 
+  if (argc<5 || argc>14) { 
     usage();
     return -1;
   }
@@ -23,10 +33,58 @@ int main(int argc, char **argv)
   cachesize=atoi(argv[2]);
   keysize=atoi(argv[3]);
   valuesize=atoi(argv[4]);
+  for (i=5;i<argc;i++) { 
+    if (argv[i][0]=='a') { 
+      atinsert=true;
+    } else if (argv[i][0]=='n') { 
+      unique=false;
+    } else if (argv[i][0]=='i') { 
+      intkeys=true;
+    } else if (argv[i][0]=='s') { 
+      apart=true;
+    } else if (argv[i][0]=='g') { 
+      directory=true;
+    } else if (argv[i][0]=='p') { 
+      prefix=true;
+    } else if (argv[i][0]=='c') { 
+      truncate=true;
+    } else if (argv[i][0]=='v') { 
+      slotted=true;
+    } else if (argv[i][0]=='o') { 
+      big=true;
+    }
+  }
 
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
-  BTreeIndex btree(keysize,valuesize,&cache);
+  BTreeIndex btree(keysize,valuesize,&cache,unique);
+
+  if (atinsert) { 
+    btree.SetSplitPolicy(BTREE_SPLIT_AT_INSERT);
+  }
+  if (apart) { 
+    btree.SetKeysApart();
+  }
+  if (directory) { 
+    btree.SetKeyDirectory();
+  }
+  if (prefix) { 
+    btree.SetPrefixCompression();
+  }
+  if (truncate) { 
+    btree.SetSuffixTruncation();
+  }
+  if (intkeys && btree.SetIntegerKeys()!=ERROR_NOERROR) { 
+    cerr << "Integer keys must be 4 or 8 bytes\n";
+    return -1;
+  }
+  if (slotted && btree.SetSlottedPages()!=ERROR_NOERROR) { 
+    cerr << "Variable length keys need a block of at most 64K that holds four of the longest entries\n";
+    return -1;
+  }
+  if (big) { 
+    btree.SetBigValues(0);
+  }
   
   ERROR_T rc;
 
@@ -42,8 +42,9 @@ int main(int argc, char **argv)
     return -1;
   } else {
     cerr << "Index attached!"<<endl;
+    KEY_T k;
     VALUE_T val;
-    if ((rc=btree.Lookup(KEY_T(key),val))!=ERROR_NOERROR) { 
+    if ((rc=btree.ParseKey(key,k))!=ERROR_NOERROR || (rc=btree.Lookup(k,val))!=ERROR_NOERROR) { 
       cerr <<"Lookup failed: error "<<rc<<endl;
     } else {
       cerr <<"Lookup succeeded\n";
@@ -40,6 +40,10 @@ int main(int argc, char **argv)
     cerr << "Index attached!"<<endl;
     // Your Implementation should do the right thing here
     cout << btree;
+    double leafdistance;
+    if ((rc=btree.LeafDistance(leafdistance))==ERROR_NOERROR) { 
+      cerr << "Average distance between adjacent leaves: "<<leafdistance<<" blocks\n";
+    }
     if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
       cerr <<"Can't detach from index due to error "<<rc<<endl;
       return -1;
@@ -40,7 +40,8 @@ int main(int argc, char **argv)
     return -1;
   } else {
     cerr << "Index attached!"<<endl;
-    if ((rc=btree.Update(KEY_T(key),VALUE_T(value)))!=ERROR_NOERROR) { 
+    KEY_T k;
+    if ((rc=btree.ParseKey(key,k))!=ERROR_NOERROR || (rc=btree.Update(k,VALUE_T(value)))!=ERROR_NOERROR) { 
       cerr <<"Can't update index due to error "<<rc<<endl;
     } else {
       cerr <<"Update succeeded\n";
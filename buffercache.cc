@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "buffercache.h"
 
 ERROR_T BufferCache::CheckDeleteOldest()
@@ -17,7 +19,8 @@ ERROR_T BufferCache::CheckDeleteOldest()
   for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
 	 i!=blockmap.end();
 	 ++i) {
-       if ((*i).second.lastaccessed<oldest) { 
+       // Pinned frames may not move, so they are never victims
+       if ((*i).second.pincount==0 && (*i).second.lastaccessed<oldest) { 
 	 oldestptr=i;
 	 oldest=(*i).second.lastaccessed;
        }
@@ -37,11 +40,47 @@ ERROR_T BufferCache::CheckDeleteOldest()
 	return rc;
       }
     }
+    NotifyChanged((*oldestptr).first);
     blockmap.erase(oldestptr);
   }
   return ERROR_NOERROR;
 }
 
+
+void BufferCache::NotifyChanged(const SIZE_T blocknum)
+{
+  for (SIZE_T i=0;i<observers.size();i++) { 
+    observers[i]->BlockChanged(blocknum);
+  }
+}
+
+
+void BufferCache::NotifyAll()
+{
+  for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
+       i!=blockmap.end();
+       ++i) {
+    NotifyChanged((*i).first);
+  }
+}
+
+
+void BufferCache::AddObserver(BufferCacheObserver *o)
+{
+  observers.push_back(o);
+}
+
+
+void BufferCache::RemoveObserver(BufferCacheObserver *o)
+{
+  for (SIZE_T i=0;i<observers.size();i++) { 
+    if (observers[i]==o) { 
+      observers.erase(observers.begin()+i);
+      return;
+    }
+  }
+}
+
 BufferCache::BufferCache(DiskSystem *d,
 			 SIZE_T cs) : 
    disk(d), cachesize(cs), curtime(0),
@@ -60,6 +99,7 @@ BufferCache::~BufferCache()
 
 ERROR_T BufferCache::Attach()
 {
+  NotifyAll();
   blockmap.clear();
   return ERROR_NOERROR;
 }
@@ -83,6 +123,7 @@ ERROR_T BufferCache::Detach()
       }
     }
   }
+  NotifyAll();
   blockmap.clear();
   return ERROR_NOERROR;
 }
@@ -128,7 +169,7 @@ bool  BufferCache::IsBlockAllocated(const SIZE_T inblocknum)
 }
 
 
-ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock) 
+ERROR_T BufferCache::GetFrame(const SIZE_T inblocknum, Block *&frame)
 {
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
 
@@ -136,9 +177,8 @@ ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock)
 
   if (b!=blockmap.end()) {
     // It's in  cache, just update its lastaccessed and return it
-    outblock=(*b).second;
-    (*b).second.lastaccessed=curtime;
-    reads++;
+    frame=&((*b).second);
+    frame->lastaccessed=curtime;
     return ERROR_NOERROR;
   } else {
     // It's not in cache, so time to allocate it
@@ -150,22 +190,115 @@ ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock)
       }
     }
     double reqtime;
+    Block myblock;
     int rc = disk->Read(inblocknum,
-			outblock,
+			myblock,
 			reqtime);
     curtime+=reqtime;
     diskreads++;
     if (rc!=ERROR_NOERROR) { 
       return rc;
     } else {
-      outblock.lastaccessed=curtime;
-      outblock.dirty=false;
-      blockmap[inblocknum]=outblock;
-      reads++;
+      myblock.lastaccessed=curtime;
+      myblock.dirty=false;
+      blockmap[inblocknum]=myblock;
+      frame=&(blockmap[inblocknum]);
       return ERROR_NOERROR;
     }
   }
+}
+
+
+ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock) 
+{
+  Block *frame;
+
+  ERROR_T rc = GetFrame(inblocknum,frame);
+
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+
+  outblock=*frame;
+  reads++;
+  return ERROR_NOERROR;
 } 
+
+
+ERROR_T BufferCache::PinBlock(const SIZE_T blocknum, Block *&frame)
+{
+  ERROR_T rc = GetFrame(blocknum,frame);
+
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+
+  frame->pincount++;
+  reads++;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BufferCache::UnpinBlock(const SIZE_T blocknum)
+{
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+
+  b = blockmap.find(blocknum);
+
+  if (b==blockmap.end() || (*b).second.pincount==0) { 
+    return ERROR_INSANE;
+  }
+
+  (*b).second.pincount--;
+  return ERROR_NOERROR;
+}
+
+
+Block *BufferCache::GetResidentFrame(const SIZE_T blocknum)
+{
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+
+  b = blockmap.find(blocknum);
+
+  return b==blockmap.end() ? 0 : &((*b).second);
+}
+
+
+bool BufferCache::IsBlockPinned(const SIZE_T blocknum)
+{
+  Block *frame=GetResidentFrame(blocknum);
+
+  return frame && frame->pincount>0;
+}
+
+
+ERROR_T BufferCache::UnpinFrame(Block *frame)
+{
+  if (frame->pincount==0) { 
+    return ERROR_INSANE;
+  }
+  frame->pincount--;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BufferCache::MarkDirty(const SIZE_T blocknum)
+{
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+
+  b = blockmap.find(blocknum);
+
+  if (b==blockmap.end()) { 
+    return ERROR_NOSUCHBLOCK;
+  }
+
+  NotifyChanged(blocknum);
+  (*b).second.lastaccessed=curtime;
+  (*b).second.dirty=true;
+  writes++;
+  return ERROR_NOERROR;
+}
+
  
 ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
 {
@@ -175,7 +308,15 @@ ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
 
   if (b!=blockmap.end()) {
     // It's in  cache, so just replace the block
-    (*b).second=inblock;
+    NotifyChanged(inblocknum);
+    // Copy over the existing frame so that pinned pointers stay valid
+    if ((*b).second.length==inblock.length) { 
+      memcpy((*b).second.data,inblock.data,inblock.length);
+    } else {
+      SIZE_T pins=(*b).second.pincount;
+      (*b).second=inblock;
+      (*b).second.pincount=pins;
+    }
     (*b).second.lastaccessed=curtime;
     (*b).second.dirty=true;
     writes++;
@@ -223,8 +364,13 @@ ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
+      (*b).second.dirty=false;
+    }
+    // A pinned frame is written, but stays resident
+    if ((*b).second.pincount==0) { 
+      NotifyChanged(blocknum);
+      blockmap.erase(b);
     }
-    blockmap.erase(b);
     return ERROR_NOERROR;
   }
 }
@@ -249,7 +395,7 @@ ostream & BufferCache::Print(ostream &os) const
     if (b!=blockmap.begin()) { 
       os << ", ";
     }
-    os << (*b).first << ((*b).second.dirty ? "(dirty)" : "");
+    os << (*b).first << ((*b).second.dirty ? "(dirty)" : "") << ((*b).second.pincount ? "(pinned)" : "");
   }
   os << "}, disk="<<*disk<<")";
   
@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <map>
+#include <vector>
 
 #include "global.h"
 #include "block.h"
@@ -17,6 +18,17 @@ struct cache_compare_lessthan {
 };
 
 
+//
+// Told whenever a cached block is written or leaves the cache, so that
+// whatever was made from its frame can go with it
+//
+class BufferCacheObserver {
+ public:
+  virtual ~BufferCacheObserver() {}
+  virtual void BlockChanged(const SIZE_T blocknum)=0;
+};
+
+
 //
 // LRU block cache with single step prefetch
 //
@@ -29,8 +41,13 @@ class BufferCache {
   map<SIZE_T, Block, cache_compare_lessthan> blockmap;
   double curtime;
   SIZE_T allocs, deallocs, reads, writes, diskreads, diskwrites;
+  vector<BufferCacheObserver *> observers;
  protected:
   ERROR_T CheckDeleteOldest();
+  void    NotifyChanged(const SIZE_T blocknum);
+  void    NotifyAll();
+  // Finds the resident frame for the block, reading it in on a miss
+  ERROR_T GetFrame(const SIZE_T blocknum, Block *&frame);
  public:
   // Cache size is in number of blocks
   BufferCache(DiskSystem *disk,
@@ -71,6 +88,36 @@ class BufferCache {
   // ERROR_WRONGSIZEBLOCK or other nonzero error codes
   ERROR_T WriteBlock(const SIZE_T inblocknum, const Block &inblock);
   
+  // Zero-copy access to a resident frame
+  //
+  // PinBlock returns a pointer to the cached copy of the block.  The
+  // frame will not be evicted, and the pointer (and its data) stays
+  // valid, until the matching UnpinBlock.  Pins nest.  If you modify
+  // the frame in place, call MarkDirty so that it gets written back.
+  // returns one of ERROR_NOERROR  (zero)
+  // ERROR_NOSUCHBLOCK or other nonzero error codes
+  ERROR_T PinBlock(const SIZE_T blocknum, Block *&frame);
+  ERROR_T UnpinBlock(const SIZE_T blocknum);
+  ERROR_T MarkDirty(const SIZE_T blocknum);
+
+  // Observers are told of every write to a block and every eviction,
+  // before the frame changes or goes.  A frame an observer has kept
+  // (from PinBlock) stays valid until then, and Touch counts a use of
+  // it as a read without looking it up.
+  void    AddObserver(BufferCacheObserver *o);
+  void    RemoveObserver(BufferCacheObserver *o);
+  void    Touch(Block *frame) { frame->lastaccessed=curtime; reads++; }
+
+  // PinBlock and UnpinBlock for a frame already in hand, pinned or 
+  // kept by an observer, without looking the block up
+  void    PinFrame(Block *frame) { Touch(frame); frame->pincount++; }
+  ERROR_T UnpinFrame(Block *frame);
+
+  // The block's frame if it is in the cache, else 0.  Reads nothing 
+  // and counts no use, so checks can look without disturbing the cache.
+  Block  *GetResidentFrame(const SIZE_T blocknum);
+  bool    IsBlockPinned(const SIZE_T blocknum);
+
   // Request that a block be read into the cache
   // This returns immediately.
   // ERROR_NOFETCH means that there is no room currently
@@ -20,7 +20,19 @@ while ($numerr<$maxerrs && !eof(CMD) && !eof(REF) && !eof(TEST)) {
     # spans multiple output lines, each of which needs to be checked.
     # it must be the case that both implementations found this was OK.
 
-    undef %refcontent if defined(%refcontent);
+    $sawerror=0;
+
+    if ($ref ne $test) { 
+      print "----------------------------------------------------------------------------\n";
+      print "ERROR $numerr found on operation $i\n\n";
+      print "Operation is \"$cmd\"\n\n";
+      print "Reference implementation says: \"$ref\"\n";
+      print "Test implementation says:      \"$test\"\n";
+      print "----------------------------------------------------------------------------\n";
+      $sawerror=1;
+    }
+
+    undef %refcontent;
     while (1) {
       $disp=<REF>; chomp($disp);
       last if $disp=~/END DISPLAY/;
@@ -28,7 +40,7 @@ while ($numerr<$maxerrs && !eof(CMD) && !eof(REF) && !eof(TEST)) {
       $refcontent{$1}=$2;
     }
       
-    undef %testcontent if defined(%testcontent);
+    undef %testcontent;
     while (1) {
       $disp=<TEST>; chomp($disp);
       last if $disp=~/END DISPLAY/;
@@ -39,8 +51,6 @@ while ($numerr<$maxerrs && !eof(CMD) && !eof(REF) && !eof(TEST)) {
     @refkeys = sort keys %refcontent;
     @testkeys = sort keys %testcontent;
 
-    $sawerror=0;
-
     if ($#refkeys!=$#testkeys) { 
       print "----------------------------------------------------------------------------\n";
       print "ERROR $numerr found on operation $i\n\n";
@@ -4,6 +4,8 @@
 #include <string>
 #include <strstream>
 #include <fstream>
+#include <string.h>
+#include <map>
 #include "btree.h"
 
 
@@ -11,7 +13,251 @@ using namespace std;
 
 void usage()
 {
-  cerr << "usage: sim filestem cachesize < specfile \n";
+  cerr << "usage: sim filestem cachesize [atinsert] [soa] [grouped] [prefix] [cut] [varlen] [overflow] [scan] [bulk] [stats] [nonunique] [sane] [int] [scalar|sse|avx2] [nodecache[=N]] [pinned[=N]] < specfile \n";
+  cerr << "       scan looks up and displays through cursors rather than Lookup and Display\n";
+  cerr << "       bulk empties the index before each display and bulk loads it again, full and half full in turn\n";
+  cerr << "       stats checks GetStats against a scan and the size of the disk before each display\n";
+  cerr << "       nonunique gives each key a run of up to 39 more values, which only sim sees\n";
+  cerr << "       sane checks the index after each insert, update and delete, and fails the operation if it is not\n";
+  cerr << "       int makes the keys signed integers, hashed from the test's keys, and checks their order at each display\n";
+  cerr << "       scalar, sse and avx2 pick the loop that counts integer keys in a node; only soa nodes use sse and avx2\n";
+  cerr << "       nodecache keeps N interior nodes (default 16) decoded, and sane checks them against the buffer cache\n";
+  cerr << "       pinned keeps the top N levels (default 2) pinned, and sane checks that they are\n";
+}
+
+
+//
+// Every pair in the index, in order, through a cursor
+//
+ERROR_T ScanAll(BTreeIndex *btree, vector<KEY_T> &keys, vector<VALUE_T> &values)
+{
+  BTreeCursor cursor;
+  KEY_T k;
+  VALUE_T v;
+  ERROR_T rc;
+
+  keys.clear();
+  values.clear();
+  if ((rc=btree->SeekFirst(cursor))!=ERROR_NOERROR) { 
+    return rc;
+  }
+  while ((rc=btree->Next(cursor,k,v))==ERROR_NOERROR) { 
+    keys.push_back(k);
+    values.push_back(v);
+  }
+  return rc==ERROR_NONEXISTENT ? ERROR_NOERROR : rc;
+}
+
+
+//
+// Checks what GetStats says against a scan of the index: the pairs
+// and keys there are, the children of each level, and every block of
+// the disk counted once
+//
+ERROR_T CheckStats(BTreeIndex *btree, const SIZE_T numblocks)
+{
+  BTreeStats stats;
+  vector<KEY_T> keys;
+  vector<VALUE_T> values;
+  SIZE_T distinct=0;
+  SIZE_T blocks;
+  ERROR_T rc;
+
+  if ((rc=btree->GetStats(stats))!=ERROR_NOERROR || 
+      (rc=ScanAll(btree,keys,values))!=ERROR_NOERROR) { 
+    return rc;
+  }
+  for (SIZE_T i=0;i<keys.size();i++) { 
+    if (i==0 || !(keys[i]==keys[i-1])) { 
+      distinct++;
+    }
+  }
+  if (stats.entries!=keys.size() || stats.levels.empty() || 
+      stats.levels.back().keys!=distinct) { 
+    return ERROR_INSANE;
+  }
+  // the superblock
+  blocks=1+stats.overflowblocks+stats.freelistblocks+stats.unusedblocks;
+  for (SIZE_T i=0;i<stats.levels.size();i++) { 
+    const BTreeLevelStats &l=stats.levels[i];
+    SIZE_T filled=0;
+    for (SIZE_T j=0;j<BTREE_FILL_BUCKETS;j++) { 
+      filled+=l.fill[j];
+    }
+    if (filled!=l.nodes || l.keys>l.slots || 
+	(i+1<stats.levels.size() && l.keys+l.nodes!=stats.levels[i+1].nodes)) { 
+      return ERROR_INSANE;
+    }
+    blocks+=l.nodes;
+  }
+  return blocks==numblocks ? ERROR_NOERROR : ERROR_INSANE;
+}
+
+
+//
+// Empties the index and bulk loads what it held back into it
+//
+ERROR_T BulkReload(BTreeIndex *btree, const double fillfactor)
+{
+  vector<KEY_T> keys;
+  vector<VALUE_T> values;
+  ERROR_T rc;
+
+  if ((rc=ScanAll(btree,keys,values))!=ERROR_NOERROR) { 
+    return rc;
+  }
+  for (SIZE_T i=0;i<keys.size();i++) { 
+    // a key with a run of values is deleted once
+    if ((i==0 || !(keys[i]==keys[i-1])) && 
+	(rc=btree->Delete(keys[i]))!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
+  if ((rc=btree->BulkLoadBegin(fillfactor))!=ERROR_NOERROR) { 
+    return rc;
+  }
+  for (SIZE_T i=0;i<keys.size();i++) { 
+    if ((rc=btree->BulkLoadAppend(keys[i],values[i]))!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
+  return btree->BulkLoadEnd();
+}
+
+
+//
+// In a nonunique index, each key gets the value the test gives it and
+// a run of shadow values after it, so runs of many lengths are made.
+// How many depends on the key.  Shadow values have bytes above 0x80, 
+// which the test never uses, and only sim sees them.
+//
+#define MAX_SHADOWS 40
+
+SIZE_T NumShadows(const KEY_T &key)
+{
+  SIZE_T h=0;
+
+  for (SIZE_T i=0;i<key.length;i++) { 
+    h=h*31+key.data[i];
+  }
+  return h%MAX_SHADOWS;
+}
+
+
+VALUE_T Shadow(const SIZE_T valuesize, const SIZE_T j)
+{
+  VALUE_T v(valuesize);
+
+  memset(v.data,0x80+j,valuesize);
+  return v;
+}
+
+
+bool IsShadow(const VALUE_T &v)
+{
+  return v.length>0 && v.data[0]>=0x80;
+}
+
+
+//
+// The index key for the test's key: the key itself, or with int, a
+// hash of it as an integer of the index's keysize, remembered in names
+// so a display can print the test's key
+//
+KEY_T SimKey(BTreeIndex *btree, const string &key, const bool integer, map<long long,string> &names)
+{
+  unsigned long long h=14695981039346656037ULL;
+  long long x;
+
+  if (!integer) { 
+    return KEY_T(key.c_str());
+  }
+  for (SIZE_T i=0;i<key.size();i++) { 
+    h=(h^(BYTE_T)key[i])*1099511628211ULL;
+  }
+  x=(long long)h;
+  if (btree->IntegerKey(0).length==4) { 
+    x=(long long)(int)h;
+  }
+  names[x]=key;
+  return btree->IntegerKey(x);
+}
+
+
+//
+// The value the test gave key, checking its run has just the one and
+// all its shadows
+//
+ERROR_T RunLookup(BTreeIndex *btree, const KEY_T &key, VALUE_T &value)
+{
+  vector<VALUE_T> values;
+  SIZE_T found=0;
+  ERROR_T rc;
+
+  if ((rc=btree->LookupAll(key,values))!=ERROR_NOERROR) { 
+    return rc;
+  }
+  for (SIZE_T i=0;i<values.size();i++) { 
+    if (!IsShadow(values[i])) { 
+      value=values[i];
+      found++;
+    }
+  }
+  return found==1 && values.size()==1+NumShadows(key) ? ERROR_NOERROR : ERROR_INSANE;
+}
+
+
+ERROR_T RunInsert(BTreeIndex *btree, const KEY_T &key, const VALUE_T &value)
+{
+  VALUE_T old;
+  ERROR_T rc;
+
+  if ((rc=RunLookup(btree,key,old))!=ERROR_NONEXISTENT) { 
+    return rc==ERROR_NOERROR ? ERROR_CONFLICT : rc;
+  }
+  if ((rc=btree->Insert(key,value))!=ERROR_NOERROR) { 
+    return rc;
+  }
+  for (SIZE_T j=0;j<NumShadows(key);j++) { 
+    if ((rc=btree->Insert(key,Shadow(value.length,j)))!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T RunUpdate(BTreeIndex *btree, const KEY_T &key, const VALUE_T &value)
+{
+  VALUE_T old;
+  ERROR_T rc;
+
+  if ((rc=RunLookup(btree,key,old))!=ERROR_NOERROR || 
+      (rc=btree->Delete(key,old))!=ERROR_NOERROR) { 
+    return rc;
+  }
+  return btree->Insert(key,value);
+}
+
+
+//
+// Takes the shadows out one at a time and then, by turns, the last
+// value or the key
+//
+ERROR_T RunDelete(BTreeIndex *btree, const KEY_T &key)
+{
+  VALUE_T old;
+  ERROR_T rc;
+
+  if ((rc=RunLookup(btree,key,old))!=ERROR_NOERROR) { 
+    return rc;
+  }
+  for (SIZE_T j=0;j<NumShadows(key);j++) { 
+    if ((rc=btree->Delete(key,Shadow(old.length,j)))!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
+  return NumShadows(key)%2 ? btree->Delete(key) : btree->Delete(key,old);
 }
 
 
@@ -20,7 +266,7 @@ int main(int argc, char *argv[])
 
   // CONFORMS to the interface of ref_impl.pl
 
-  if (argc != 3){
+  if (argc < 3){
     usage();
     return 1;
   }
@@ -28,6 +274,60 @@ int main(int argc, char *argv[])
   char *filestem=argv[1];
   SIZE_T cachesize=atoi(argv[2]);
   SIZE_T superblocknum;
+  bool atinsert=false, apart=false, directory=false, prefix=false;
+  bool truncate=false, slotted=false, big=false, scan=false, bulk=false, stats=false, nonunique=false, sane=false;
+  bool integer=false;
+  SIZE_T nodecache=0;
+  SIZE_T pinned=0;
+  map<long long,string> names;
+  SIZE_T numdisplays=0;
+
+  for (int i=3;i<argc;i++) { 
+    if (!strcmp(argv[i],"atinsert")) { 
+      atinsert=true;
+    } else if (!strcmp(argv[i],"soa")) { 
+      apart=true;
+    } else if (!strcmp(argv[i],"grouped")) { 
+      directory=true;
+    } else if (!strcmp(argv[i],"prefix")) { 
+      prefix=true;
+    } else if (!strcmp(argv[i],"cut")) { 
+      truncate=true;
+    } else if (!strcmp(argv[i],"varlen")) { 
+      slotted=true;
+    } else if (!strcmp(argv[i],"overflow")) { 
+      big=true;
+    } else if (!strcmp(argv[i],"scan")) { 
+      scan=true;
+    } else if (!strcmp(argv[i],"bulk")) { 
+      bulk=true;
+    } else if (!strcmp(argv[i],"stats")) { 
+      stats=true;
+    } else if (!strcmp(argv[i],"nonunique")) { 
+      nonunique=true;
+      // Display shows the first value of each run, which may be a shadow
+      scan=true;
+    } else if (!strcmp(argv[i],"sane")) { 
+      sane=true;
+    } else if (!strcmp(argv[i],"int")) { 
+      integer=true;
+      // Display would print the hashes
+      scan=true;
+    } else if (!strncmp(argv[i],"nodecache",9) && (argv[i][9]==0 || argv[i][9]=='=')) { 
+      nodecache= argv[i][9] ? atoi(argv[i]+10) : 16;
+    } else if (!strncmp(argv[i],"pinned",6) && (argv[i][6]==0 || argv[i][6]=='=')) { 
+      pinned= argv[i][6] ? atoi(argv[i]+7) : 2;
+    } else if (!strcmp(argv[i],"scalar") || !strcmp(argv[i],"sse") || !strcmp(argv[i],"avx2")) { 
+      if (!BTreeSetCountKernel(!strcmp(argv[i],"scalar") ? BTREE_KERNEL_SCALAR :
+			       !strcmp(argv[i],"sse") ? BTREE_KERNEL_SSE : BTREE_KERNEL_AVX2)) { 
+	cerr << "This machine can't run "<<argv[i]<<"\n";
+	return 1;
+      }
+    } else {
+      usage();
+      return 1;
+    }
+  }
 
   FILE *file; 
   char line[1024];
@@ -40,7 +340,7 @@ int main(int argc, char *argv[])
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
   // will be set on init
-  BTreeIndex *btree;
+  BTreeIndex *btree=0;
 
 
   if ((rc=cache.Attach())!=ERROR_NOERROR) {
@@ -57,9 +357,46 @@ int main(int argc, char *argv[])
     line2 = line;
     istrstream is(line2.c_str(),line2.size());
     is >> action >> key >> value;
+    KEY_T k;
+
+    if (btree && action!="INIT" && action!="DISPLAY" && action!="DEINIT") { 
+      k=SimKey(btree,key,integer,names);
+    }
 
     if (action == "INIT") {
-      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache);
+      // the test's keysize only picks how wide the integers are
+      btree = new BTreeIndex(integer ? (atoi(key.c_str())<8 ? 4 : 8) : atoi(key.c_str()),
+			     atoi(value.c_str()),&cache,!nonunique);
+      if (integer) { 
+	btree->SetIntegerKeys();
+      }
+      if (atinsert) { 
+	btree->SetSplitPolicy(BTREE_SPLIT_AT_INSERT);
+      }
+      if (apart) { 
+	btree->SetKeysApart();
+      }
+      if (directory) { 
+	btree->SetKeyDirectory();
+      }
+      if (prefix) { 
+	btree->SetPrefixCompression();
+      }
+      if (truncate) { 
+	btree->SetSuffixTruncation();
+      }
+      if (slotted) { 
+	btree->SetSlottedPages();
+      }
+      if (big) { 
+	btree->SetBigValues(0);
+      }
+      if (nodecache) { 
+	btree->SetNodeCache(nodecache);
+      }
+      if (pinned) { 
+	btree->SetPinnedLevels(pinned);
+      }
       if ((rc=btree->Attach(0, true))!=ERROR_NOERROR) {
 	cerr << "Can't attach btree with initialization due to error "<<rc<<"\n";
 	cout << "FAIL\n";
@@ -67,21 +404,27 @@ int main(int argc, char *argv[])
 	cout << "OK\n";
       }
     } else if (action == "INSERT"){
-      if ((rc=btree->Insert(KEY_T(key.c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
+      if ((rc= nonunique ? RunInsert(btree,k,VALUE_T(value.c_str())) :
+	   btree->Insert(k,VALUE_T(value.c_str())))!=ERROR_NOERROR ||
+	  (sane && (rc=btree->SanityCheck())!=ERROR_NOERROR)) { 
         cout <<"FAIL"<<endl;
 	cerr <<"Can't insert due to error "<<rc<<"\n";
       } else {
         cout <<"OK\n";
       }
     } else if (action == "UPDATE"){
-      if ((rc=btree->Update(KEY_T(key.c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
+      if ((rc= nonunique ? RunUpdate(btree,k,VALUE_T(value.c_str())) :
+	   btree->Update(k,VALUE_T(value.c_str())))!=ERROR_NOERROR ||
+	  (sane && (rc=btree->SanityCheck())!=ERROR_NOERROR)) { 
         cout <<"FAIL" <<endl;
 	cerr <<"Can't update due to error "<<rc<<"\n";
       } else {
         cout <<"OK\n";
       }
     } else if (action == "DELETE"){
-      if ((rc=btree->Delete(KEY_T(key.c_str())))!=ERROR_NOERROR) { 
+      if ((rc= nonunique ? RunDelete(btree,k) :
+	   btree->Delete(k))!=ERROR_NOERROR ||
+	  (sane && (rc=btree->SanityCheck())!=ERROR_NOERROR)) { 
         cout <<"FAIL"<<endl;
 	cerr <<"Can't delete due to error "<<rc<<endl;
       } else {
@@ -89,7 +432,21 @@ int main(int argc, char *argv[])
       }
     } else if (action == "LOOKUP"){
       VALUE_T lookup_value;
-      if ((rc=btree->Lookup(KEY_T(key.c_str()),lookup_value))!=ERROR_NOERROR) { 
+      if (nonunique) { 
+	rc=RunLookup(btree,k,lookup_value);
+      } else if (scan) { 
+	// the first pair at or after the key, if it is that key
+	BTreeCursor cursor;
+	KEY_T found;
+	if ((rc=btree->Seek(k,cursor))==ERROR_NOERROR &&
+	    (rc=btree->Next(cursor,found,lookup_value))==ERROR_NOERROR &&
+	    !(found==k)) { 
+	  rc=ERROR_NONEXISTENT;
+	}
+      } else {
+	rc=btree->Lookup(k,lookup_value);
+      }
+      if (rc!=ERROR_NOERROR) { 
         cout <<"FAIL"<< endl;
 	cerr <<"Can't lookup due to error "<<rc<<endl;
       } else {
@@ -100,9 +457,50 @@ int main(int argc, char *argv[])
  	cout << endl;
       }
     } else if (action == "DISPLAY") {
+      vector<KEY_T> keys;
+      vector<VALUE_T> values;
+      rc=ERROR_NOERROR;
+      if (bulk && 
+	  ((rc=BulkReload(btree,numdisplays++%2 ? 0.5 : 1.0))!=ERROR_NOERROR ||
+	   (sane && (rc=btree->SanityCheck())!=ERROR_NOERROR))) { 
+	cerr <<"Can't bulk load due to error "<<rc<<endl;
+      }
+      if (rc==ERROR_NOERROR && scan && (rc=ScanAll(btree,keys,values))!=ERROR_NOERROR) { 
+	cerr <<"Can't scan due to error "<<rc<<endl;
+      }
+      for (SIZE_T i=1; rc==ERROR_NOERROR && integer && i<keys.size(); i++) { 
+	long long prev=btree->IntegerKeyValue(keys[i-1]), cur=btree->IntegerKeyValue(keys[i]);
+	if (cur<prev || (cur==prev && !nonunique)) { 
+	  cerr <<"Integer keys out of order: "<<prev<<" then "<<cur<<endl;
+	  rc=ERROR_INSANE;
+	}
+      }
+      if (rc==ERROR_NOERROR && stats && 
+	  (rc=CheckStats(btree,cache.GetNumBlocks()))!=ERROR_NOERROR) { 
+	cerr <<"Stats do not add up, error "<<rc<<endl;
+      }
       // This should always be OK
-      cout <<"OK BEGIN DISPLAY\n";
-      btree->Display(cout,BTREE_SORTED_KEYVAL);
+      cout <<(rc==ERROR_NOERROR ? "OK" : "FAIL")<<" BEGIN DISPLAY\n";
+      if (scan) { 
+	for (SIZE_T i=0; i<keys.size(); i++) { 
+	  if (IsShadow(values[i])) { 
+	    continue;
+	  }
+	  cout << "(";
+	  if (integer) { 
+	    cout << names[btree->IntegerKeyValue(keys[i])];
+	  } else {
+	    btree->PrintKey(cout,keys[i]);
+	  }
+	  cout << ",";
+	  for (unsigned int j=0; j<values[i].length; j++) {
+	    cout << values[i].data[j];
+	  }
+	  cout << ")\n";
+	}
+      } else {
+	btree->Display(cout,BTREE_SORTED_KEYVAL);
+      }
       cout <<"OK END DISPLAY\n";
     } else if (action == "DEINIT"){
       if ((rc=btree->Detach(superblocknum))!=ERROR_NOERROR) { 
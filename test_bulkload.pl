@@ -0,0 +1,98 @@
+#!/usr/bin/perl -w
+
+# Checks the btree_bulkload tool.  Makes an index with btree_init,
+# loads sorted random pairs into it with btree_bulkload, checks it
+# with btree_sane and btree_stats, and then looks up a sample of the
+# keys, and of keys that were not loaded, with btree_lookup.
+
+$diskstem="__bulk";
+$numblocks=8192;
+$blocksize=256;
+$heads=1;
+$blockspertrack=8192;
+$tracks=1;
+$avgseek=10;
+$trackseek=1;
+$rotlat=10;
+$cachesize=64;
+
+$keysize=16;
+$valuesize=8;
+$keybytes="abcdefghijklmnopqrstuvwxyz0123456789";
+$numlookups=50;
+
+$#ARGV>=2 or die "usage: test_bulkload.pl seed numpairs fillfactor [btree_init option ...]\n";
+
+($seed,$numpairs,$fillfactor,@initopts)=@ARGV;
+
+$ENV{PATH}.=":.";
+
+srand $seed;
+
+sub MakeKey {
+  return join("", map { substr($keybytes,int(rand(length($keybytes))),1) } (1..$keysize));
+}
+
+%content=();
+while (keys %content < $numpairs) {
+  $content{MakeKey()}=join("", map { substr($keybytes,int(rand(length($keybytes))),1) } (1..$valuesize));
+}
+
+$t=time();
+$pid=$$;
+
+open(PAIRS,">BULK.$t.$pid.input");
+foreach $key (sort keys %content) {
+  print PAIRS "$key $content{$key}\n";
+}
+close(PAIRS);
+
+system "deletedisk $diskstem";
+system "makedisk $diskstem $numblocks $blocksize $heads $blockspertrack $tracks $avgseek $trackseek $rotlat";
+system "btree_init $diskstem $cachesize $keysize $valuesize @initopts";
+
+$numerr=0;
+
+$out=`btree_bulkload $diskstem $cachesize $fillfactor < BULK.$t.$pid.input 2>&1`;
+if ($out!~/Loaded $numpairs pairs/) {
+  print "ERROR: btree_bulkload did not load $numpairs pairs\n$out";
+  $numerr++;
+}
+
+$out=`btree_sane $diskstem $cachesize 2>&1`;
+if ($out!~/Sanity check succeded/) {
+  print "ERROR: btree_sane says the loaded index is not sane\n$out";
+  $numerr++;
+}
+
+$out=`btree_stats $diskstem $cachesize 2>&1`;
+if ($out!~/ $numpairs entries/) {
+  print "ERROR: btree_stats does not count $numpairs entries\n$out";
+  $numerr++;
+}
+
+@keys=keys %content;
+for ($i=0;$i<$numlookups;$i++) {
+  my $key=$keys[int(rand($#keys+1))];
+  # btree_lookup prints the value's bytes in hex
+  my $hex=unpack("H*",$content{$key});
+  my $value=`btree_lookup $diskstem $cachesize $key 2>/dev/null`;
+  if ($value!~/data=0x$hex\b/) {
+    print "ERROR: LOOKUP $key returns \"$value\" rather than $content{$key}\n";
+    $numerr++;
+  }
+  do {
+    $key=MakeKey();
+  } while (defined $content{$key});
+  $value=`btree_lookup $diskstem $cachesize $key 2>&1`;
+  if ($value!~/Lookup failed/) {
+    print "ERROR: LOOKUP $key of a key that was not loaded does not fail\n";
+    $numerr++;
+  }
+}
+
+if ($numerr==0) {
+  print "CONGRATULATIONS - NO ERRORS FOUND!\n";
+} else {
+  print "ERRORS FOUND\n";
+}
@@ -16,9 +16,13 @@ $cachesize=64;
 
 $maxerr=10;
 
-$#ARGV==3 or die "usage: test_me.pl keysize valuesize seed numops\n";
+$#ARGV>=3 or die "usage: test_me.pl keysize valuesize seed numops [blocksize [simoption ...]]\n";
 
-($keysize,$valuesize,$seed,$numops)=@ARGV;
+($keysize,$valuesize,$seed,$numops,$bs,@simopts)=@ARGV;
+
+# e.g. test_me.pl 16 8 1 5000 256 prefix cut sane
+# to check the index after every operation with small blocks
+$blocksize=$bs if defined $bs;
 
 $ENV{PATH}.=":.";
 
@@ -26,7 +30,7 @@ system "deletedisk $diskstem";
 system "makedisk $diskstem $numblocks $blocksize $heads $blockspertrack $tracks $avgseek $trackseek $rotlat";
 
 
-$cmd="test.pl \"ref_impl.pl nodebug 0\" \"sim $diskstem $cachesize\" $keysize $valuesize $seed $numops $maxerr";
+$cmd="test.pl \"ref_impl.pl nodebug 0\" \"sim $diskstem $cachesize @simopts\" $keysize $valuesize $seed $numops $maxerr";
 
 system $cmd;
 
@@ -0,0 +1,63 @@
+#!/usr/bin/perl -w
+
+# Checks splits of interior nodes with prefix compression and suffix
+# truncation on small blocks.  Keys over a two letter alphabet share
+# long prefixes, so the separators passed up are of many lengths and 
+# interior nodes fill up with fewer keys than their slots.  Mostly 
+# inserts, so the tree grows a few levels, and sim checks the index 
+# after every operation.
+
+$diskstem="__split";
+$numblocks=8192;
+$blocksize=256;
+$heads=1;
+$blockspertrack=8192;
+$tracks=1;
+$avgseek=10;
+$trackseek=1;
+$rotlat=10;
+$cachesize=64;
+
+$keysize=16;
+$valuesize=8;
+$keybytes="ab";
+
+$maxerr=10;
+
+$#ARGV>=1 or die "usage: test_split.pl seed numops [simoption ...]\n";
+
+($seed,$numops,@simopts)=@ARGV;
+
+@simopts=("prefix","cut") if !@simopts;
+
+$ENV{PATH}.=":.";
+
+srand $seed;
+
+$t=time();
+$pid=$$;
+
+open(SEQ,">SPLIT.$t.$pid.input");
+print SEQ "INIT $keysize $valuesize\n";
+%content=();
+for ($i=1;$i<$numops;$i++) { 
+  my @keys=sort keys %content;
+  if (@keys && rand()<0.3) { 
+    my $key=$keys[int(rand($#keys+1))];
+    delete $content{$key};
+    print SEQ "DELETE $key\n";
+  } else {
+    my $key=join("", map { substr($keybytes,int(rand(length($keybytes))),1) } (1..$keysize));
+    $content{$key}=1;
+    print SEQ "INSERT $key ".("v" x $valuesize)."\n";
+  }
+}
+print SEQ "DEINIT\n";
+close(SEQ);
+
+system "deletedisk $diskstem";
+system "makedisk $diskstem $numblocks $blocksize $heads $blockspertrack $tracks $avgseek $trackseek $rotlat";
+
+system "ref_impl.pl nodebug 0 < SPLIT.$t.$pid.input > SPLIT.$t.$pid.refout";
+system "sim $diskstem $cachesize @simopts sane < SPLIT.$t.$pid.input > SPLIT.$t.$pid.yourout";
+system "compare.pl SPLIT.$t.$pid.input SPLIT.$t.$pid.refout SPLIT.$t.$pid.yourout $maxerr";
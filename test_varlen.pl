@@ -0,0 +1,73 @@
+#!/usr/bin/perl -w
+
+# Checks slotted pages with keys and values of many lengths on small
+# blocks.  After the index fills, most operations update a key with a
+# value of another length, so values often outgrow what is left of
+# their leaf and the leaf has to split under them.  sim checks the
+# index after every operation.
+
+$diskstem="__varlen";
+$numblocks=8192;
+$blocksize=512;
+$heads=1;
+$blockspertrack=8192;
+$tracks=1;
+$avgseek=10;
+$trackseek=1;
+$rotlat=10;
+$cachesize=64;
+
+$keysize=16;
+$valuesize=32;
+$bytes="abcdefghijklmnopqrstuvwxyz0123456789";
+
+$maxerr=10;
+
+$#ARGV>=1 or die "usage: test_varlen.pl seed numops [simoption ...]\n";
+
+($seed,$numops,@simopts)=@ARGV;
+
+$ENV{PATH}.=":.";
+
+srand $seed;
+
+sub MakeString {
+  my ($maxlength)=@_;
+  return join("", map { substr($bytes,int(rand(length($bytes))),1) } (1..1+int(rand($maxlength))));
+}
+
+$t=time();
+$pid=$$;
+
+open(SEQ,">VARLEN.$t.$pid.input");
+print SEQ "INIT $keysize $valuesize\n";
+%content=();
+for ($i=1;$i<$numops;$i++) {
+  my @keys=keys %content;
+  # mostly inserts for the first quarter, then mostly updates
+  my $r= $i>$numops/4 ? rand() : rand(0.1)+0.85;
+  if (@keys && $r<0.7) {
+    my $key=$keys[int(rand($#keys+1))];
+    $content{$key}=MakeString($valuesize);
+    print SEQ "UPDATE $key $content{$key}\n";
+  } elsif (@keys && $r<0.85) {
+    my $key=$keys[int(rand($#keys+1))];
+    delete $content{$key};
+    print SEQ "DELETE $key\n";
+  } else {
+    my $key=MakeString($keysize);
+    next if defined $content{$key};
+    $content{$key}=MakeString($valuesize);
+    print SEQ "INSERT $key $content{$key}\n";
+  }
+  print SEQ "DISPLAY\n" if $i%500==0;
+}
+print SEQ "DEINIT\n";
+close(SEQ);
+
+system "deletedisk $diskstem";
+system "makedisk $diskstem $numblocks $blocksize $heads $blockspertrack $tracks $avgseek $trackseek $rotlat";
+
+system "ref_impl.pl nodebug 0 < VARLEN.$t.$pid.input > VARLEN.$t.$pid.refout";
+system "sim $diskstem $cachesize varlen scan @simopts sane < VARLEN.$t.$pid.input > VARLEN.$t.$pid.yourout";
+system "compare.pl VARLEN.$t.$pid.input VARLEN.$t.$pid.refout VARLEN.$t.$pid.yourout $maxerr";